@@ -0,0 +1,556 @@
+// 内存池和系统malloc的性能对比
+// make bench.out && ./bench.out [最大线程数] [操作次数倍率]
+// 每个场景在子进程中运行，分别统计吞吐量、延迟分位数和峰值内存
+#include "include/ConcurrentAlloc.hpp"
+using namespace mempool;
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+// 每隔多少次操作记录一次延迟，每次都计时的话计时本身的开销会影响吞吐量
+static const size_t LATENCY_SAMPLE_MASK = 7;
+
+struct SystemMalloc
+{
+	static const char* Name() { return "malloc"; }
+	static void* Alloc(size_t size) { return malloc(size); }
+	static void Free(void* ptr) { free(ptr); }
+};
+
+struct PoolMalloc
+{
+	static const char* Name() { return "mempool"; }
+	static void* Alloc(size_t size) { return ConcurrentAlloc(size); }
+	static void Free(void* ptr) { ConcurrentFree(ptr); }
+};
+
+// 每个线程的计数和延迟采样
+struct Worker
+{
+	size_t _ops = 0;
+	std::vector<unsigned int> _latency; // 纳秒
+
+	template <class A>
+	void* Alloc(size_t size)
+	{
+		void* ptr = nullptr;
+		if ((++_ops & LATENCY_SAMPLE_MASK) != 0)
+		{
+			ptr = A::Alloc(size);
+		}
+		else
+		{
+			Clock::time_point begin = Clock::now();
+			ptr = A::Alloc(size);
+			Record(begin);
+		}
+		// 写一个字节，让内存真正被使用
+		*static_cast<char*>(ptr) = 1;
+		return ptr;
+	}
+
+	template <class A>
+	void Free(void* ptr)
+	{
+		if ((++_ops & LATENCY_SAMPLE_MASK) != 0)
+		{
+			A::Free(ptr);
+			return;
+		}
+		Clock::time_point begin = Clock::now();
+		A::Free(ptr);
+		Record(begin);
+	}
+
+	void Record(Clock::time_point begin)
+	{
+		long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count();
+		if (_latency.size() < _latency.capacity()) // 提前预留好空间，计时期间不扩容
+		{
+			_latency.push_back(static_cast<unsigned int>(ns));
+		}
+	}
+};
+
+// 常见程序中的申请大小分布：大部分是小对象，少量中等和较大的对象
+static size_t RealisticSize(std::mt19937& rng)
+{
+	unsigned int r = rng() % 100;
+	if (r < 60)
+	{
+		return 1 + rng() % 64;
+	}
+	if (r < 85)
+	{
+		return 65 + rng() % (512 - 64);
+	}
+	if (r < 97)
+	{
+		return 513 + rng() % (8 * 1024 - 512);
+	}
+	return 8 * 1024 + 1 + rng() % (64 * 1024 - 8 * 1024);
+}
+
+// 场景1：每个线程独立地批量申请再释放固定的几种大小
+template <class A>
+static void BenchLocal(Worker& w, size_t id, size_t ops)
+{
+	static const size_t sizes[] = {16, 64, 256};
+	const size_t batch = 100;
+	void* ptrs[batch];
+	for (size_t done = 0; done < ops; done += batch * 2)
+	{
+		size_t size = sizes[(done / (batch * 2) + id) % 3];
+		for (size_t i = 0; i < batch; i++)
+		{
+			ptrs[i] = w.Alloc<A>(size);
+		}
+		for (size_t i = 0; i < batch; i++)
+		{
+			w.Free<A>(ptrs[i]);
+		}
+	}
+}
+
+// 场景2：按真实的大小分布随机申请和释放，同时存活的对象数量在一个窗口内
+template <class A>
+static void BenchMixed(Worker& w, size_t id, size_t ops)
+{
+	std::mt19937 rng(static_cast<unsigned int>(id + 1));
+	const size_t window = 1024;
+	std::vector<void*> slots(window, nullptr);
+	for (size_t i = 0; i < ops; i++)
+	{
+		void*& slot = slots[rng() % window];
+		if (slot != nullptr)
+		{
+			w.Free<A>(slot);
+			slot = nullptr;
+		}
+		else
+		{
+			slot = w.Alloc<A>(RealisticSize(rng));
+		}
+	}
+	for (void* ptr : slots)
+	{
+		if (ptr != nullptr)
+		{
+			w.Free<A>(ptr);
+		}
+	}
+}
+
+// 场景4：长短生命周期混合，每16个对象留下一个到最后才释放，其余的很快释放
+template <class A>
+static void BenchLifetime(Worker& w, size_t id, size_t ops)
+{
+	std::mt19937 rng(static_cast<unsigned int>(id + 1));
+	const size_t window = 32;
+	void* shortLived[window] = {nullptr};
+	std::vector<void*> longLived;
+	longLived.reserve(ops / 16 + 1);
+	for (size_t i = 0; i < ops / 2; i++)
+	{
+		void* ptr = w.Alloc<A>(RealisticSize(rng));
+		if (i % 16 == 0)
+		{
+			longLived.push_back(ptr);
+			continue;
+		}
+		void*& slot = shortLived[i % window];
+		if (slot != nullptr)
+		{
+			w.Free<A>(slot);
+		}
+		slot = ptr;
+	}
+	for (void* ptr : shortLived)
+	{
+		if (ptr != nullptr)
+		{
+			w.Free<A>(ptr);
+		}
+	}
+	for (void* ptr : longLived)
+	{
+		w.Free<A>(ptr);
+	}
+}
+
+// 场景5：超过256KB的大块内存，最多同时存活8个
+template <class A>
+static void BenchLarge(Worker& w, size_t id, size_t ops)
+{
+	std::mt19937 rng(static_cast<unsigned int>(id + 1));
+	const size_t window = 8;
+	void* slots[window] = {nullptr};
+	for (size_t i = 0; i < ops / 2; i++)
+	{
+		void*& slot = slots[i % window];
+		if (slot != nullptr)
+		{
+			w.Free<A>(slot);
+		}
+		slot = w.Alloc<A>(MAX_SIZE + 1 + rng() % (4 * 1024 * 1024 - MAX_SIZE));
+	}
+	for (void* ptr : slots)
+	{
+		if (ptr != nullptr)
+		{
+			w.Free<A>(ptr);
+		}
+	}
+}
+
+// 场景6：页级别的碎片化负载，小对象、几十页的span和超过1MB的大块内存随机交错申请释放
+// 空闲的span大小各不相同，PageCache需要经常查找、拆分和复用
+template <class A>
+static void BenchFragment(Worker& w, size_t id, size_t ops)
+{
+	std::mt19937 rng(static_cast<unsigned int>(id + 1));
+	const size_t window = 256;
+	void* slots[window] = {nullptr};
+	for (size_t i = 0; i < ops; i++)
+	{
+		void*& slot = slots[rng() % window];
+		if (slot != nullptr)
+		{
+			w.Free<A>(slot);
+			slot = nullptr;
+			continue;
+		}
+		unsigned int r = rng() % 100;
+		size_t size = 0;
+		if (r < 50)
+		{
+			size = RealisticSize(rng);
+		}
+		else if (r < 85)
+		{
+			size = MAX_SIZE + 1 + rng() % (1024 * 1024 - MAX_SIZE); // 32到128页
+		}
+		else
+		{
+			size = 1024 * 1024 + rng() % (7 * 1024 * 1024); // 超过128页
+		}
+		slot = w.Alloc<A>(size);
+	}
+	for (void* ptr : slots)
+	{
+		if (ptr != nullptr)
+		{
+			w.Free<A>(ptr);
+		}
+	}
+}
+
+// 场景3中生产者到消费者的单生产者单消费者队列
+struct Channel
+{
+	static const size_t CAPACITY = 4096;
+	void* _buf[CAPACITY];
+	std::atomic<size_t> _head{0}; // 消费者读取的位置
+	std::atomic<size_t> _tail{0}; // 生产者写入的位置
+
+	void Push(void* ptr)
+	{
+		size_t tail = _tail.load(std::memory_order_relaxed);
+		while (tail - _head.load(std::memory_order_acquire) == CAPACITY)
+		{
+			std::this_thread::yield();
+		}
+		_buf[tail % CAPACITY] = ptr;
+		_tail.store(tail + 1, std::memory_order_release);
+	}
+
+	void* Pop()
+	{
+		size_t head = _head.load(std::memory_order_relaxed);
+		while (_tail.load(std::memory_order_acquire) == head)
+		{
+			std::this_thread::yield();
+		}
+		void* ptr = _buf[head % CAPACITY];
+		_head.store(head + 1, std::memory_order_release);
+		return ptr;
+	}
+};
+
+// 场景3：生产者线程申请，消费者线程释放，线程两两配对
+template <class A>
+static void BenchProdCons(Worker& w, size_t id, size_t ops, std::vector<Channel>& channels)
+{
+	Channel& channel = channels[id / 2];
+	size_t objs = ops / 2;
+	if (id % 2 == 0)
+	{
+		std::mt19937 rng(static_cast<unsigned int>(id + 1));
+		for (size_t i = 0; i < objs; i++)
+		{
+			channel.Push(w.Alloc<A>(RealisticSize(rng)));
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < objs; i++)
+		{
+			w.Free<A>(channel.Pop());
+		}
+	}
+}
+
+struct BenchCase
+{
+	const char* _name;
+	size_t _ops; // 每个线程的操作次数（申请和释放各算一次）
+};
+
+static const BenchCase benchCases[] = {
+	{"local", 2000000},
+	{"mixed", 2000000},
+	{"prodcons", 1000000},
+	{"lifetime", 1000000},
+	{"large", 20000},
+	{"fragment", 200000},
+};
+
+struct BenchResult
+{
+	size_t _ops = 0;
+	double _seconds = 0;
+	unsigned int _p50 = 0;
+	unsigned int _p99 = 0;
+	unsigned int _p999 = 0;
+	size_t _peakRssKB = 0;
+};
+
+static size_t PeakRssKB()
+{
+#ifdef __linux__
+	// VmHWM可以通过clear_refs重置，只统计这个场景
+	FILE* fp = fopen("/proc/self/status", "r");
+	if (fp != nullptr)
+	{
+		char line[256];
+		size_t kb = 0;
+		while (fgets(line, sizeof(line), fp) != nullptr)
+		{
+			if (sscanf(line, "VmHWM: %zu kB", &kb) == 1)
+			{
+				break;
+			}
+		}
+		fclose(fp);
+		if (kb != 0)
+		{
+			return kb;
+		}
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+#else
+	return 0;
+#endif
+}
+
+static void ResetPeakRss()
+{
+#ifdef __linux__
+	FILE* fp = fopen("/proc/self/clear_refs", "w");
+	if (fp != nullptr)
+	{
+		fputs("5", fp);
+		fclose(fp);
+	}
+#endif
+}
+
+template <class A>
+static void RunCase(size_t caseIndex, size_t threads, size_t ops, BenchResult& result)
+{
+	std::vector<Worker> workers(threads);
+	std::vector<Channel> channels(caseIndex == 2 ? threads / 2 : 0);
+	std::atomic<size_t> ready{0};
+	std::atomic<bool> go{false};
+
+	auto run = [&](size_t id) {
+		Worker& w = workers[id];
+		w._latency.reserve(ops / (LATENCY_SAMPLE_MASK + 1) + 1);
+		ready++;
+		while (!go.load(std::memory_order_acquire))
+		{
+			std::this_thread::yield();
+		}
+		switch (caseIndex)
+		{
+		case 0:
+			BenchLocal<A>(w, id, ops);
+			break;
+		case 1:
+			BenchMixed<A>(w, id, ops);
+			break;
+		case 2:
+			BenchProdCons<A>(w, id, ops, channels);
+			break;
+		case 3:
+			BenchLifetime<A>(w, id, ops);
+			break;
+		case 4:
+			BenchLarge<A>(w, id, ops);
+			break;
+		default:
+			BenchFragment<A>(w, id, ops);
+			break;
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (size_t i = 0; i < threads; i++)
+	{
+		pool.emplace_back(run, i);
+	}
+	while (ready.load() != threads)
+	{
+		std::this_thread::yield();
+	}
+	ResetPeakRss();
+	Clock::time_point begin = Clock::now();
+	go.store(true, std::memory_order_release);
+	for (std::thread& t : pool)
+	{
+		t.join();
+	}
+	result._seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+	result._peakRssKB = PeakRssKB();
+
+	std::vector<unsigned int> latency;
+	for (Worker& w : workers)
+	{
+		result._ops += w._ops;
+		latency.insert(latency.end(), w._latency.begin(), w._latency.end());
+	}
+	if (!latency.empty())
+	{
+		std::sort(latency.begin(), latency.end());
+		result._p50 = latency[latency.size() * 50 / 100];
+		result._p99 = latency[latency.size() * 99 / 100];
+		result._p999 = latency[latency.size() * 999 / 1000];
+	}
+}
+
+// 在子进程中运行，结果通过管道传回来，这样每个场景的峰值内存互不影响
+template <class A>
+static bool RunIsolated(size_t caseIndex, size_t threads, size_t ops, BenchResult& result)
+{
+#ifdef __linux__
+	int fds[2];
+	if (pipe(fds) != 0)
+	{
+		return false;
+	}
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(fds[0]);
+		BenchResult child;
+		RunCase<A>(caseIndex, threads, ops, child);
+		ssize_t n = write(fds[1], &child, sizeof(child));
+		_exit(n == sizeof(child) ? 0 : 1);
+	}
+	close(fds[1]);
+	ssize_t n = pid > 0 ? read(fds[0], &result, sizeof(result)) : -1;
+	close(fds[0]);
+	int status = 0;
+	if (pid > 0)
+	{
+		waitpid(pid, &status, 0);
+	}
+	return n == sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+	RunCase<A>(caseIndex, threads, ops, result);
+	return true;
+#endif
+}
+
+template <class A>
+static void Report(size_t caseIndex, size_t threads, size_t ops)
+{
+	BenchResult r;
+	if (!RunIsolated<A>(caseIndex, threads, ops, r))
+	{
+		printf("%-9s %-8s %7zu  failed\n", benchCases[caseIndex]._name, A::Name(), threads);
+		return;
+	}
+	printf("%-9s %-8s %7zu %12.2f %8u %8u %8u %10.1f\n", benchCases[caseIndex]._name, A::Name(), threads,
+		   r._ops / r._seconds / 1e6, r._p50, r._p99, r._p999, r._peakRssKB / 1024.0);
+	fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+	size_t maxThreads = std::thread::hardware_concurrency();
+	maxThreads = maxThreads < 4 ? 4 : maxThreads;
+	double scale = 1.0;
+	if (argc > 1)
+	{
+		maxThreads = strtoul(argv[1], nullptr, 10);
+	}
+	if (argc > 2)
+	{
+		scale = atof(argv[2]);
+	}
+	if (maxThreads == 0 || scale <= 0)
+	{
+		printf("usage: %s [max threads] [ops scale]\n", argv[0]);
+		return 1;
+	}
+
+	// 1, 2, 4, ...，最后一轮正好是最大线程数
+	std::vector<size_t> threadCounts;
+	for (size_t threads = 1; threads < maxThreads; threads *= 2)
+	{
+		threadCounts.push_back(threads);
+	}
+	threadCounts.push_back(maxThreads);
+
+	printf("case      alloc    threads  Mops/s(sum)  p50(ns)  p99(ns) p999(ns)  peakRSS(MB)\n");
+	for (size_t c = 0; c < sizeof(benchCases) / sizeof(benchCases[0]); c++)
+	{
+		size_t ops = static_cast<size_t>(benchCases[c]._ops * scale);
+		ops = ops < 2 ? 2 : ops;
+		size_t last = 0;
+		for (size_t threads : threadCounts)
+		{
+			// 生产者消费者需要成对的线程
+			if (c == 2)
+			{
+				threads = threads < 2 ? 2 : threads & ~static_cast<size_t>(1);
+			}
+			if (threads == last)
+			{
+				continue;
+			}
+			last = threads;
+			Report<SystemMalloc>(c, threads, ops);
+			Report<PoolMalloc>(c, threads, ops);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,125 @@
+// 长时间运行的页级碎片测试
+// make fragbench.out && ./fragbench.out [操作次数] [输出次数]
+// 随机申请释放不同页数的内存，定期输出PageCache中空闲span的数量和大小的变化
+// span能够正确合并的话，空闲span的数量会稳定下来，最大的空闲span也不会越来越小
+#include "include/ConcurrentAlloc.hpp"
+using namespace mempool;
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <random>
+#include <chrono>
+
+struct Block
+{
+	void* _ptr = nullptr;
+	size_t _size = 0;
+};
+
+// 大部分是小对象，也有几页到几百页的span，超过128页的会进入_largeSpans
+static size_t RandomSize(std::mt19937& rng)
+{
+	unsigned int r = rng() % 100;
+	if (r < 60)
+	{
+		return 1 + rng() % 1024;
+	}
+	if (r < 80)
+	{
+		return 1025 + rng() % (MAX_SIZE - 1024);
+	}
+	if (r < 97)
+	{
+		return MAX_SIZE + 1 + rng() % (1024 * 1024 - MAX_SIZE); // 32到128页
+	}
+	return 1024 * 1024 + rng() % (1024 * 1024); // 128到256页
+}
+
+int main(int argc, char* argv[])
+{
+	size_t ops = 5000000;
+	size_t reports = 20;
+	if (argc > 1)
+	{
+		ops = strtoul(argv[1], nullptr, 10);
+	}
+	if (argc > 2)
+	{
+		reports = strtoul(argv[2], nullptr, 10);
+	}
+	if (ops == 0 || reports == 0)
+	{
+		printf("usage: %s [ops] [reports]\n", argv[0]);
+		return 1;
+	}
+	const size_t interval = ops / reports == 0 ? 1 : ops / reports;
+
+	std::mt19937 rng(1);
+	// 短生命周期的对象随机替换，长生命周期的对象很少替换，会把空闲的页隔开
+	std::vector<Block> shortLived(4096);
+	std::vector<Block> longLived(512);
+	size_t liveBytes = 0;
+
+	auto replace = [&](Block& block) {
+		if (block._ptr != nullptr)
+		{
+			ConcurrentFree(block._ptr);
+			liveBytes -= block._size;
+			block._ptr = nullptr;
+			return;
+		}
+		block._size = RandomSize(rng);
+		block._ptr = ConcurrentAlloc(block._size);
+		*static_cast<char*>(block._ptr) = 1;
+		liveBytes += block._size;
+	};
+
+	printf("%10s %10s %10s %10s %10s %12s %12s %8s\n", "ops", "live(MB)", "mapped(MB)", "free spans",
+		   "free(MB)", "largest(KB)", "avg free(KB)", "large");
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (size_t i = 1; i <= ops; i++)
+	{
+		if (rng() % 64 == 0)
+		{
+			replace(longLived[rng() % longLived.size()]);
+		}
+		else
+		{
+			replace(shortLived[rng() % shortLived.size()]);
+		}
+
+		if (i % interval == 0 || i == ops)
+		{
+			FreeSpanStats stats;
+			PageCache::GetInstance()->GetFreeSpanStats(stats);
+			size_t avgKB = stats._spans == 0 ? 0 : (stats._pages << PAGE_SHIFT) / stats._spans / 1024;
+			printf("%10zu %10.1f %10.1f %10zu %10.1f %12zu %12zu %8zu\n", i, liveBytes / 1048576.0,
+				   systemMappedBytes.load() / 1048576.0, stats._spans, (stats._pages << PAGE_SHIFT) / 1048576.0,
+				   (stats._largestPages << PAGE_SHIFT) / 1024, avgKB, stats._largeSpans);
+			fflush(stdout);
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	for (Block& block : shortLived)
+	{
+		if (block._ptr != nullptr)
+		{
+			ConcurrentFree(block._ptr);
+		}
+	}
+	for (Block& block : longLived)
+	{
+		if (block._ptr != nullptr)
+		{
+			ConcurrentFree(block._ptr);
+		}
+	}
+	FreeSpanStats stats;
+	PageCache::GetInstance()->GetFreeSpanStats(stats);
+	printf("%.2f Mops/s, after freeing everything: %zu free spans, largest %zu KB, coalesced: %s\n",
+		   ops / seconds / 1e6, stats._spans, (stats._largestPages << PAGE_SHIFT) / 1024,
+		   PageCache::GetInstance()->CheckFreeSpans() ? "yes" : "no");
+	return 0;
+}
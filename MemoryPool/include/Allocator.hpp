@@ -0,0 +1,78 @@
+#pragma once
+// STL容器使用内存池的适配器
+#include "ConcurrentAlloc.hpp"
+#include <new>
+#include <memory_resource>
+
+namespace mempool
+{
+	// 标准分配器，std::vector<int, mempool::Allocator<int>>
+	// 释放时容器会传入元素个数，小对象直接按大小找到桶，不需要通过页号查询span
+	template <class T>
+	class Allocator
+	{
+	public:
+		typedef T value_type;
+
+		Allocator() noexcept = default;
+		template <class U>
+		Allocator(const Allocator<U>&) noexcept {}
+
+		T* allocate(size_t n)
+		{
+			if (n > static_cast<size_t>(-1) / sizeof(T))
+			{
+				throw std::bad_array_new_length();
+			}
+			return static_cast<T*>(ConcurrentAlignedAlloc(n * sizeof(T), alignof(T)));
+		}
+
+		void deallocate(T* ptr, size_t n) noexcept
+		{
+			ConcurrentAlignedFree(ptr, n * sizeof(T), alignof(T));
+		}
+
+		// 没有状态，任何两个分配器申请的内存都可以互相释放
+		template <class U>
+		bool operator==(const Allocator<U>&) const noexcept
+		{
+			return true;
+		}
+		template <class U>
+		bool operator!=(const Allocator<U>&) const noexcept
+		{
+			return false;
+		}
+	};
+
+	// std::pmr容器使用的内存资源，std::pmr::vector<int> v(mempool::MemoryResource::GetInstance())
+	// 按alignment对齐申请，释放时pmr会传回申请时的大小和对齐，同样走带大小的释放
+	class MemoryResource : public std::pmr::memory_resource
+	{
+	public:
+		// 程序退出时不析构，全局的pmr容器可能析构得更晚
+		static MemoryResource* GetInstance()
+		{
+			alignas(MemoryResource) static unsigned char buf[sizeof(MemoryResource)];
+			static MemoryResource* instance = new(buf) MemoryResource;
+			return instance;
+		}
+
+	protected:
+		void* do_allocate(size_t bytes, size_t alignment) override
+		{
+			return ConcurrentAlignedAlloc(bytes, alignment);
+		}
+
+		void do_deallocate(void* ptr, size_t bytes, size_t alignment) override
+		{
+			ConcurrentAlignedFree(ptr, bytes, alignment);
+		}
+
+		// 所有MemoryResource都共用同一个内存池
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+		{
+			return dynamic_cast<const MemoryResource*>(&other) != nullptr;
+		}
+	};
+}
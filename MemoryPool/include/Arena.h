@@ -0,0 +1,139 @@
+#pragma once
+// 一起释放的对象使用的区域分配器
+#include "Utils.hpp"
+#include "Span.hpp"
+#include <new>
+#include <memory_resource>
+
+namespace mempool
+{
+	static const size_t ARENA_MIN_PAGES = 1;	// 第一个span的页数
+	static const size_t ARENA_MAX_PAGES = 128;	// 每次增长最多申请的页数，更大的申请单独一个span
+	static const size_t ARENA_KEEP_PAGES = 128; // Reset之后最多保留多少页
+
+	// 从PageCache拿span，在span里面按指针递增地切内存，单个对象不释放
+	// Reset或者析构的时候一次性把所有span还回去，适合一个请求里申请、请求结束时一起释放的对象
+	// Reset会保留一个span，大小按这一轮用掉的内存决定，同样的请求下一轮不需要再访问PageCache
+	// 不是线程安全的，每个请求或者每个线程使用自己的Arena
+	class Arena : public std::pmr::memory_resource
+	{
+	public:
+		Arena() = default;
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+		~Arena();
+
+		// 申请bytes字节，按align对齐，align必须是2的幂
+		void* Allocate(size_t bytes, size_t align = alignof(std::max_align_t))
+		{
+			assert(align != 0 && (align & (align - 1)) == 0);
+			size_t ptr = (_ptr + align - 1) & ~(align - 1);
+			if (bytes == 0 || ptr > _end || bytes > _end - ptr)
+			{
+				return AllocateSlow(bytes, align);
+			}
+			_ptr = ptr + bytes;
+			_allocated += bytes;
+			return reinterpret_cast<void*>(ptr);
+		}
+
+		// 一次性释放所有对象，只保留一个span
+		void Reset();
+
+		// 上次Reset之后申请的字节数
+		size_t GetAllocatedBytes() const
+		{
+			return _allocated;
+		}
+		// 每一轮申请的字节数的最大值，包括当前这一轮
+		size_t GetHighWaterMark() const
+		{
+			return _allocated > _highWater ? _allocated : _highWater;
+		}
+		// 当前持有的span的字节数和数量
+		size_t GetReservedBytes() const
+		{
+			return _reserved;
+		}
+		size_t GetSpanCount() const
+		{
+			return _spanCount;
+		}
+
+	protected:
+		// pmr容器使用：单个对象的释放什么都不做
+		void* do_allocate(size_t bytes, size_t alignment) override
+		{
+			return Allocate(bytes, alignment);
+		}
+		void do_deallocate(void*, size_t, size_t) override {}
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+		{
+			return this == &other;
+		}
+
+	private:
+		// 当前span放不下的时候申请一个新的span
+		void* AllocateSlow(size_t bytes, size_t align);
+		// 从当前线程所在节点的PageCache申请k页，挂到span链表的头部
+		Span* NewSpan(size_t k);
+		// 把span还给所属的PageCache
+		static void ReleaseSpan(Span* span);
+
+		Span* _spans = nullptr; // 持有的span，通过_next链接，第一个是正在切的
+		size_t _ptr = 0;		// 当前span中下一个可用的位置
+		size_t _end = 0;		// 当前span的结束位置
+		size_t _nextPages = ARENA_MIN_PAGES; // 下一次增长申请的页数，每次翻倍
+
+		size_t _allocated = 0;
+		size_t _highWater = 0;
+		size_t _reserved = 0;
+		size_t _spanCount = 0;
+	};
+
+	// 标准分配器接口，std::vector<int, ArenaAllocator<int>> v(ArenaAllocator<int>(&arena))
+	template <class T>
+	class ArenaAllocator
+	{
+	public:
+		typedef T value_type;
+
+		explicit ArenaAllocator(Arena* arena) noexcept
+			: _arena(arena)
+		{}
+		template <class U>
+		ArenaAllocator(const ArenaAllocator<U>& other) noexcept
+			: _arena(other.GetArena())
+		{}
+
+		T* allocate(size_t n)
+		{
+			if (n > static_cast<size_t>(-1) / sizeof(T))
+			{
+				throw std::bad_array_new_length();
+			}
+			return static_cast<T*>(_arena->Allocate(n * sizeof(T), alignof(T)));
+		}
+
+		void deallocate(T*, size_t) noexcept {}
+
+		Arena* GetArena() const noexcept
+		{
+			return _arena;
+		}
+
+		template <class U>
+		bool operator==(const ArenaAllocator<U>& other) const noexcept
+		{
+			return _arena == other.GetArena();
+		}
+		template <class U>
+		bool operator!=(const ArenaAllocator<U>& other) const noexcept
+		{
+			return _arena != other.GetArena();
+		}
+
+	private:
+		Arena* _arena;
+	};
+}
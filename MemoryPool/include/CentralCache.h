@@ -1,9 +1,134 @@
 #pragma once
 #include "Utils.hpp"
 #include "Span.hpp"
+#include "TransferCache.h"
 
 namespace mempool
 {
+	// 中心缓存一个桶当前的状态
+	struct CentralBucketStats
+	{
+		size_t _spans = 0;		   // 桶中的span数量，也就是从PageCache拿来正在使用的span
+		size_t _spanFreeBytes = 0; // span中没有分配出去的字节数，包括末尾切不出对象的部分
+		size_t _transferBytes = 0; // 传输缓存中的对象字节数
+		// 按使用率分档的span数量，第i档是已分配对象占[i/8, (i+1)/8)的span，最后一个是已经分配完的span
+		size_t _occupancy[NUM_OCCUPANCY_BINS + 1] = {};
+	};
+
+	// 一个节点的span按使用率分档的链表，最后一个是已经分配完的span
+	struct CentralBins
+	{
+		SpanList _bins[NUM_OCCUPANCY_BINS + 1];
+	};
+
+	// 中心缓存的一个桶，span按已经分配出去的对象比例放在不同的链表中
+	// 分配时先用最满的span，快空的span就有机会全部回收，还给PageCache
+	// 全部回收的span会马上还给PageCache，所以没有空span的链表
+	// 每个NUMA节点的span各自一组链表，线程只从自己节点的span中拿对象，共用一把桶锁
+	class CentralBucket
+	{
+	public:
+		static const size_t FULL_BIN = NUM_OCCUPANCY_BINS; // 对象都分配出去了的span
+
+		CentralBucket()
+		{
+			_nodeBins[0] = &_localBins;
+		}
+		CentralBucket(const CentralBucket&) = delete;
+		CentralBucket& operator=(const CentralBucket&) = delete;
+
+		void Lock()
+		{
+			_mtx.lock();
+		}
+		void Unlock()
+		{
+			_mtx.unlock();
+		}
+		bool TryLock()
+		{
+			return _mtx.try_lock();
+		}
+
+		// span按当前的使用情况应该放在哪个链表
+		static size_t BinOf(Span* span)
+		{
+			if (span->_list == nullptr && span->_carve == span->_carveEnd)
+			{
+				return FULL_BIN;
+			}
+			return span->_useCount * NUM_OCCUPANCY_BINS / span->_capacity;
+		}
+
+		// 下面的函数都需要持有桶锁
+		void Insert(Span* span)
+		{
+			span->_bin = BinOf(span);
+			BinsOf(span)._bins[span->_bin].PushFront(span);
+		}
+		void Erase(Span* span)
+		{
+			BinsOf(span)._bins[span->_bin].Erase(span);
+		}
+		// span分配或者回收了对象之后调用，换了档才需要移动
+		void Update(Span* span)
+		{
+			size_t bin = BinOf(span);
+			if (bin != span->_bin)
+			{
+				CentralBins& bins = BinsOf(span);
+				bins._bins[span->_bin].Erase(span);
+				span->_bin = bin;
+				bins._bins[bin].PushFront(span);
+			}
+		}
+		// node节点上使用率最高的、还有对象可以分配的span，没有返回nullptr
+		// 不用其他节点的span，对象的物理内存和使用它的线程在同一个节点上
+		Span* FullestPartial(size_t node)
+		{
+			CentralBins* bins = _nodeBins[node];
+			if (bins == nullptr)
+			{
+				return nullptr;
+			}
+			for (size_t i = NUM_OCCUPANCY_BINS; i-- > 0;)
+			{
+				if (!bins->_bins[i].Empty())
+				{
+					return bins->_bins[i].Begin();
+				}
+			}
+			return nullptr;
+		}
+		// node节点的第bin档链表，这个节点还没有span的时候返回nullptr
+		SpanList* Bin(size_t node, size_t bin)
+		{
+			return _nodeBins[node] == nullptr ? nullptr : &_nodeBins[node]->_bins[bin];
+		}
+
+		// 有其他线程还回来的对象的span，无锁地入栈，持有桶锁时整个取出来合并
+		// 只需要处理这些span，不用遍历已经分配完的span
+		std::atomic<Span*> _remoteSpans{nullptr};
+
+	private:
+		// span所属节点的链表，其他节点第一次有span时才创建
+		CentralBins& BinsOf(Span* span)
+		{
+			size_t node = span->_node.load(std::memory_order_relaxed);
+			if (_nodeBins[node] == nullptr)
+			{
+				_nodeBins[node] = NewBins();
+			}
+			return *_nodeBins[node];
+		}
+		// 从定长内存池中申请一组链表，只在持有桶锁时调用
+		static CentralBins* NewBins();
+
+		std::mutex _mtx; // 桶锁
+		CentralBins _localBins; // 节点0的链表，单节点的机器上只用这一组
+		CentralBins* _nodeBins[MAX_NUMA_NODES] = {};
+	};
+
 	// 中心缓存采用单例模式设计
 	class CentralCache
 	{
@@ -15,21 +140,76 @@ namespace mempool
 			return &_sInstance;
 		}
 
-		// 获取一个非空的span
-		Span* GetOneSpan(SpanListLock& list, size_t bytes);
+		// 获取一个node节点上的非空span
+		Span* GetOneSpan(CentralBucket& bucket, size_t bytes, size_t node);
 
 		// 从中心缓存获取一定数量的对象给ThreadCache
 		// start/end是链表指针的输出型参数
 		// 返回值是最终给了多少个bytes大小的内存
 		size_t FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t bytes);
 
+		// 回收ThreadCache中的一批对象，优先放进传输缓存，放不下再还给span
+		void ReleaseRangeObj(void* start, void* end, size_t n, size_t bytes);
+
 		// 回收ThreadCache中的list
 		void ReleaseListToSpans(void* start, size_t bytes);
+
+		// 获取所有桶的传输缓存的命中情况
+		TransferCacheStats GetTransferCacheStats();
+
+		// 把node节点的传输缓存中上次调用以来一直没有用到的对象还给span
+		void ReleaseIdleTransfer(size_t node);
+
+		// 获取一个桶当前的状态，内部加桶锁
+		void GetBucketStats(size_t index, CentralBucketStats& stats);
+
+		// 不属于当前线程的对象，无锁地挂到span的远程释放队列中
+		void RemoteFree(Span* span, void* obj);
+
+		// 持有/释放所有桶锁和传输缓存的锁，用于fork前后
+		void LockAll();
+		void UnlockAll();
 	private:
-		SpanListLock _spanList[NUM_FREELIST];
+		// 把span的远程释放队列合并到span的_list中，需要持有桶锁
+		// 返回合并之后span是否可以还给PageCache
+		bool DrainRemoteList(Span* span);
+
+		// 把span放进桶的待合并栈，不需要桶锁
+		void PushRemoteSpan(CentralBucket& bucket, Span* span);
+
+		// 合并待合并栈中所有span的远程释放队列，需要持有桶锁
+		void DrainRemoteSpans(CentralBucket& bucket);
+
+		// span的对象全部回收，并且不在待合并栈中，可以还给PageCache
+		static bool Releasable(Span* span)
+		{
+			return span->_useCount == 0 && !span->_remotePending.load(std::memory_order_acquire);
+		}
+
+		// span全部回收后还给PageCache，调用前持有桶锁，函数内部会临时解开
+		void ReleaseSpanToPageCache(CentralBucket& bucket, Span* span);
+
+		// node节点的传输缓存，每个桶一个
+		TransferCache* TransferCaches(size_t node)
+		{
+			TransferCache* caches = _nodeTransfer[node].load(std::memory_order_acquire);
+			return caches != nullptr ? caches : NewTransferCaches(node);
+		}
+		// 其他节点第一次用到时直接向系统申请一组传输缓存
+		TransferCache* NewTransferCaches(size_t node);
+
+		CentralBucket _spanList[NUM_FREELIST];
+		// 节点0的传输缓存，单节点的机器上只用这一组
+		// 线程把释放的对象放进自己节点的传输缓存，申请时也只从自己节点的拿
+		TransferCache _transferCache[NUM_FREELIST];
+		std::atomic<TransferCache*> _nodeTransfer[MAX_NUMA_NODES] = {};
+		std::mutex _nodeMtx; // 创建其他节点的传输缓存时加锁
 
 		// 默认构造函数和拷贝构造函数都私有
-		CentralCache(){}
+		CentralCache()
+		{
+			_nodeTransfer[0].store(_transferCache, std::memory_order_relaxed);
+		}
 		CentralCache(const CentralCache&) = delete;
 		CentralCache& operator=(const CentralCache&) = delete;
 	};
@@ -1,53 +1,289 @@
 #pragma once
+#include <cstring>
 #include "Utils.hpp"
 #include "PageCache.h"
 #include "ThreadCache.h"
+#include "CentralCache.h"
+#include "MallocExtension.h"
+#include "HeapProfiler.h"
+#include "GuardedPageAllocator.h"
+#ifdef MEMPOOL_PERCPU
+#include "CpuCache.h"
+#endif
 
 namespace mempool
 {
 	static void* ConcurrentAlloc(size_t size)
 	{
+		// 按字节数倒计时采样，被采样的对象单独占用一个span
+		if (HeapProfiler::ShouldSample(size))
+		{
+			return HeapProfiler::SampledAlloc(size);
+		}
+		// 按申请次数倒计时，少量对象放到前后都是保护页的槽中，没有空闲的槽时照常申请
+		if (GuardedPageAllocator::ShouldGuard())
+		{
+			void* ptr = GuardedPageAllocator::Allocate(size);
+			if (ptr != nullptr)
+			{
+				return ptr;
+			}
+		}
+
 		if (size > MAX_SIZE)
 		{
 			size_t alignSize = SizeClass::RoundUp(size);
 			size_t kpage = alignSize >> PAGE_SHIFT;
 
-			PageCache::GetInstance()->Lock();
-			Span* span = PageCache::GetInstance()->NewSpan(kpage);
+			PageCache* pageCache = PageCache::GetInstance();
+			pageCache->Lock();
+			Span* span = pageCache->NewSpan(kpage);
 			span->_objSize = size; // 对于大块内存而言是没有拆分的，这里必须要设置一下大小
-			PageCache::GetInstance()->Unlock();
+			pageCache->Unlock();
+			CurrentThreadStats()->RecordLarge(kpage << PAGE_SHIFT);
 
 			void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
 			return ptr;
 		}
 		else
 		{
+			CurrentThreadStats()->RecordAlloc(SizeClass::Index(size), size);
+#ifdef MEMPOOL_PERCPU
+			// per-CPU模式下使用当前CPU的缓存，rseq不可用的时候退回到TLSThreadCache
+			if (CpuCache::GetInstance()->IsActive())
+			{
+				return CpuCache::GetInstance()->Allocate(size);
+			}
+#endif
 			// 通过TLS 每个线程无锁的获取自己的专属的ThreadCache对象
 			if (TLSThreadCache == nullptr)
 			{
-				static FixedMemoryPool<ThreadCache> tcPool; // 这里的static变量是全局可见的
-				TLSThreadCache = tcPool.New();
+				// 线程退出时会自动把ThreadCache还回去
+				TLSThreadCache = ThreadCache::Create();
 			}
 
 			return TLSThreadCache->Allocate(size);
 		}
 	}
 
+	// 按align字节对齐申请内存，align必须是2的幂，使用不带size的ConcurrentFree或者ConcurrentAlignedFree释放
+	// 对齐申请的大小和桶的映射与ConcurrentAlloc不同，不能直接用带size的ConcurrentFree
+	static void* ConcurrentAlignedAlloc(size_t size, size_t align)
+	{
+		assert(align != 0 && (align & (align - 1)) == 0);
+		if (size == 0)
+		{
+			size = 1;
+		}
+		if (align <= sizeof(void*))
+		{
+			return ConcurrentAlloc(size);
+		}
+		if (align <= (1 << PAGE_SHIFT))
+		{
+			// 每个区间的对齐粒度都是2的幂，大小取整到align的倍数后，所在的桶大小仍然是align的倍数
+			// span的起始地址按页对齐，按桶大小切出来的每个对象也就都是对齐的，不需要额外多申请
+			// 超过MAX_SIZE的会直接拿到按页对齐的span
+			return ConcurrentAlloc(SizeClass::_RoundUp(size, align));
+		}
+
+		// 超过一页的对齐，由PageCache把span放在对齐的页号上
+		size_t kpage = SizeClass::_RoundUp(size, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+		PageCache* pageCache = PageCache::GetInstance();
+		pageCache->Lock();
+		Span* span = pageCache->NewAlignedSpan(kpage, align >> PAGE_SHIFT);
+		// 整个span都给这一个对象，大小按大块内存标记，释放时直接还给PageCache
+		span->_objSize = size > MAX_SIZE ? size : MAX_SIZE + 1;
+		pageCache->Unlock();
+		CurrentThreadStats()->RecordLarge(kpage << PAGE_SHIFT);
+
+		return (void*)(span->_pageId << PAGE_SHIFT);
+	}
+
 	static void ConcurrentFree(void* ptr)
 	{
-		Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+		Span* span = PageCache::MapObjectToSpan(ptr);
 		size_t size = span->_objSize;
 
 		if (size > MAX_SIZE)
 		{
-			PageCache::GetInstance()->Lock();
-			PageCache::GetInstance()->ReleaseSpanToPageCache(span);
-			PageCache::GetInstance()->Unlock();
+			if (span->_guard != nullptr)
+			{
+				GuardedPageAllocator::Deallocate(ptr, span);
+				return;
+			}
+			if (span->_sample != nullptr)
+			{
+				HeapProfiler::SampledFree(span);
+			}
+			CurrentThreadStats()->RecordLarge(-static_cast<long long>(span->_n << PAGE_SHIFT));
+			// 还给申请这个span的节点，不一定是当前线程所在的节点
+			PageCache* pageCache = PageCache::GetInstance(span->_node);
+			pageCache->Lock();
+			pageCache->ReleaseSpanToPageCache(span);
+			pageCache->Unlock();
+			return;
+		}
+
+		size_t index = SizeClass::Index(size);
+		ThreadStats* stats = CurrentThreadStats();
+		stats->RecordFree(index);
+#ifdef MEMPOOL_PERCPU
+		if (CpuCache::GetInstance()->IsActive())
+		{
+			// per-CPU缓存不区分线程，直接放回当前CPU的slab
+			CpuCache::GetInstance()->Deallocate(ptr, size);
 		}
 		else
+#endif
+		if (TLSThreadCache != nullptr && TLSThreadCache->IsAllocating(size))
+		{
+			TLSThreadCache->Deallocate(ptr, size);
+		}
+		else
+		{
+			// 跨线程释放（或者当前线程没有ThreadCache），无锁地还给span
+			stats->RecordReturn(index, 1);
+			CentralCache::GetInstance()->RemoteFree(span, ptr);
+		}
+	}
+
+	// 调用方已知对象大小时的释放接口
+	// 小对象直接根据size计算桶的位置，不需要再通过页号查询span
+	static void ConcurrentFree(void* ptr, size_t size)
+	{
+		// 被采样的小对象不在size对应的桶里，开启过采样之后只能通过span判断
+		if (heapSamplingUsed.load(std::memory_order_relaxed))
 		{
-			assert(TLSThreadCache);
+			ConcurrentFree(ptr);
+			return;
+		}
+#ifdef MEMPOOL_PERCPU
+		if (size <= MAX_SIZE && CpuCache::GetInstance()->IsActive())
+		{
+			CurrentThreadStats()->RecordFree(SizeClass::Index(size));
+			CpuCache::GetInstance()->Deallocate(ptr, size);
+			return;
+		}
+#endif
+		if (size <= MAX_SIZE && TLSThreadCache != nullptr && TLSThreadCache->IsAllocating(size))
+		{
+			CurrentThreadStats()->RecordFree(SizeClass::Index(size));
 			TLSThreadCache->Deallocate(ptr, size);
 		}
+		else
+		{
+			// 大块内存需要span才能还给PageCache，跨线程释放需要span的远程释放队列
+			// 这两种情况只能走查询的路径
+			ConcurrentFree(ptr);
+		}
+	}
+
+	// 释放ConcurrentAlignedAlloc申请的内存，size和align要和申请时一样
+	// 不超过一页的对齐按申请时取整后的大小找到桶，超过一页的对齐整个span只有这一个对象，需要查询span
+	static void ConcurrentAlignedFree(void* ptr, size_t size, size_t align)
+	{
+		if (size == 0)
+		{
+			size = 1;
+		}
+		if (align <= sizeof(void*))
+		{
+			ConcurrentFree(ptr, size);
+		}
+		else if (align <= (1 << PAGE_SHIFT))
+		{
+			ConcurrentFree(ptr, SizeClass::_RoundUp(size, align));
+		}
+		else
+		{
+			ConcurrentFree(ptr);
+		}
+	}
+
+	// 调整内存大小，尽量原地完成
+	// 小对象新的大小还在同一个桶里时直接返回原指针
+	// 大块内存由PageCache合并后面空闲的span或者把尾部的页还回去，直接向系统申请的大块内存通过mremap调整
+	static void* ConcurrentRealloc(void* ptr, size_t size)
+	{
+		if (ptr == nullptr)
+		{
+			return ConcurrentAlloc(size);
+		}
+		if (size == 0)
+		{
+			ConcurrentFree(ptr);
+			return nullptr;
+		}
+
+		Span* span = PageCache::MapObjectToSpan(ptr);
+		size_t oldSize = span->_objSize;
+		if (oldSize <= MAX_SIZE)
+		{
+			if (size <= MAX_SIZE && SizeClass::RoundUp(size) == oldSize)
+			{
+				return ptr;
+			}
+		}
+		else if (span->_guard != nullptr)
+		{
+			// 保护页对象只复制申请的大小，再往后就是保护页
+			oldSize = GuardedPageAllocator::GetSize(span);
+		}
+		else
+		{
+			// 大块内存的实际容量按页计算
+			oldSize = span->_n << PAGE_SHIFT;
+			// 被采样的对象重新申请，采样记录跟着释放一起删除
+			if (size > MAX_SIZE && span->_sample == nullptr)
+			{
+				size_t kpage = SizeClass::RoundUp(size) >> PAGE_SHIFT;
+				PageCache* pageCache = PageCache::GetInstance(span->_node);
+				pageCache->Lock();
+				bool resized = pageCache->ResizeSpan(span, kpage);
+				if (resized)
+				{
+					span->_objSize = size;
+				}
+				pageCache->Unlock();
+				if (resized)
+				{
+					CurrentThreadStats()->RecordLargeResize(static_cast<long long>(kpage << PAGE_SHIFT) - static_cast<long long>(oldSize));
+					return (void*)(span->_pageId << PAGE_SHIFT);
+				}
+			}
+		}
+
+		// 无法原地调整，重新申请并复制
+		void* newPtr = ConcurrentAlloc(size);
+		memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+		ConcurrentFree(ptr);
+		return newPtr;
 	}
+
+	// 继承这个类之后，对象的new/delete都会走内存池
+	// 编译器会给带size参数的operator delete传入对象大小，释放时走上面的sized接口
+	class PoolObject
+	{
+	public:
+		static void* operator new(size_t size)
+		{
+			return ConcurrentAlloc(size);
+		}
+
+		static void operator delete(void* ptr, size_t size)
+		{
+			ConcurrentFree(ptr, size);
+		}
+
+		static void* operator new[](size_t size)
+		{
+			return ConcurrentAlloc(size);
+		}
+
+		static void operator delete[](void* ptr, size_t size)
+		{
+			ConcurrentFree(ptr, size);
+		}
+	};
 }
\ No newline at end of file
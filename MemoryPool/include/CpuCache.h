@@ -0,0 +1,62 @@
+#pragma once
+#include "Utils.hpp"
+
+// 只有x86_64的Linux并且glibc自带rseq注册（2.35+）的时候才能使用per-CPU缓存
+#if defined(MEMPOOL_PERCPU) && defined(__linux__) && defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define MEMPOOL_HAS_RSEQ 1
+#endif
+#endif
+
+namespace mempool
+{
+	static const size_t PERCPU_CLASS_BYTES = 64 * 1024; // 每个CPU的每个桶最多缓存多少字节
+
+	// 每个CPU一个前端缓存，替代每个线程一个的ThreadCache
+	// 通过restartable sequences在当前CPU的slab上无锁地push/pop，内存占用和核数相关而不是和线程数相关
+	class CpuCache
+	{
+	public:
+		static CpuCache* GetInstance()
+		{
+			static CpuCache _sInstance;
+			return &_sInstance;
+		}
+
+		// 当前线程能否使用per-CPU缓存，不能的时候调用方走TLSThreadCache
+		bool IsActive();
+
+		// 申请和释放内存对象
+		void* Allocate(size_t bytes);
+		void Deallocate(void* ptr, size_t bytes);
+
+		// slab一共保留了多少内存，用于观察前端缓存的内存占用
+		size_t GetSlabBytes()
+		{
+			return _numCpus * _slabStride;
+		}
+
+	private:
+		// 在当前CPU的slab上push/pop，slab满了或者空了返回false
+		bool Push(size_t index, void* obj);
+		bool Pop(size_t index, void*& obj);
+
+		// slab空了，从中心缓存获取一批对象
+		void* Refill(size_t index, size_t bytes);
+
+		// slab满了，把一半的对象还给中心缓存
+		void Drain(size_t index, size_t bytes, void* obj);
+
+		size_t _numCpus = 0;		   // slab的数量，按照可能的CPU数量计算
+		size_t _slabStride = 0;		   // 每个CPU的slab占用的字节数
+		char* _slabs = nullptr;		   // 所有CPU的slab，每个slab的开头是每个桶的栈顶下标
+		size_t _begin[NUM_FREELIST];   // 每个桶在slab中的起始下标
+		size_t _end[NUM_FREELIST];	   // 每个桶在slab中的结束下标
+		size_t _classSize[NUM_FREELIST]; // 每个桶对应的对象大小
+
+		CpuCache();
+		CpuCache(const CpuCache&) = delete;
+		CpuCache& operator=(const CpuCache&) = delete;
+	};
+}
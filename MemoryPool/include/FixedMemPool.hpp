@@ -2,6 +2,7 @@
 // 定长内存池
 #include "Utils.hpp"
 #include <cstdlib>
+#include <cstring>
 
 namespace mempool {
 
@@ -26,7 +27,7 @@ public:
 			if (_remainBytes < sizeof(T))
 			{
 				_remainBytes = 128 * 1024;
-				_memory = static_cast<char*>(SystemAlloc(_remainBytes >> PAGE_SHIFT)); // 申请的是页面数量
+				_memory = static_cast<char*>(MetadataAlloc(_remainBytes >> PAGE_SHIFT)); // 申请的是页面数量
 			}
 
 			obj = reinterpret_cast<T*>(_memory);
@@ -54,6 +55,16 @@ public:
 		_freeList = obj; // 更新头节点
 	}
 
+	// fork前由调用方持有，避免子进程中这把锁停留在被其他线程持有的状态
+	void Lock()
+	{
+		_mtx.lock();
+	}
+	void Unlock()
+	{
+		_mtx.unlock();
+	}
+
 private:
 	char* _memory = nullptr; // 指向大块内存的指针
 	size_t _remainBytes = 0; // 大块内存在切分过程中剩余字节数
@@ -61,4 +72,667 @@ private:
 	void* _freeList = nullptr; // 还回来过程中链接的自由链表的头指针
 	std::mutex _mtx; // 需要加锁
 };
-}
\ No newline at end of file
+
+// 给内部的STL容器使用的分配器，节点从定长内存池中获取，不会调用malloc
+// 替换了全局malloc之后，持有PageCache的锁时也可以使用
+template<class T>
+class FixedPoolAllocator
+{
+public:
+	typedef T value_type;
+
+	FixedPoolAllocator() = default;
+	template<class U>
+	FixedPoolAllocator(const FixedPoolAllocator<U>&) {}
+
+	T* allocate(size_t n)
+	{
+		assert(n == 1); // 只用于每次申请一个节点的容器，比如std::set
+		(void)n;
+		return reinterpret_cast<T*>(Pool().New());
+	}
+
+	void deallocate(T* ptr, size_t)
+	{
+		Pool().Delete(reinterpret_cast<Storage*>(ptr));
+	}
+
+	template<class U>
+	bool operator==(const FixedPoolAllocator<U>&) const
+	{
+		return true;
+	}
+	template<class U>
+	bool operator!=(const FixedPoolAllocator<U>&) const
+	{
+		return false;
+	}
+
+private:
+	// 只提供大小和对齐，节点由容器自己构造
+	struct Storage
+	{
+		alignas(T) unsigned char _bytes[sizeof(T)];
+	};
+
+	// 同一种节点共用一个定长内存池，程序退出时不析构，使用它的容器可能析构得更晚
+	static FixedMemoryPool<Storage>& Pool()
+	{
+		alignas(FixedMemoryPool<Storage>) static unsigned char buf[sizeof(FixedMemoryPool<Storage>)];
+		static FixedMemoryPool<Storage>* pool = new(buf) FixedMemoryPool<Storage>;
+		return *pool;
+	}
+};
+
+static const size_t MAGAZINE_SIZE = 32;		   // 每个magazine最多放多少个对象
+static const size_t MAX_DEPOT_MAGAZINES = 16;  // depot中最多保留多少个满的magazine，多出来的对象还给chunk
+static const size_t POOL_CHUNK_PAGES = 16;	   // 每个chunk的页数，128KB，按自己的大小对齐
+static const size_t POOL_THREAD_SLOTS = 8;	   // 每个线程最多同时缓存几个内存池的magazine
+static const size_t POOL_KEEP_EMPTY_CHUNKS = 1; // 全部空闲的chunk保留几个，避免反复mmap/munmap
+
+// 多线程共用的定长内存池，参考Bonwick的magazine分配器
+// 每个线程对每个内存池缓存两个magazine，大部分New/Delete不加锁
+// magazine满了或者空了和共享的depot交换，depot是两个无锁栈（满的和空的magazine）
+// depot也没有的时候才加锁从chunk中切对象，chunk记录还剩多少空闲对象，全部空闲的chunk还给操作系统
+// 不需要构造和析构对象的部分都在这里，ConcurrentFixedPool<T>只负责构造和析构
+class MagazinePool
+{
+public:
+	MagazinePool(size_t objSize, size_t objAlign)
+		: _objSize(RoundUp(objSize < sizeof(void*) ? sizeof(void*) : objSize, objAlign))
+		, _objOffset(RoundUp(sizeof(Chunk), objAlign))
+		, _capacity(((POOL_CHUNK_PAGES << PAGE_SHIFT) - _objOffset) / _objSize)
+		, _id(NextId().fetch_add(1, std::memory_order_relaxed))
+	{
+		assert(_capacity >= MAGAZINE_SIZE); // 一个chunk至少能装满一个magazine
+		_available._next = _available._prev = &_available;
+		_allChunks._nextAll = _allChunks._prevAll = &_allChunks;
+		std::unique_lock<std::mutex> lock(RegistryMutex());
+		_nextLive = LivePools();
+		LivePools() = this;
+	}
+
+	MagazinePool(const MagazinePool&) = delete;
+	MagazinePool& operator=(const MagazinePool&) = delete;
+
+	// 内存池析构时所有对象都算作已经释放，chunk全部还给操作系统
+	// 其他线程缓存的magazine会在线程退出或者这个位置被挤掉时发现内存池已经不在了，直接丢弃里面的对象
+	~MagazinePool()
+	{
+		{
+			std::unique_lock<std::mutex> lock(RegistryMutex());
+			MagazinePool** itr = &LivePools();
+			while (*itr != this)
+			{
+				itr = &(*itr)->_nextLive;
+			}
+			*itr = _nextLive;
+		}
+		if (ThreadMagazines* slot = FindSlot())
+		{
+			slot->Drop();
+		}
+		while (Magazine* mag = PopMagazine(_fullMagazines))
+		{
+			MagazineAllocator().Delete(mag);
+		}
+		while (Magazine* mag = PopMagazine(_emptyMagazines))
+		{
+			MagazineAllocator().Delete(mag);
+		}
+		Chunk* chunk = _allChunks._nextAll;
+		while (chunk != &_allChunks)
+		{
+			Chunk* next = chunk->_nextAll;
+			MetadataFree(chunk, POOL_CHUNK_PAGES);
+			chunk = next;
+		}
+	}
+
+	// 申请和释放一个对象的内存，不构造也不析构
+	void* Allocate()
+	{
+		ThreadMagazines& slot = Slot();
+		if (slot._loaded->_count == 0)
+		{
+			if (!Reload(slot))
+			{
+				void* obj = nullptr;
+				RefillFromChunks(&obj, 1);
+				return obj;
+			}
+		}
+		return slot._loaded->_objs[--slot._loaded->_count];
+	}
+
+	void Deallocate(void* obj)
+	{
+		ThreadMagazines& slot = Slot();
+		if (slot._loaded->_count == MAGAZINE_SIZE)
+		{
+			Unload(slot);
+		}
+		slot._loaded->_objs[slot._loaded->_count++] = obj;
+	}
+
+	// 一次申请n个对象，先从当前线程的magazine拿，不够的时候整个magazine地从depot拿
+	// 最后剩下的在一次加锁中从chunk切出来
+	void AllocateBatch(void** objs, size_t n)
+	{
+		ThreadMagazines& slot = Slot();
+		size_t got = 0;
+		while (got < n)
+		{
+			if (slot._loaded->_count == 0 && !Reload(slot))
+			{
+				RefillFromChunks(objs + got, n - got);
+				return;
+			}
+			Magazine* mag = slot._loaded;
+			size_t take = n - got < mag->_count ? n - got : mag->_count;
+			mag->_count -= take;
+			memcpy(objs + got, mag->_objs + mag->_count, take * sizeof(void*));
+			got += take;
+		}
+	}
+
+	// 一次释放n个对象，放满的magazine交给depot
+	void DeallocateBatch(void** objs, size_t n)
+	{
+		ThreadMagazines& slot = Slot();
+		size_t put = 0;
+		while (put < n)
+		{
+			if (slot._loaded->_count == MAGAZINE_SIZE)
+			{
+				Unload(slot);
+			}
+			Magazine* mag = slot._loaded;
+			size_t space = MAGAZINE_SIZE - mag->_count;
+			size_t give = n - put < space ? n - put : space;
+			memcpy(mag->_objs + mag->_count, objs + put, give * sizeof(void*));
+			mag->_count += give;
+			put += give;
+		}
+	}
+
+	// 把当前线程缓存的对象和depot中所有的对象还给chunk，全部空闲的chunk还给操作系统
+	// 其他线程缓存的对象要等它们退出或者把magazine交给depot之后才能回来，返回还剩多少个chunk
+	size_t ReleaseFreeChunks()
+	{
+		if (ThreadMagazines* slot = FindSlot())
+		{
+			ReturnToChunks(slot->_loaded->_objs, slot->_loaded->_count);
+			slot->_loaded->_count = 0;
+			ReturnToChunks(slot->_prev->_objs, slot->_prev->_count);
+			slot->_prev->_count = 0;
+		}
+		while (Magazine* mag = PopMagazine(_fullMagazines))
+		{
+			_fullCount.fetch_sub(1, std::memory_order_relaxed);
+			ReturnToChunks(mag->_objs, mag->_count);
+			mag->_count = 0;
+			PushMagazine(_emptyMagazines, mag);
+		}
+		std::unique_lock<std::mutex> lock(_chunkMtx);
+		Chunk* chunk = _available._next;
+		while (chunk != &_available)
+		{
+			Chunk* next = chunk->_next;
+			if (chunk->_free == _capacity)
+			{
+				_emptyChunks--; // 保留的空chunk也一起还回去
+				FreeChunk(chunk);
+			}
+			chunk = next;
+		}
+		return _chunks.load(std::memory_order_relaxed);
+	}
+
+	// 当前向系统申请的chunk数量和字节数
+	size_t ChunkCount() const
+	{
+		return _chunks.load(std::memory_order_relaxed);
+	}
+	size_t ChunkBytes() const
+	{
+		return ChunkCount() * (POOL_CHUNK_PAGES << PAGE_SHIFT);
+	}
+
+	// 当前线程是否缓存着这个内存池的magazine
+	bool CachedInThisThread()
+	{
+		return FindSlot() != nullptr;
+	}
+
+private:
+	struct Magazine
+	{
+		std::atomic<Magazine*> _next{nullptr}; // depot的栈中的下一个，弹出时可能正被其他线程修改
+		size_t _count = 0;
+		void* _objs[MAGAZINE_SIZE];
+	};
+
+	// chunk的开头放这个头部，后面是对象，对象所在的chunk通过地址对齐找到
+	struct Chunk
+	{
+		Chunk* _next = nullptr; // 还有空闲对象的chunk链表
+		Chunk* _prev = nullptr;
+		Chunk* _nextAll = nullptr; // 所有chunk的链表，析构时还给操作系统
+		Chunk* _prevAll = nullptr;
+		void* _freeList = nullptr; // 还回来的对象
+		char* _carve = nullptr;	   // 还没有切过的内存
+		size_t _free = 0;		   // 空闲对象的数量，包括还没有切的
+	};
+
+	// 每个线程缓存的magazine，一个正在使用，一个备用，两个都满了或者都空了才和depot交换
+	// 这样在边界上反复申请释放不会每次都访问depot
+	struct ThreadMagazines
+	{
+		MagazinePool* _pool = nullptr;
+		size_t _id = 0;
+		Magazine* _loaded = nullptr;
+		Magazine* _prev = nullptr;
+
+		// 把magazine交还给所属的内存池，内存池已经析构的话直接丢弃里面的对象
+		void Flush()
+		{
+			if (_pool != nullptr)
+			{
+				std::unique_lock<std::mutex> lock(RegistryMutex());
+				for (MagazinePool* pool = LivePools(); pool != nullptr; pool = pool->_nextLive)
+				{
+					if (pool == _pool && pool->_id == _id)
+					{
+						pool->PutMagazine(_loaded);
+						pool->PutMagazine(_prev);
+						_loaded = _prev = nullptr;
+						break;
+					}
+				}
+			}
+			Drop();
+		}
+
+		void Drop()
+		{
+			if (_loaded != nullptr)
+			{
+				MagazineAllocator().Delete(_loaded);
+			}
+			if (_prev != nullptr)
+			{
+				MagazineAllocator().Delete(_prev);
+			}
+			_pool = nullptr;
+			_id = 0;
+			_loaded = _prev = nullptr;
+		}
+	};
+
+	struct ThreadSlots
+	{
+		ThreadMagazines _slots[POOL_THREAD_SLOTS];
+		~ThreadSlots()
+		{
+			for (ThreadMagazines& slot : _slots)
+			{
+				slot.Flush();
+			}
+		}
+	};
+
+	static size_t RoundUp(size_t bytes, size_t align)
+	{
+		return (bytes + align - 1) & ~(align - 1);
+	}
+
+	static ThreadSlots& Slots()
+	{
+		static thread_local ThreadSlots slots;
+		return slots;
+	}
+
+	// 当前线程缓存这个内存池的位置，没有的话返回nullptr
+	// 从_id % POOL_THREAD_SLOTS开始线性探测整个数组，中途的空位不停下，所以释放位置不会让后面的内存池找不到
+	ThreadMagazines* FindSlot()
+	{
+		ThreadMagazines* slots = Slots()._slots;
+		for (size_t i = 0; i < POOL_THREAD_SLOTS; i++)
+		{
+			ThreadMagazines& slot = slots[(_id + i) % POOL_THREAD_SLOTS];
+			if (slot._id == _id)
+			{
+				return &slot;
+			}
+		}
+		return nullptr;
+	}
+
+	// 当前线程缓存这个内存池的位置，大部分时候第一个位置就是
+	ThreadMagazines& Slot()
+	{
+		ThreadMagazines& slot = Slots()._slots[_id % POOL_THREAD_SLOTS];
+		if (slot._id == _id)
+		{
+			return slot;
+		}
+		return ClaimSlot();
+	}
+
+	// 编号冲突的内存池占了第一个位置，继续探测，还没有位置的话占用第一个空位
+	// 只有线程同时使用超过POOL_THREAD_SLOTS个内存池时，才把第一个位置的magazine还回去
+	ThreadMagazines& ClaimSlot()
+	{
+		if (ThreadMagazines* found = FindSlot())
+		{
+			return *found;
+		}
+		ThreadMagazines* slots = Slots()._slots;
+		ThreadMagazines* slot = &slots[_id % POOL_THREAD_SLOTS];
+		for (size_t i = 0; i < POOL_THREAD_SLOTS; i++)
+		{
+			if (slots[(_id + i) % POOL_THREAD_SLOTS]._id == 0)
+			{
+				slot = &slots[(_id + i) % POOL_THREAD_SLOTS];
+				break;
+			}
+		}
+		slot->Flush();
+		slot->_pool = this;
+		slot->_id = _id;
+		slot->_loaded = MagazineAllocator().New();
+		slot->_prev = MagazineAllocator().New();
+		return *slot;
+	}
+
+	// 当前的magazine空了：备用的有对象就交换，否则把空的交给depot，从depot拿一个满的
+	bool Reload(ThreadMagazines& slot)
+	{
+		if (slot._prev->_count > 0)
+		{
+			std::swap(slot._loaded, slot._prev);
+			return true;
+		}
+		Magazine* full = PopMagazine(_fullMagazines);
+		if (full == nullptr)
+		{
+			return false;
+		}
+		_fullCount.fetch_sub(1, std::memory_order_relaxed);
+		PushMagazine(_emptyMagazines, slot._prev);
+		slot._prev = slot._loaded;
+		slot._loaded = full;
+		return true;
+	}
+
+	// 当前的magazine满了：备用的是空的就交换，否则把满的备用magazine交给depot，拿一个空的
+	void Unload(ThreadMagazines& slot)
+	{
+		if (slot._prev->_count == 0)
+		{
+			std::swap(slot._loaded, slot._prev);
+			return;
+		}
+		PutMagazine(slot._prev);
+		slot._prev = slot._loaded;
+		slot._loaded = PopMagazine(_emptyMagazines);
+		if (slot._loaded == nullptr)
+		{
+			slot._loaded = MagazineAllocator().New();
+		}
+	}
+
+	// 把magazine交给depot，满的magazine太多的时候里面的对象还给chunk，这样chunk才有机会全部空闲
+	void PutMagazine(Magazine* mag)
+	{
+		if (mag->_count == 0)
+		{
+			PushMagazine(_emptyMagazines, mag);
+			return;
+		}
+		if (_fullCount.load(std::memory_order_relaxed) >= MAX_DEPOT_MAGAZINES)
+		{
+			ReturnToChunks(mag->_objs, mag->_count);
+			mag->_count = 0;
+			PushMagazine(_emptyMagazines, mag);
+			return;
+		}
+		_fullCount.fetch_add(1, std::memory_order_relaxed);
+		PushMagazine(_fullMagazines, mag);
+	}
+
+	// depot的无锁栈，栈顶指针的高位放一个计数器，避免ABA问题
+	// magazine的内存不会还给操作系统，其他线程刚弹出的magazine仍然可以安全地读取_next
+	static const size_t TAG_SHIFT = sizeof(void*) == 8 ? 48 : 32;
+
+	static Magazine* Untag(unsigned long long top)
+	{
+		return reinterpret_cast<Magazine*>(static_cast<size_t>(top & ((1ULL << TAG_SHIFT) - 1)));
+	}
+
+	static void PushMagazine(std::atomic<unsigned long long>& stack, Magazine* mag)
+	{
+		unsigned long long top = stack.load(std::memory_order_relaxed);
+		unsigned long long next;
+		do
+		{
+			mag->_next.store(Untag(top), std::memory_order_relaxed);
+			next = reinterpret_cast<size_t>(mag) | (((top >> TAG_SHIFT) + 1) << TAG_SHIFT);
+		} while (!stack.compare_exchange_weak(top, next, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	static Magazine* PopMagazine(std::atomic<unsigned long long>& stack)
+	{
+		unsigned long long top = stack.load(std::memory_order_acquire);
+		unsigned long long next;
+		Magazine* mag;
+		do
+		{
+			mag = Untag(top);
+			if (mag == nullptr)
+			{
+				return nullptr;
+			}
+			next = reinterpret_cast<size_t>(mag->_next.load(std::memory_order_relaxed)) | (((top >> TAG_SHIFT) + 1) << TAG_SHIFT);
+		} while (!stack.compare_exchange_weak(top, next, std::memory_order_acquire, std::memory_order_acquire));
+		return mag;
+	}
+
+	Chunk* ChunkOf(void* obj)
+	{
+		const size_t chunkBytes = POOL_CHUNK_PAGES << PAGE_SHIFT;
+		return reinterpret_cast<Chunk*>(reinterpret_cast<size_t>(obj) & ~(chunkBytes - 1));
+	}
+
+	// 加锁从chunk中取n个对象，没有空闲对象的时候申请新的chunk
+	void RefillFromChunks(void** objs, size_t n)
+	{
+		std::unique_lock<std::mutex> lock(_chunkMtx);
+		for (size_t i = 0; i < n; i++)
+		{
+			Chunk* chunk = _available._next;
+			if (chunk == &_available)
+			{
+				chunk = NewChunk();
+			}
+			if (chunk->_free == _capacity)
+			{
+				_emptyChunks--;
+			}
+			if (chunk->_freeList != nullptr)
+			{
+				objs[i] = chunk->_freeList;
+				chunk->_freeList = NextObj(chunk->_freeList);
+			}
+			else
+			{
+				objs[i] = chunk->_carve;
+				chunk->_carve += _objSize;
+			}
+			if (--chunk->_free == 0)
+			{
+				Unlink(chunk);
+			}
+		}
+	}
+
+	// 加锁把n个对象还给所属的chunk，全部空闲的chunk超过保留数量时还给操作系统
+	void ReturnToChunks(void** objs, size_t n)
+	{
+		if (n == 0)
+		{
+			return;
+		}
+		std::unique_lock<std::mutex> lock(_chunkMtx);
+		for (size_t i = 0; i < n; i++)
+		{
+			Chunk* chunk = ChunkOf(objs[i]);
+			NextObj(objs[i]) = chunk->_freeList;
+			chunk->_freeList = objs[i];
+			if (chunk->_free++ == 0)
+			{
+				PushFront(chunk);
+			}
+			if (chunk->_free == _capacity)
+			{
+				if (_emptyChunks >= POOL_KEEP_EMPTY_CHUNKS)
+				{
+					FreeChunk(chunk);
+				}
+				else
+				{
+					_emptyChunks++;
+				}
+			}
+		}
+	}
+
+	Chunk* NewChunk()
+	{
+		void* ptr = MetadataAlloc(POOL_CHUNK_PAGES, POOL_CHUNK_PAGES);
+		Chunk* chunk = new(ptr) Chunk;
+		chunk->_carve = static_cast<char*>(ptr) + _objOffset;
+		chunk->_free = _capacity;
+		chunk->_nextAll = _allChunks._nextAll;
+		chunk->_prevAll = &_allChunks;
+		_allChunks._nextAll->_prevAll = chunk;
+		_allChunks._nextAll = chunk;
+		PushFront(chunk);
+		_emptyChunks++;
+		_chunks.fetch_add(1, std::memory_order_relaxed);
+		return chunk;
+	}
+
+	// 全部空闲的chunk从两个链表中删除，还给操作系统
+	void FreeChunk(Chunk* chunk)
+	{
+		assert(chunk->_free == _capacity);
+		Unlink(chunk);
+		chunk->_prevAll->_nextAll = chunk->_nextAll;
+		chunk->_nextAll->_prevAll = chunk->_prevAll;
+		MetadataFree(chunk, POOL_CHUNK_PAGES);
+		_chunks.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void PushFront(Chunk* chunk)
+	{
+		chunk->_next = _available._next;
+		chunk->_prev = &_available;
+		_available._next->_prev = chunk;
+		_available._next = chunk;
+	}
+
+	void Unlink(Chunk* chunk)
+	{
+		chunk->_prev->_next = chunk->_next;
+		chunk->_next->_prev = chunk->_prev;
+	}
+
+	// magazine本身从定长内存池获取，程序退出时不析构，线程退出时可能还要用
+	static FixedMemoryPool<Magazine>& MagazineAllocator()
+	{
+		alignas(FixedMemoryPool<Magazine>) static unsigned char buf[sizeof(FixedMemoryPool<Magazine>)];
+		static FixedMemoryPool<Magazine>* pool = new(buf) FixedMemoryPool<Magazine>;
+		return *pool;
+	}
+
+	// 还存在的内存池，线程退出时通过它确认magazine的所属内存池还没有析构
+	static std::mutex& RegistryMutex()
+	{
+		alignas(std::mutex) static unsigned char buf[sizeof(std::mutex)];
+		static std::mutex* mtx = new(buf) std::mutex;
+		return *mtx;
+	}
+	static MagazinePool*& LivePools()
+	{
+		static MagazinePool* head = nullptr;
+		return head;
+	}
+	// 内存池的编号不会重复使用，地址相同的新内存池也能和已经析构的区分开
+	static std::atomic<size_t>& NextId()
+	{
+		static std::atomic<size_t> id{1};
+		return id;
+	}
+
+	const size_t _objSize;	 // 对齐之后的对象大小
+	const size_t _objOffset; // chunk中第一个对象的偏移
+	const size_t _capacity;	 // 每个chunk能放多少个对象
+	const size_t _id;
+	MagazinePool* _nextLive = nullptr;
+
+	std::atomic<unsigned long long> _fullMagazines{0};
+	std::atomic<unsigned long long> _emptyMagazines{0};
+	std::atomic<size_t> _fullCount{0}; // depot中满的magazine数量，只是大概的值
+
+	std::mutex _chunkMtx;
+	Chunk _available; // 还有空闲对象的chunk，带头双向循环链表
+	Chunk _allChunks; // 所有的chunk
+	size_t _emptyChunks = 0; // 全部空闲的chunk数量
+	std::atomic<size_t> _chunks{0};
+};
+
+// 多线程共用的定长内存池，接口和FixedMemoryPool一样，另外可以批量申请释放
+// 内存会还给操作系统，所以不能用在其他线程可能无锁读取已经释放的对象的地方，比如Span
+template<class T>
+class ConcurrentFixedPool : public MagazinePool
+{
+public:
+	ConcurrentFixedPool()
+		: MagazinePool(sizeof(T), alignof(T))
+	{}
+
+	T* New()
+	{
+		T* obj = static_cast<T*>(Allocate());
+		new(obj)T;
+		return obj;
+	}
+
+	void Delete(T* obj)
+	{
+		obj->~T();
+		Deallocate(obj);
+	}
+
+	// 一次申请n个对象，放在objs中
+	void NewBatch(T** objs, size_t n)
+	{
+		AllocateBatch(reinterpret_cast<void**>(objs), n);
+		for (size_t i = 0; i < n; i++)
+		{
+			new(objs[i])T;
+		}
+	}
+
+	void DeleteBatch(T** objs, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+		{
+			objs[i]->~T();
+		}
+		DeallocateBatch(reinterpret_cast<void**>(objs), n);
+	}
+};
+}
@@ -41,6 +41,10 @@ public:
 		_freeList = NextObj(end);
 		NextObj(end) = nullptr;
 		_size -= n;
+		if (_size < _lowWater)
+		{
+			_lowWater = _size;
+		}
 	}
 
 	void* Pop()
@@ -51,6 +55,10 @@ public:
 		void* obj = _freeList;
 		_freeList = NextObj(obj);
 		_size--;
+		if (_size < _lowWater)
+		{
+			_lowWater = _size;
+		}
 
 		return obj;
 	}
@@ -74,11 +82,21 @@ public:
 	{
 		return _size;
 	}
+	// 上次重置以来链表最短的时候有多长，这么多对象一直没有被用到
+	size_t GetLowWater()
+	{
+		return _lowWater;
+	}
+	void ResetLowWater()
+	{
+		_lowWater = _size;
+	}
 
 private:
 	void* _freeList = nullptr;
 	size_t _maxSize = 1; // ThreadCache申请内存时用于限制的阈值
 	size_t _size = 0; // 链表长度
+	size_t _lowWater = 0; // 链表长度的最小值，回收ThreadCache多余的内存时使用
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,81 @@
+#pragma once
+// 采样的保护页分配，用很小的开销在线上发现越界访问和释放后使用（参考GWP-ASan）
+#include "Utils.hpp"
+#include "Span.hpp"
+#include "HeapProfiler.h"
+
+namespace mempool
+{
+	static const size_t GUARDED_SLOTS = 64;		// 同时存在的保护页对象最多多少个
+	static const long long GUARD_RECHECK = 1024; // 关闭时，每隔多少次申请重新检查一次采样间隔
+
+	// 一个槽中的对象，记录申请和释放时的调用栈，出错的时候输出
+	struct GuardedSlot
+	{
+		void* _ptr = nullptr;		  // 对象地址
+		size_t _size = 0;			  // 申请的大小
+		std::atomic<bool> _inUse{false}; // 对象是否存活，释放时交换成false，用来发现重复释放
+		Span* _span = nullptr;		  // 在页号映射中登记的span
+
+		size_t _allocThread = 0;
+		size_t _freeThread = 0;
+		int _allocDepth = 0;
+		int _freeDepth = 0; // 为0代表还没有释放过
+		void* _allocStack[MAX_STACK_DEPTH];
+		void* _freeStack[MAX_STACK_DEPTH];
+	};
+
+// 距离下一次使用保护页还剩多少次申请，定义在GuardedPageAllocator.cpp中
+#ifdef _WIN32
+	extern _declspec(thread) long long TLSGuardCountdown;
+#elif __linux__
+	extern __thread long long TLSGuardCountdown __attribute__((tls_model("initial-exec")));
+#endif
+
+	// 单独保留一段地址空间，分成GUARDED_SLOTS个槽，每个槽前后都是不可访问的保护页
+	// 被选中的申请放在槽的开头或者末尾，越过对象边界一访问到保护页就会触发段错误
+	// 释放后整个槽也变成不可访问，并且最久之前释放的槽最先被复用，尽量长时间地发现释放后使用
+	// 出错时信号处理函数输出出错的类型以及对象申请、释放时的调用栈，然后按原来的方式处理信号
+	class GuardedPageAllocator
+	{
+	public:
+		// 设置平均每多少次申请使用一次保护页，0代表关闭
+		static void SetSampleRate(size_t n);
+		static size_t GetSampleRate();
+
+		// 这次申请是否使用保护页，快速路径上只有一次减法和一次比较
+		static bool ShouldGuard()
+		{
+			return --TLSGuardCountdown < 0 && PickNextGuard();
+		}
+
+		// 从空闲的槽中分配，对象比一个槽大或者没有空闲的槽时返回nullptr，由调用方走普通的路径
+		static void* Allocate(size_t size);
+
+		// span是保护页对象的，重复释放或者地址不是对象起始位置时输出报告并终止程序
+		static void Deallocate(void* ptr, Span* span);
+
+		// 对象申请时的大小，复制时不能读到槽后面的保护页
+		static size_t GetSize(Span* span)
+		{
+			return span->_guard->_size;
+		}
+
+		static bool IsGuarded(void* ptr);
+
+		// 当前存活的保护页对象数量
+		static size_t GetGuardedCount();
+
+		// 每个槽的字节数，大于它的申请不会使用保护页
+		static size_t GetSlotBytes();
+
+		// 持有保护页分配的锁，用于fork前后
+		// 初始化时持有这把锁再去拿PageCache的锁，所以fork前要最先拿它
+		static void LockAll();
+		static void UnlockAll();
+
+	private:
+		// 倒计时用完了，决定这次是否使用保护页并重新设置倒计时
+		static bool PickNextGuard();
+	};
+}
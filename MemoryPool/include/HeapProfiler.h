@@ -0,0 +1,88 @@
+#pragma once
+// 采样的堆内存分析，平均每申请sampleRate字节采样一次，记录调用栈
+#include "Utils.hpp"
+#include "Span.hpp"
+#include <string>
+#ifdef __linux__
+#include <execinfo.h>
+#endif
+
+namespace mempool
+{
+	static const int MAX_STACK_DEPTH = 32; // 最多记录多少层调用栈
+
+	// 一个被采样的对象
+	struct HeapSample
+	{
+		void* _ptr = nullptr;	   // 对象地址
+		size_t _size = 0;		   // 申请的大小
+		size_t _rate = 0;		   // 采样时的采样间隔，用于估算代表的总字节数
+		int _depth = 0;			   // 调用栈深度
+		void* _stack[MAX_STACK_DEPTH];
+
+		HeapSample* _next = nullptr; // 所有存活的采样对象链接在一起
+		HeapSample* _prev = nullptr;
+	};
+
+	// 开启过采样（堆分析或者保护页）之后，被采样的小对象不在桶里，带size的释放不能再直接根据size找桶
+	inline std::atomic<bool> heapSamplingUsed{false};
+
+// 距离下一次采样还剩多少字节，定义在HeapProfiler.cpp中
+#ifdef _WIN32
+	extern _declspec(thread) long long TLSSampleCountdown;
+#elif __linux__
+	extern __thread long long TLSSampleCountdown __attribute__((tls_model("initial-exec")));
+#endif
+
+	class HeapProfiler
+	{
+	public:
+		// 设置平均多少字节采样一次，0代表关闭
+		static void SetSampleRate(size_t bytes);
+		static size_t GetSampleRate();
+
+		// 这次申请是否需要采样，快速路径上只有一次减法和一次比较
+		static bool ShouldSample(size_t size)
+		{
+			TLSSampleCountdown -= static_cast<long long>(size);
+			return TLSSampleCountdown < 0 && PickNextSample();
+		}
+
+		// 被采样的对象单独占用一个span，这样释放的时候通过span就能找到采样记录
+		static void* SampledAlloc(size_t size);
+
+		// span是采样对象的，释放前删除采样记录
+		static void SampledFree(Span* span);
+
+		// 当前存活的采样对象数量
+		static size_t GetSampleCount();
+
+		// 按调用栈汇总存活的采样对象，估算字节数从大到小输出，带符号名
+		static std::string DumpText();
+
+		// pprof可以直接读取的heap profile格式（gperftools的heap_v2文本格式）
+		// pprof <binary> <file> 会根据采样间隔自动换算成估算的字节数
+		static std::string DumpPprof();
+
+		// 持有采样记录的锁，用于fork前后
+		static void LockAll();
+		static void UnlockAll();
+
+		// 记录当前调用栈，返回实际的层数，保护页分配器也使用
+		// 内联到调用方，第一层就是调用方自己
+		static int CaptureStack(void** stack, int maxDepth)
+		{
+#ifdef _WIN32
+			return CaptureStackBackTrace(2, maxDepth, stack, nullptr);
+#elif __linux__
+			return backtrace(stack, maxDepth);
+#else
+			return 0;
+#endif
+		}
+
+	private:
+		// 倒计时用完了，决定这次是否采样并重新设置倒计时
+		static bool PickNextSample();
+	};
+}
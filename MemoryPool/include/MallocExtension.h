@@ -0,0 +1,161 @@
+#pragma once
+// 内存池的统计信息，接口仿照tcmalloc的MallocExtension
+#include "Utils.hpp"
+#include <string>
+
+namespace mempool
+{
+	// 每个线程自己的计数器
+	// 只有所属线程会写，用relaxed的load+store更新，没有加锁也没有原子的读改写指令
+	// 读取统计的时候把所有线程的计数器加起来
+	struct ThreadStats
+	{
+		struct Counter
+		{
+			std::atomic<size_t> _value{0};
+
+			void Add(size_t n)
+			{
+				_value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+			}
+			size_t Get() const
+			{
+				return _value.load(std::memory_order_relaxed);
+			}
+		};
+
+		Counter _allocs[NUM_FREELIST];		  // 申请次数
+		Counter _frees[NUM_FREELIST];		  // 释放次数
+		Counter _requestedBytes[NUM_FREELIST]; // 调用方实际申请的字节数，用来估算内部碎片
+		Counter _fetchCalls[NUM_FREELIST];	  // 前端缓存没有对象，去中心缓存获取的次数
+		Counter _fetchedObjs[NUM_FREELIST];	  // 从中心缓存拿到的对象数量
+		Counter _returnedObjs[NUM_FREELIST];  // 还给中心缓存的对象数量（包括远程释放）
+
+		Counter _largeAllocs; // 超过MAX_SIZE的申请次数
+		Counter _largeFrees;  // 超过MAX_SIZE的释放次数
+		Counter _largeBytes;  // 大块内存申请的字节数减去释放的字节数，所有线程加起来才有意义
+
+		// 所有线程的计数器链接在一起
+		ThreadStats* _next = nullptr;
+		ThreadStats* _prev = nullptr;
+
+		void RecordAlloc(size_t index, size_t bytes)
+		{
+			_allocs[index].Add(1);
+			_requestedBytes[index].Add(bytes);
+		}
+		void RecordFree(size_t index)
+		{
+			_frees[index].Add(1);
+		}
+		void RecordFetch(size_t index, size_t n)
+		{
+			_fetchCalls[index].Add(1);
+			_fetchedObjs[index].Add(n);
+		}
+		void RecordReturn(size_t index, size_t n)
+		{
+			_returnedObjs[index].Add(n);
+		}
+		// 大块内存的字节数，释放的时候传入负数
+		void RecordLarge(long long bytes)
+		{
+			if (bytes > 0)
+			{
+				_largeAllocs.Add(1);
+			}
+			else
+			{
+				_largeFrees.Add(1);
+			}
+			_largeBytes.Add(static_cast<size_t>(bytes));
+		}
+		// 大块内存原地调整了大小
+		void RecordLargeResize(long long bytes)
+		{
+			_largeBytes.Add(static_cast<size_t>(bytes));
+		}
+
+		// 从定长内存池中获取当前线程的计数器，并注册线程退出时的回调
+		static ThreadStats* Create();
+
+		// 线程退出时调用，计数器累加到全局之后还给定长内存池
+		static void Destroy(ThreadStats* stats);
+	};
+
+// 定义在MallocExtension.cpp中，所有编译单元共用同一个变量
+#ifdef _WIN32
+	extern _declspec(thread) ThreadStats* TLSThreadStats;
+#elif __linux__
+	extern __thread ThreadStats* TLSThreadStats __attribute__((tls_model("initial-exec")));
+#endif
+
+	// 当前线程的计数器，第一次使用时创建
+	static inline ThreadStats* CurrentThreadStats()
+	{
+		if (TLSThreadStats == nullptr)
+		{
+			TLSThreadStats = ThreadStats::Create();
+		}
+		return TLSThreadStats;
+	}
+
+	// 一个桶的统计
+	struct SizeClassStats
+	{
+		size_t _objSize = 0;		// 桶对应的对象大小
+		size_t _allocs = 0;			// 申请次数
+		size_t _frees = 0;			// 释放次数
+		size_t _cacheMisses = 0;	// 前端缓存未命中，调用FetchRangeObj的次数
+		size_t _spansInUse = 0;		// 中心缓存中属于这个桶的span数量
+		size_t _inUseBytes = 0;		// 应用程序正在使用的字节数（按桶的大小计算）
+		size_t _frontCacheBytes = 0; // ThreadCache/CpuCache中缓存的字节数
+		size_t _wastedBytes = 0;	// 正在使用的对象因为向上取整浪费的字节数（按平均申请大小估算）
+		// 中心缓存的span按使用率分档的数量，第i档是已分配对象占[i/8, (i+1)/8)的span，最后一个是已经分配完的span
+		size_t _spanOccupancy[NUM_OCCUPANCY_BINS + 1] = {};
+	};
+
+	// 整个内存池的统计
+	struct MallocStats
+	{
+		size_t _mappedBytes = 0;		  // 向操作系统申请的字节数
+		size_t _metadataBytes = 0;		  // 其中存放内存池自身数据结构的字节数
+		size_t _releasedBytes = 0;		  // PageCache中已经还给操作系统的字节数
+		size_t _pageCacheFreeBytes = 0;	  // PageCache中空闲的字节数，包括已经还给操作系统的
+		size_t _pageCacheFreeSpans = 0;	  // PageCache中空闲span的数量
+		size_t _pageCacheLargestFree = 0; // PageCache中最大的空闲span的字节数
+		size_t _centralCacheFreeBytes = 0; // 中心缓存的span中还没有分配出去的字节数
+		size_t _transferCacheBytes = 0;	  // 传输缓存中的字节数
+		size_t _frontCacheBytes = 0;	  // ThreadCache/CpuCache中缓存的字节数
+		size_t _inUseBytes = 0;			  // 应用程序正在使用的字节数，包括大块内存
+		size_t _wastedBytes = 0;		  // 内部碎片
+		size_t _largeAllocs = 0;		  // 大块内存申请次数
+		size_t _largeFrees = 0;			  // 大块内存释放次数
+		size_t _largeInUseBytes = 0;	  // 正在使用的大块内存字节数
+		size_t _spanOccupancy[NUM_OCCUPANCY_BINS + 1] = {}; // 所有桶加起来的span使用率分布
+		SizeClassStats _classes[NUM_FREELIST];
+	};
+
+	class MallocExtension
+	{
+	public:
+		// 汇总所有的统计信息，读取期间会依次持有各个锁，但不会同时持有
+		static void GetMallocStats(MallocStats& stats);
+
+		// 可读的统计报告，格式和tcmalloc的MallocExtension::GetStats类似
+		static std::string GetStats();
+
+		// 按名字获取一个统计值，名字不存在时返回false，支持的名字：
+		// generic.current_allocated_bytes  应用程序正在使用的字节数
+		// generic.heap_size                 向操作系统申请并且没有还回去的字节数
+		// heap.mapped_bytes                 向操作系统申请的字节数
+		// heap.metadata_bytes               存放内存池自身数据结构的字节数
+		// heap.released_bytes               已经还给操作系统的字节数
+		// heap.pagecache_free_bytes         PageCache中有物理内存的空闲字节数
+		// heap.central_cache_free_bytes     中心缓存span中的空闲字节数
+		// heap.transfer_cache_free_bytes    传输缓存中的字节数
+		// heap.thread_cache_free_bytes      ThreadCache/CpuCache中缓存的字节数
+		// heap.internal_fragmentation_bytes 向上取整浪费的字节数
+		static bool GetNumericProperty(const char* name, size_t* value);
+	};
+}
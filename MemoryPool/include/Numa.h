@@ -0,0 +1,69 @@
+#pragma once
+// NUMA拓扑：机器上有几个节点，当前线程在哪个节点上
+#include "Utils.hpp"
+
+namespace mempool
+{
+	static const size_t NUMA_MAX_CPUS = 1024; // 记录CPU所属节点的数组大小，更大的CPU编号按节点0处理
+
+	// 每个节点有自己的PageCache，新的span从当前线程所在节点的PageCache申请
+	// 单节点的机器或者获取不到拓扑的时候只有一个节点，和只有一个PageCache的时候完全一样
+	class NumaTopology
+	{
+	public:
+		static NumaTopology* GetInstance()
+		{
+			static NumaTopology _sInstance;
+			return &_sInstance;
+		}
+
+		// 节点的数量，不超过MAX_NUMA_NODES
+		size_t NumNodes() const
+		{
+			size_t fake = _fakeNodes.load(std::memory_order_acquire);
+			return fake != 0 ? fake : _numNodes;
+		}
+
+		// 当前线程正在运行的CPU所属的节点
+		size_t CurrentNode() const;
+
+		// 把[ptr, ptr+n页)的物理内存优先放在下标为node的PageCache对应的节点上
+		// 单节点时什么都不做，物理页在第一次访问的时候分配，也就是申请这段内存的线程所在的节点
+		void BindMemory(void* ptr, size_t n, size_t node) const;
+
+		// 测试用：假装有nodes个节点，当前线程在哪个节点由currentNode决定
+		// nodes为0时恢复真实的拓扑，假的拓扑不会绑定物理内存
+		void SetFakeTopology(size_t nodes, size_t (*currentNode)());
+
+	private:
+		size_t _numNodes = 1;
+		unsigned char _cpuNode[NUMA_MAX_CPUS] = {}; // 每个CPU对应的PageCache下标
+		// 每个PageCache下标对应的系统节点编号，节点编号可能不连续，绑定内存时要用系统的编号
+		unsigned short _heapNode[MAX_NUMA_NODES] = {};
+
+		std::atomic<size_t> _fakeNodes{0};
+		std::atomic<size_t (*)()> _fakeCurrentNode{nullptr};
+
+		// 单例模式，构造时读取系统的拓扑
+		NumaTopology();
+		NumaTopology(const NumaTopology&) = delete;
+	};
+
+// 当前线程绑定的节点+1，0表示还没有绑定
+// 创建ThreadCache的时候绑定到所在CPU的节点，之后这个线程需要的span都从这个节点的PageCache申请
+#ifdef _WIN32
+	extern _declspec(thread) size_t TLSNumaNode;
+#elif __linux__
+	extern __thread size_t TLSNumaNode __attribute__((tls_model("initial-exec")));
+#endif
+
+	// 当前线程应该使用哪个节点的PageCache，没有绑定的线程（比如per-CPU模式）按当前CPU查
+	static inline size_t CurrentThreadNode()
+	{
+		if (TLSNumaNode != 0)
+		{
+			return TLSNumaNode - 1;
+		}
+		return NumaTopology::GetInstance()->CurrentNode();
+	}
+}
@@ -2,22 +2,57 @@
 #include "Span.hpp"
 #include "Utils.hpp"
 #include "FixedMemPool.hpp"
+#include "PageMap.hpp"
+#include "Numa.h"
+#include <set>
 
 namespace mempool
 {
+	// PageCache中空闲span的分布，用来观察页级别的碎片
+	struct FreeSpanStats
+	{
+		size_t _spans = 0;		  // 空闲span的数量
+		size_t _pages = 0;		  // 空闲的页数，包括已经还给操作系统的
+		size_t _largestPages = 0; // 最大的空闲span的页数
+		size_t _largeSpans = 0;	  // 超过128页的空闲span的数量
+	};
+
+	// 每个NUMA节点一个PageCache，各自有自己的锁和空闲span，页号到span的映射所有节点共用
+	// span记录所属的节点，释放时还给申请它的那个PageCache；单节点的机器上只会用到第一个
 	class PageCache
 	{
 	public:
+		// 当前线程所在节点的PageCache
+		// 加锁、申请、解锁要用同一个PageCache，调用方先保存返回值，线程在中间换了CPU也没有关系
 		static PageCache* GetInstance()
 		{
-			static PageCache _sInstance;
-			return &_sInstance;
+			return GetInstance(CurrentThreadNode());
+		}
+
+		// 指定节点的PageCache
+		static PageCache* GetInstance(size_t node)
+		{
+			static PageCache* instances = []() {
+				static PageCache heaps[MAX_NUMA_NODES];
+				for (size_t i = 0; i < MAX_NUMA_NODES; i++)
+				{
+					heaps[i]._node = i;
+				}
+				return heaps;
+			}();
+			assert(node < MAX_NUMA_NODES);
+			return &instances[node];
 		}
 
-		// 通过内存地址获取它对应的span对象地址，自带加锁
-		Span* MapObjectToSpan(void* obj);
+		// fork之前拿到所有节点的锁，按节点顺序加锁
+		static void LockAll();
+		static void UnlockAll();
 
-		// 遍历设置映射关系
+		// 通过内存地址获取它对应的span对象地址，无锁读取
+		static Span* MapObjectToSpan(void* obj);
+
+		// 设置正在使用的span的映射关系
+		// 小span每一页都要设置，对象可能在任何一页；大span只设置首尾两页
 		void SetMapObjectToSpan(Span* span);
 
 		// 释放空闲span回到Pagecache，并合并相邻的span
@@ -26,6 +61,54 @@ namespace mempool
 		// 获取一个K页的span
 		Span* NewSpan(size_t k);
 
+		// 登记一段不由PageCache管理的n页内存（保护页分配器的槽），释放时可以通过地址找到span
+		// span一直处于使用状态，不会和相邻的span合并，也不会还给PageCache
+		Span* NewExternalSpan(PageID id, size_t n);
+
+		// 调整一个正在使用的大块内存span的页数，起始页号可能改变
+		// 无法原地完成的时候返回false，span保持不变，由调用方重新申请并复制
+		bool ResizeSpan(Span* span, size_t k);
+
+		// 获取一个K页并且起始页号是alignPages倍数的span，alignPages必须是2的幂
+		Span* NewAlignedSpan(size_t k, size_t alignPages);
+
+		// 把空闲超过释放间隔的span的物理内存还给操作系统，最多释放bytes字节
+		// 返回实际释放的字节数，内部加锁
+		// 开始之前先把这个节点的传输缓存中上次调用以来闲置的对象还给span，不能在持有任何锁的时候调用
+		size_t ReleaseFreeMemory(size_t bytes);
+
+		// 设置span空闲多久之后才可以被释放，单位毫秒，所有节点共用
+		void SetReleaseInterval(size_t ms)
+		{
+			_releaseIntervalMs = ms;
+		}
+
+		// 启动后台线程，每隔periodMs毫秒对所有节点调用一次ReleaseFreeMemory
+		void StartScavenger(size_t periodMs);
+		void StopScavenger();
+
+		// 透明大页模式：每次向系统申请2MB对齐的内存并建议内核使用大页，所有节点共用
+		// 拆分span时优先从使用率高的大页中拆，释放内存时不拆散使用率高的大页
+		void SetHugePageMode(bool on)
+		{
+			_hugePageMode = on;
+		}
+
+		// 当前PageCache中空闲span的分布，内部加锁
+		void GetFreeSpanStats(FreeSpanStats& stats);
+
+		// 检查每个空闲span的首尾页映射是否正确，以及相邻的空闲span是否都已经合并，用于测试，内部加锁
+		bool CheckFreeSpans();
+
+		// 当前PageCache中空闲span的字节数（包括已经还给操作系统的），内部加锁
+		size_t GetFreeBytes();
+
+		// 当前PageCache中已经还给操作系统的字节数
+		size_t GetReleasedBytes()
+		{
+			return _releasedPages.load(std::memory_order_relaxed) << PAGE_SHIFT;
+		}
+
 		inline void Lock(){
 			_pageMtx.lock();
 		}
@@ -36,14 +119,105 @@ namespace mempool
 
 	private:
 		SpanList _spanList[NUM_PAGES]; // 通过页面数量映射Span
-		FixedMemoryPool<Span> _spanPool; // 获取Span对象的定长内存池
-		// 用于映射页号和Span对象地址
-		std::unordered_map<PageID, Span*> _idSpanMap;
-		// PageCache采用全局锁
+		Bitmap<NUM_PAGES> _nonEmpty;   // 第i位表示_spanList[i]不为空
+
+		// 超过128页的空闲span按页数排序，页数相同的按地址排序
+		// 查找时取页数不小于k的第一个，也就是最合适的那个
+		struct SpanLess
+		{
+			typedef void is_transparent; // 可以直接用页数查找
+			bool operator()(const Span* a, const Span* b) const
+			{
+				return a->_n != b->_n ? a->_n < b->_n : a->_pageId < b->_pageId;
+			}
+			bool operator()(const Span* a, size_t n) const
+			{
+				return a->_n < n;
+			}
+			bool operator()(size_t n, const Span* b) const
+			{
+				return n < b->_n;
+			}
+		};
+		std::set<Span*, SpanLess, FixedPoolAllocator<Span*>> _largeSpans;
+		// 获取Span对象的定长内存池，每个节点分开，span对象只会由所属的PageCache构造
+		FixedMemoryPool<Span> _spanPool;
+		// 用于映射页号和Span对象地址，基数树实现，读取不需要加锁
+		// 所有节点共用，每个节点只写自己的span的页，合并时可以查到相邻的其他节点的span
+		PageMap& _idSpanMap = SharedPageMap();
+		// 每个节点的PageCache一把锁
 		std::mutex _pageMtx;
+		size_t _node = 0; // 这个PageCache对应的节点
+
+		// 程序退出时不析构，其他线程可能还在释放内存
+		static PageMap& SharedPageMap()
+		{
+			alignas(PageMap) static unsigned char buf[sizeof(PageMap)];
+			static PageMap* map = new(buf) PageMap;
+			return *map;
+		}
+
+		// 直接向系统申请超过管理范围的span
+		Span* NewSystemSpan(size_t k, size_t alignPages);
+		// 通过mremap调整直接向系统申请的span
+		bool RemapSystemSpan(Span* span, size_t k);
+
+		// 空闲span只设置首尾两页的映射，合并时查的是相邻span的尾页或者首页
+		void SetBoundaryMap(Span* span);
+		// 清掉[start, start+n)的映射，用于已经还给操作系统的地址
+		void ClearMap(PageID start, size_t n);
+
+		// 空闲span插入链表，已经释放的放在链表末尾，分配时优先拿还有物理内存的
+		// 超过128页的插入_largeSpans
+		void InsertFreeSpan(Span* span);
+		// 从链表或者_largeSpans中删除空闲span
+		void EraseFreeSpan(Span* span);
+		// 和前后相邻的空闲span合并，然后插入空闲链表
+		void MergeAndInsert(Span* span);
+		// 取出一个页数不小于k的空闲span，没有的时候返回nullptr
+		Span* FindFreeSpan(size_t k);
+		// 向系统申请一段新的内存，返回对应的空闲span，还没有插入链表
+		Span* GrowHeap();
+		// span被分配出去或者被合并了，不再算作已释放
+		void ClearReleased(Span* span);
+
+		// 从定长内存池中获取一个属于这个节点的span对象
+		Span* NewSpanObject()
+		{
+			Span* span = _spanPool.New();
+			span->_node.store(_node, std::memory_order_relaxed);
+			return span;
+		}
+
+		// 从_spanList[n]中取出一个span，大页模式下优先取所在大页使用率最高的
+		Span* PickSpan(size_t n);
+		// 修改[start, start+n)覆盖的每个大页中正在使用的页数
+		void AddHugePageUsed(PageID start, size_t n, bool used);
+		void AddHugePageUsed(Span* span, bool used)
+		{
+			AddHugePageUsed(span->_pageId, span->_n, used);
+		}
+		// span所在的大页中有多少页正在使用
+		size_t HugePageUsed(PageID id);
+
+		std::atomic<size_t> _releasedPages{0}; // 已经还给操作系统的页数
+		inline static std::atomic<size_t> _releaseIntervalMs{10 * 1000}; // 空闲多久之后可以被释放
+
+		inline static std::atomic<bool> _hugePageMode{false};
+		HugePageMap _hugePageUsed; // 每个大页中这个节点正在使用的页数
+
+		// 后台释放线程
+		std::thread _scavenger;
+		std::mutex _scavengerMtx;
+		std::condition_variable _scavengerCond;
+		bool _scavengerStop = false;
 
 		// 单例模式，私有构造函数
 		PageCache(){}
 		PageCache(const PageCache&) = delete;
+		~PageCache()
+		{
+			StopScavenger();
+		}
 	};
 }
\ No newline at end of file
@@ -0,0 +1,208 @@
+#pragma once
+// 页号到Span的映射，基数树实现（参考tcmalloc的pagemap）
+#include "Utils.hpp"
+#include "FixedMemPool.hpp"
+
+namespace mempool
+{
+	// 两层基数树，适用于32位平台
+	// BITS是页号的有效位数，32位下为 32-PAGE_SHIFT
+	template <int BITS>
+	class PageMap2
+	{
+	private:
+		static const int ROOT_BITS = 5;
+		static const int ROOT_LENGTH = 1 << ROOT_BITS;
+		static const int LEAF_BITS = BITS - ROOT_BITS;
+		static const int LEAF_LENGTH = 1 << LEAF_BITS;
+
+		// 叶子节点，直接存放页号对应的值
+		struct Leaf
+		{
+			void *_values[LEAF_LENGTH] = {};
+		};
+
+	public:
+		// 无锁读取，找不到的时候返回nullptr
+		void *Get(size_t id) const
+		{
+			const size_t i1 = id >> LEAF_BITS;
+			const size_t i2 = id & (LEAF_LENGTH - 1);
+			if ((id >> BITS) > 0)
+			{
+				return nullptr;
+			}
+			Leaf *leaf = _root[i1].load(std::memory_order_acquire);
+			if (leaf == nullptr)
+			{
+				return nullptr;
+			}
+			return leaf->_values[i2];
+		}
+
+		// 写入前必须调用Ensure，并且需要在页所属的PageCache的锁内调用
+		void Set(size_t id, void *value)
+		{
+			assert((id >> BITS) == 0);
+			const size_t i1 = id >> LEAF_BITS;
+			const size_t i2 = id & (LEAF_LENGTH - 1);
+			Leaf *leaf = _root[i1].load(std::memory_order_relaxed);
+			assert(leaf != nullptr);
+			leaf->_values[i2] = value;
+		}
+
+		// 确保[start, start+n)范围内的节点都已经分配
+		bool Ensure(size_t start, size_t n)
+		{
+			for (size_t key = start; key <= start + n - 1;)
+			{
+				const size_t i1 = key >> LEAF_BITS;
+				if (i1 >= ROOT_LENGTH)
+				{
+					return false; // 超出范围
+				}
+				if (_root[i1].load(std::memory_order_acquire) == nullptr)
+				{
+					// 节点的内存同样从定长内存池中获取
+					// 每个NUMA节点的PageCache各自加锁，可能同时分配同一个节点，没抢到的还回去
+					Leaf *leaf = _leafPool.New();
+					Leaf *expected = nullptr;
+					if (!_root[i1].compare_exchange_strong(expected, leaf, std::memory_order_acq_rel))
+					{
+						_leafPool.Delete(leaf);
+					}
+				}
+				// 跳到下一个叶子节点
+				key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
+			}
+			return true;
+		}
+
+	private:
+		std::atomic<Leaf *> _root[ROOT_LENGTH] = {};
+		FixedMemoryPool<Leaf> _leafPool;
+	};
+
+	// 三层基数树，适用于64位平台
+	// 64位下只有低48位是有效的用户态地址，页号位数为 48-PAGE_SHIFT
+	template <int BITS>
+	class PageMap3
+	{
+	private:
+		// 前两层平分位数，剩下的交给叶子节点
+		static const int INTERIOR_BITS = (BITS + 2) / 3;
+		static const int INTERIOR_LENGTH = 1 << INTERIOR_BITS;
+		static const int LEAF_BITS = BITS - 2 * INTERIOR_BITS;
+		static const int LEAF_LENGTH = 1 << LEAF_BITS;
+
+		// 中间节点，指向下一层
+		struct Node
+		{
+			std::atomic<void *> _ptrs[INTERIOR_LENGTH] = {};
+		};
+
+		// 叶子节点，直接存放页号对应的值
+		struct Leaf
+		{
+			void *_values[LEAF_LENGTH] = {};
+		};
+
+	public:
+		// 无锁读取，找不到的时候返回nullptr
+		// 节点一旦分配就不会释放，所以读取的时候不需要加锁
+		void *Get(size_t id) const
+		{
+			const size_t i1 = id >> (LEAF_BITS + INTERIOR_BITS);
+			const size_t i2 = (id >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+			const size_t i3 = id & (LEAF_LENGTH - 1);
+			if ((id >> BITS) > 0)
+			{
+				return nullptr;
+			}
+			Node *node = static_cast<Node *>(_root._ptrs[i1].load(std::memory_order_acquire));
+			if (node == nullptr)
+			{
+				return nullptr;
+			}
+			Leaf *leaf = static_cast<Leaf *>(node->_ptrs[i2].load(std::memory_order_acquire));
+			if (leaf == nullptr)
+			{
+				return nullptr;
+			}
+			return leaf->_values[i3];
+		}
+
+		// 写入前必须调用Ensure，并且需要在页所属的PageCache的锁内调用
+		void Set(size_t id, void *value)
+		{
+			assert((id >> BITS) == 0);
+			const size_t i1 = id >> (LEAF_BITS + INTERIOR_BITS);
+			const size_t i2 = (id >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+			const size_t i3 = id & (LEAF_LENGTH - 1);
+			Node *node = static_cast<Node *>(_root._ptrs[i1].load(std::memory_order_relaxed));
+			assert(node != nullptr);
+			Leaf *leaf = static_cast<Leaf *>(node->_ptrs[i2].load(std::memory_order_relaxed));
+			assert(leaf != nullptr);
+			leaf->_values[i3] = value;
+		}
+
+		// 确保[start, start+n)范围内的节点都已经分配
+		bool Ensure(size_t start, size_t n)
+		{
+			for (size_t key = start; key <= start + n - 1;)
+			{
+				const size_t i1 = key >> (LEAF_BITS + INTERIOR_BITS);
+				const size_t i2 = (key >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+				if (i1 >= INTERIOR_LENGTH)
+				{
+					return false; // 超出范围
+				}
+
+				Node *node = static_cast<Node *>(_root._ptrs[i1].load(std::memory_order_acquire));
+				if (node == nullptr)
+				{
+					// 节点的内存同样从定长内存池中获取
+					// 每个NUMA节点的PageCache各自加锁，可能同时分配同一个节点，没抢到的还回去
+					Node *created = _nodePool.New();
+					void *expected = nullptr;
+					if (_root._ptrs[i1].compare_exchange_strong(expected, created, std::memory_order_acq_rel))
+					{
+						node = created;
+					}
+					else
+					{
+						_nodePool.Delete(created);
+						node = static_cast<Node *>(expected);
+					}
+				}
+				if (node->_ptrs[i2].load(std::memory_order_acquire) == nullptr)
+				{
+					Leaf *leaf = _leafPool.New();
+					void *expected = nullptr;
+					if (!node->_ptrs[i2].compare_exchange_strong(expected, leaf, std::memory_order_acq_rel))
+					{
+						_leafPool.Delete(leaf);
+					}
+				}
+				// 跳到下一个叶子节点
+				key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
+			}
+			return true;
+		}
+
+	private:
+		Node _root; // 根节点直接放在对象里面
+		FixedMemoryPool<Node> _nodePool;
+		FixedMemoryPool<Leaf> _leafPool;
+	};
+
+	// 根据平台选择基数树的层数
+	// HugePageMap以2MB的大页号为下标
+#if defined(_WIN64) || (defined(__linux__) && __WORDSIZE == 64)
+	typedef PageMap3<48 - PAGE_SHIFT> PageMap;
+	typedef PageMap3<48 - HUGEPAGE_SHIFT> HugePageMap;
+#else
+	typedef PageMap2<32 - PAGE_SHIFT> PageMap;
+	typedef PageMap2<32 - HUGEPAGE_SHIFT> HugePageMap;
+#endif
+}
@@ -18,6 +18,9 @@ namespace mempool
 #endif
 #endif
 
+	struct HeapSample;
+	struct GuardedSlot;
+
 	// PageCache和CentralCache中用于托管内存的类
 	struct Span
 	{
@@ -27,13 +30,36 @@ namespace mempool
 		Span *_next = nullptr; // 下一个Span（链表）
 		Span *_prev = nullptr; // 上一个Span（链表）
 
-		void *_list = nullptr; // 链接span拆分的小块内存
+		void *_list = nullptr; // 链接还回来的小块内存
 		size_t _useCount = 0;  // 使用数量，为0代表没有被使用
 
+		// 还没有切分过的内存，需要对象时才从这里切，不用一开始就把整个span链接起来
+		char *_carve = nullptr;	   // 下一个对象的位置
+		char *_carveEnd = nullptr; // 最后一个完整对象的结束位置
+
 		size_t _objSize; // 拆分的小块内存的大小
+		size_t _capacity = 0; // 能切出来的对象数量
+		size_t _bin = 0;	  // 在CentralCache的桶中按使用率放在哪个链表
 
 		bool _isUsed = false; // 是否在占用
 		// 当Span被分配给CentralCache后设置为true
+
+		size_t _freeTime = 0;	  // 回到PageCache的时间（毫秒），用于判断空闲了多久
+		bool _isReleased = false; // 物理内存是否已经通过madvise还给了操作系统
+
+		// 其他线程释放的对象先无锁地挂在这里，由CentralCache持有桶锁时批量合并到_list
+		std::atomic<void *> _remoteList{nullptr};
+		std::atomic<size_t> _remoteCount{0}; // 远程释放队列的长度，只用于判断是否需要合并
+		// 远程释放队列不为空之后span被放进桶的待合并栈，出栈前不能还给PageCache
+		std::atomic<bool> _remotePending{false};
+		Span *_remoteNext = nullptr; // 待合并栈中的下一个span
+
+		HeapSample *_sample = nullptr; // 不为空代表这个span只存放一个被采样的对象
+		GuardedSlot *_guard = nullptr; // 不为空代表这个span是保护页分配器的一个槽
+
+		// 所属的NUMA节点，也就是由哪个PageCache管理，释放时还给这个PageCache
+		// 合并时会读取相邻的其他节点的span，所以用原子变量，节点不同的span不会合并
+		std::atomic<size_t> _node{MAX_NUMA_NODES};
 	};
 
 	// 带头双向循环链表
@@ -41,12 +67,15 @@ namespace mempool
 	{
 	public:
 		// 初始化头节点
+		// 头节点直接放在对象里面，构造时不调用new，替换了全局malloc之后也不会递归
 		SpanList()
+			: _head(&_headNode)
 		{
-			_head = new Span;
 			_head->_next = _head;
 			_head->_prev = _head;
 		}
+		SpanList(const SpanList &) = delete;
+		SpanList &operator=(const SpanList &) = delete;
 		// 返回链表实际的头节点
 		Span *Begin()
 		{
@@ -68,6 +97,11 @@ namespace mempool
 			Insert(Begin(), span);
 		}
 
+		void PushBack(Span *span)
+		{
+			Insert(End(), span);
+		}
+
 		Span *PopFront()
 		{
 			Span *front = _head->_next;
@@ -101,7 +135,8 @@ namespace mempool
 		}
 
 	protected:		 // 因为需要继承所以用保护
-		Span *_head; // 链表头节点
+		Span *_head;	 // 链表头节点
+		Span _headNode; // 头节点本身
 	};
 
 	// 继承父类但包含桶锁，因为只有CentralCache需要桶锁
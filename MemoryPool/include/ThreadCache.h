@@ -1,8 +1,13 @@
+#pragma once
 #include "FreeList.hpp"
 #include "Utils.hpp"
 
 namespace mempool
 {
+	static const size_t THREAD_CACHE_BUDGET = 32 * 1024 * 1024; // 所有线程的ThreadCache总共最多缓存多少字节
+	static const size_t MIN_THREAD_CACHE = 64 * 1024;			// 每个线程至少保留的额度
+	static const size_t THREAD_CACHE_INIT = 256 * 1024;			// 新线程的初始额度
+	static const size_t THREAD_CACHE_STEAL = 64 * 1024;			// 额度不够时一次增加多少
 
 	class ThreadCache
 	{
@@ -14,17 +19,84 @@ namespace mempool
 		// 从中心缓存获取对象
 		void *FetchFromCentralCache(size_t index, size_t bytes);
 
-		// 释放对象时，链表过长时，回收内存回到中心缓存
-		void ReleaseToCentralCache(FreeList &list, size_t bytes);
+		// 释放对象时，链表过长时，从链表头部还给中心缓存n个对象
+		void ReleaseToCentralCache(size_t index, size_t n);
+
+		// 当前线程是否从这个桶申请过内存
+		// 只释放不申请的线程不算对象的持有者，释放时会把对象还给span的远程释放队列
+		// 申请过的线程留下的对象不超过这个桶链表的阈值，多出来的成批还给中心缓存，申请线程可以重新拿到
+		bool IsAllocating(size_t bytes)
+		{
+			return _freeList[SizeClass::Index(bytes)].GetMaxSize() > 1;
+		}
+
+		// 把所有链表中的对象都还给中心缓存
+		void ReleaseAll();
+
+		// 这个线程绑定的NUMA节点，新的span从这个节点的PageCache申请
+		size_t GetNode()
+		{
+			return _node;
+		}
+
+		// 当前缓存的字节数和这个线程的额度
+		size_t GetCacheSize()
+		{
+			return _size.load(std::memory_order_relaxed);
+		}
+		size_t GetMaxCacheSize()
+		{
+			return _maxSize.load(std::memory_order_relaxed);
+		}
+
+		// 设置所有线程的ThreadCache总共最多缓存多少字节，额度在线程之间动态分配
+		// 调小之后，缓存超过额度的线程会在之后释放内存时逐渐还回去
+		static void SetOverallBudget(size_t bytes);
+		static size_t GetOverallBudget();
+
+		// 从定长内存池中获取当前线程的ThreadCache，并注册线程退出时的回调
+		static ThreadCache *Create();
+
+		// 线程退出时调用，清空链表并把ThreadCache还给定长内存池
+		static void Destroy(ThreadCache *tc);
+
+		// 持有ThreadCache链表和额度的锁，用于fork前后
+		static void LockAll();
+		static void UnlockAll();
 
 	private:
 		FreeList _freeList[NUM_FREELIST];
+
+		// 缓存的字节数只有所属线程会修改，其他线程在分配额度时读取
+		std::atomic<size_t> _size{0};
+		// 这个线程的额度，持有全局锁的时候才会修改，其他线程可能从这里拿走一部分
+		std::atomic<size_t> _maxSize{0};
+
+		// 所有线程的ThreadCache链接在一起，用于在线程之间分配额度
+		ThreadCache *_next = nullptr;
+		ThreadCache *_prev = nullptr;
+
+		size_t _node = 0; // 创建时所在CPU的NUMA节点
+
+		void AddCacheSize(long long bytes)
+		{
+			_size.store(_size.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+		}
+
+		// 缓存超过额度时，先把每个链表中一直没有用到的对象还回去，还是超过的话把链表整个还回去
+		// 最后再尝试增加额度，经常超过额度的线程会逐渐拿到更多的额度
+		void Scavenge();
+
+		// 优先使用还没有分给任何线程的额度，没有的话从空闲额度最多的线程那里拿
+		void IncreaseCacheLimit();
 	};
 
 // 线程局部变量，当检测到ThreadCache为空指针的时候进行初始化，每个线程都有自己的ThreadCache
+// 定义在ThreadCache.cpp中，所有编译单元共用同一个变量
 #ifdef _WIN32
-	static _declspec(thread) ThreadCache *TLSThreadCache = nullptr;
+	extern _declspec(thread) ThreadCache *TLSThreadCache;
 #elif __linux__
-	static __thread ThreadCache *TLSThreadCache = nullptr;
+	// initial-exec模型直接通过线程指针偏移访问，编译成动态库替换malloc时不会因为__tls_get_addr再去调用malloc
+	extern __thread ThreadCache *TLSThreadCache __attribute__((tls_model("initial-exec")));
 #endif
 }
\ No newline at end of file
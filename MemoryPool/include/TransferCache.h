@@ -0,0 +1,71 @@
+#pragma once
+#include "Utils.hpp"
+
+namespace mempool
+{
+	static const size_t MAX_TRANSFER_BATCHES = 64;		// 每个桶最多缓存多少批对象
+	static const size_t TRANSFER_CACHE_BYTES = 256 * 1024; // 每个桶最多缓存多少字节
+
+	// 传输缓存的命中情况
+	struct TransferCacheStats
+	{
+		size_t _insertHits = 0;   // ThreadCache还回来的对象直接放进了传输缓存
+		size_t _insertMisses = 0; // 传输缓存满了，只能还给span
+		size_t _removeHits = 0;   // ThreadCache申请的对象直接从传输缓存拿到了
+		size_t _removeMisses = 0; // 传输缓存里没有合适的批次，只能从span里拿
+		size_t _bytes = 0;		  // 当前缓存的对象字节数
+
+		// 命中率，没有任何访问的时候返回0
+		double HitRate() const
+		{
+			size_t total = _insertHits + _insertMisses + _removeHits + _removeMisses;
+			return total == 0 ? 0.0 : static_cast<double>(_insertHits + _removeHits) / total;
+		}
+	};
+
+	// 位于ThreadCache和CentralCache的span之间
+	// 缓存整批已经链接好的对象，线程之间交换时只需要一次很短的加锁
+	class TransferCache
+	{
+	public:
+		// 放入一批对象，链表需要以nullptr结尾
+		// 传输缓存满了的时候返回false，由调用方还给span
+		bool InsertRange(void* start, void* end, size_t n, size_t bytes);
+
+		// 取出一批不超过batchNum个的对象，返回取到的数量，0代表没有合适的批次
+		size_t RemoveRange(void*& start, void*& end, size_t batchNum, size_t bytes);
+
+		// 取出上次调用以来一直没有被取走过的批次，串成一个以nullptr结尾的链表，没有的时候返回nullptr
+		// 定期调用，闲置的对象还给span之后，span才有机会全部回收、还给PageCache
+		void* TakeIdle(size_t bytes);
+
+		// 累加当前桶的命中情况
+		void GetStats(TransferCacheStats& stats);
+
+		// fork前后由CentralCache统一加锁解锁，保证子进程中的锁处于未持有状态
+		void Lock()
+		{
+			_mtx.lock();
+		}
+		void Unlock()
+		{
+			_mtx.unlock();
+		}
+
+	private:
+		// 一批对象
+		struct Batch
+		{
+			void* _start;
+			void* _end;
+			size_t _n;
+		};
+
+		Batch _slots[MAX_TRANSFER_BATCHES]; // 当成栈来用，后放入的先取出
+		size_t _used = 0;					 // 已经使用的槽位数量
+		size_t _bytes = 0;					 // 缓存的对象总字节数
+		size_t _lowWater = 0;				 // 上次TakeIdle之后_used的最小值，栈底的这么多批次一直没有用到
+		TransferCacheStats _stats;
+		std::mutex _mtx;
+	};
+}
@@ -6,12 +6,15 @@
 
 #include <thread>
 #include <mutex>
+#include <chrono>
+#include <condition_variable>
 #include <atomic>
 #include <unordered_map>
 #include <iostream>
 
 #ifdef _WIN32
 #include <Windows.h>
+#include <intrin.h>
 #elif __linux__ // linux
 #include <sys/mman.h>
 #endif // _WIN32
@@ -21,23 +24,72 @@ namespace mempool
 
 	static const size_t PAGE_SHIFT = 13;	   // 内存地址对应一个页面的偏移量，13代表8KB
 	static const size_t MAX_SIZE = 256 * 1024; // threadcache负责256kb
-	static const size_t NUM_FREELIST = 208;	   // threadcache中freelist的长度
 	static const size_t NUM_PAGES = 129;	   // PageCache最大管理128Page，使用129这样避免下标-1
-#ifdef __linux__
-	// Linux下需要一个map来存放地址和长度的关系，否则没有办法释放内存
-	static std::unordered_map<void *, unsigned long long> allocPtrToBytes;
-#endif
+	static const size_t HUGEPAGE_SHIFT = 21;   // 透明大页的大小，2MB
+	static const size_t HUGEPAGE_PAGES = 1 << (HUGEPAGE_SHIFT - PAGE_SHIFT); // 一个大页包含多少页
+	static const size_t NUM_OCCUPANCY_BINS = 8; // 中心缓存中部分使用的span按使用率分成几档
+	static const size_t MAX_NUMA_NODES = 8;		// 最多几个NUMA节点各自有一个PageCache，更多的节点按取模共用
+
+	// 通过SystemAlloc向操作系统申请、还没有SystemFree的字节数
+	// inline变量在所有编译单元中只有一份
+	inline std::atomic<size_t> systemMappedBytes{0};
+	// 其中存放内存池自身数据结构的字节数，通过MetadataAlloc申请
+	inline std::atomic<size_t> metadataMappedBytes{0};
 
 	// 直接用操作系统接口申请空间，参数为页面数量，一页8KB
-	static void *SystemAlloc(size_t numOfPages)
+	// 返回的地址按alignPages个页对齐，alignPages必须是2的幂
+	static void *SystemAllocAligned(size_t numOfPages, size_t alignPages)
 	{
 		unsigned long long bytes = numOfPages << PAGE_SHIFT;
+		const size_t alignBytes = alignPages << PAGE_SHIFT;
 #ifdef _WIN32
+		// VirtualAlloc本身按64KB对齐，更大的对齐先保留一块更大的地址空间找到对齐的位置，再在这个位置上重新申请
 		void *ptr = VirtualAlloc(0, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (ptr != nullptr && (reinterpret_cast<size_t>(ptr) & (alignBytes - 1)) != 0)
+		{
+			VirtualFree(ptr, 0, MEM_RELEASE);
+			ptr = nullptr;
+			for (int i = 0; i < 8 && ptr == nullptr; i++)
+			{
+				char *raw = static_cast<char *>(VirtualAlloc(0, bytes + alignBytes, MEM_RESERVE, PAGE_NOACCESS));
+				if (raw == nullptr)
+				{
+					break;
+				}
+				char *aligned = reinterpret_cast<char *>((reinterpret_cast<size_t>(raw) + alignBytes - 1) & ~(alignBytes - 1));
+				VirtualFree(raw, 0, MEM_RELEASE);
+				ptr = VirtualAlloc(aligned, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+			}
+		}
 #elif __linux__
 		// linux下brk或者mmap
+		// mmap只保证4KB对齐，先按原大小申请，已经对齐就直接用
+		// 这样连续申请的内存通常首尾相接，PageCache可以把它们合并成更大的span
 		void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		allocPtrToBytes[ptr] = bytes;
+		if (ptr != MAP_FAILED && (reinterpret_cast<size_t>(ptr) & (alignBytes - 1)) != 0)
+		{
+			// 没有对齐，多申请alignBytes再把首尾多余的部分还回去
+			munmap(ptr, bytes);
+			ptr = mmap(NULL, bytes + alignBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ptr != MAP_FAILED)
+			{
+				char *raw = static_cast<char *>(ptr);
+				char *aligned = reinterpret_cast<char *>((reinterpret_cast<size_t>(raw) + alignBytes - 1) & ~(alignBytes - 1));
+				if (aligned != raw)
+				{
+					munmap(raw, aligned - raw);
+				}
+				if (aligned + bytes != raw + bytes + alignBytes)
+				{
+					munmap(aligned + bytes, (raw + bytes + alignBytes) - (aligned + bytes));
+				}
+				ptr = aligned;
+			}
+		}
+		if (ptr == MAP_FAILED)
+		{
+			ptr = nullptr;
+		}
 #else
 		void *ptr = nullptr; // 不支持的操作系统
 #endif
@@ -45,31 +97,96 @@ namespace mempool
 		{
 			throw std::bad_alloc();
 		}
+		systemMappedBytes.fetch_add(bytes, std::memory_order_relaxed);
 		// std::cout << "alloc ptr: "<< ptr << " - " << bytes << "\n";
 		return ptr;
 	}
 
-	// 直接用操作系统接口释放空间
-	static void SystemFree(void *ptr)
+	// 直接用操作系统接口申请空间，参数为页面数量，一页8KB
+	static void *SystemAlloc(size_t numOfPages)
 	{
+		return SystemAllocAligned(numOfPages, 1);
+	}
+
+	// 直接用操作系统接口释放空间，numOfPages必须和申请时一致
+	// 调用方（Span）本身就记录了页数，不需要再额外用map保存长度，这里也就不会再调用malloc
+	static void SystemFree(void *ptr, size_t numOfPages)
+	{
+		systemMappedBytes.fetch_sub(numOfPages << PAGE_SHIFT, std::memory_order_relaxed);
 #ifdef _WIN32
 		VirtualFree(ptr, 0, MEM_RELEASE);
 #elif __linux__
-		// linux
- 		auto ret = allocPtrToBytes.find(ptr);
-		// 被释放的内存一定是以申请时的指针为起始地址的
-		if(ret != allocPtrToBytes.end()) 
-		{	// 被释放的长度
-			unsigned long long bytes = ret->second;
-			munmap(ptr, bytes);
+		munmap(ptr, numOfPages << PAGE_SHIFT);
+#endif
+	}
+
+	// 为内存池自身的数据结构（span、页号映射、ThreadCache、传输缓存、per-CPU缓存、定长内存池等）申请空间
+	// 单独计入metadataMappedBytes，统计时和应用程序的内存区分开
+	static void *MetadataAlloc(size_t numOfPages, size_t alignPages = 1)
+	{
+		void *ptr = SystemAllocAligned(numOfPages, alignPages);
+		metadataMappedBytes.fetch_add(numOfPages << PAGE_SHIFT, std::memory_order_relaxed);
+		return ptr;
+	}
+
+	static void MetadataFree(void *ptr, size_t numOfPages)
+	{
+		metadataMappedBytes.fetch_sub(numOfPages << PAGE_SHIFT, std::memory_order_relaxed);
+		SystemFree(ptr, numOfPages);
+	}
+
+	// 调整直接向系统申请的内存的大小，物理页由内核整体搬移，不需要复制数据
+	// target为空时只尝试原地调整，否则移动到target（需要是一段已经申请的newPages页的内存）
+	// 失败时返回nullptr，原来的内存保持不变
+	static void *SystemRemap(void *ptr, size_t oldPages, size_t newPages, void *target)
+	{
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+		void *ret = target == nullptr
+						? mremap(ptr, oldPages << PAGE_SHIFT, newPages << PAGE_SHIFT, 0)
+						: mremap(ptr, oldPages << PAGE_SHIFT, newPages << PAGE_SHIFT, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+		if (ret == MAP_FAILED)
+		{
+			return nullptr;
 		}
-		else
+		// 移动到target时，target已经按newPages计算过了，只需要减掉原来的部分
+		if (target == nullptr)
 		{
-			assert(false); // 没有找到，说明有问题
+			systemMappedBytes.fetch_add(newPages << PAGE_SHIFT, std::memory_order_relaxed);
 		}
+		systemMappedBytes.fetch_sub(oldPages << PAGE_SHIFT, std::memory_order_relaxed);
+		return ret;
+#else
+		return nullptr; // 其他平台只能重新申请再复制
 #endif
 	}
 
+	// 把物理内存还给操作系统，但保留虚拟地址空间，之后可以直接访问（会重新触发缺页）
+	static void SystemRelease(void *ptr, size_t numOfPages)
+	{
+		size_t bytes = numOfPages << PAGE_SHIFT;
+#ifdef _WIN32
+		VirtualAlloc(ptr, bytes, MEM_RESET, PAGE_READWRITE);
+#elif __linux__
+		madvise(ptr, bytes, MADV_DONTNEED);
+#endif
+	}
+
+	// 建议操作系统使用透明大页来映射这段内存
+	static void SystemHugePage(void *ptr, size_t numOfPages)
+	{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+		madvise(ptr, numOfPages << PAGE_SHIFT, MADV_HUGEPAGE);
+#endif
+	}
+
+	// 单调时钟的毫秒数
+	static size_t NowMs()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+				   std::chrono::steady_clock::now().time_since_epoch())
+			.count();
+	}
+
 	// 因为自由链表是直接用内存中前4/8位来存放下一个位置的指针的
 	// 所以只需要通过强转返回内存的前4/8位的地址就可以了
 	static void *&NextObj(void *obj)
@@ -77,6 +194,89 @@ namespace mempool
 		return *(static_cast<void **>(obj));
 	}
 
+	// 最低的为1的位的下标，x不能为0
+	static inline size_t FindFirstSet(unsigned long long x)
+	{
+		assert(x != 0);
+#ifdef _WIN32
+		unsigned long index = 0;
+		_BitScanForward64(&index, x);
+		return index;
+#else
+		return __builtin_ctzll(x);
+#endif
+	}
+
+	// 定长位图，用来快速找到下一个不为空的链表
+	template <size_t N>
+	class Bitmap
+	{
+	public:
+		void Set(size_t i)
+		{
+			_words[i / WORD_BITS] |= 1ULL << (i % WORD_BITS);
+		}
+		void Clear(size_t i)
+		{
+			_words[i / WORD_BITS] &= ~(1ULL << (i % WORD_BITS));
+		}
+		bool Test(size_t i) const
+		{
+			return (_words[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+		}
+		// 下标不小于start的第一个为1的位，没有的时候返回N
+		size_t FindNext(size_t start) const
+		{
+			size_t w = start / WORD_BITS;
+			if (w >= NUM_WORDS)
+			{
+				return N;
+			}
+			// 第一个字先去掉start前面的位，之后每次检查一整个字
+			unsigned long long bits = _words[w] & (~0ULL << (start % WORD_BITS));
+			while (bits == 0)
+			{
+				if (++w == NUM_WORDS)
+				{
+					return N;
+				}
+				bits = _words[w];
+			}
+			return w * WORD_BITS + FindFirstSet(bits);
+		}
+
+	private:
+		static const size_t WORD_BITS = 64;
+		static const size_t NUM_WORDS = (N + WORD_BITS - 1) / WORD_BITS;
+		unsigned long long _words[NUM_WORDS] = {};
+	};
+
+	// 计算对象大小的对齐映射规则
+	// 桶的划分在编译期生成：
+	// 128字节以内按8字节对齐，1024字节以内按16字节对齐，再往上每个2的幂区间平均分成8个桶
+	// 这样向上取整浪费的内存不超过12.5%，而且每个区间的对齐粒度都是2的幂
+	// 每个桶一次向PageCache申请的页数也在编译期确定，保证切分span时尾部剩下的内存不超过12.5%
+	static const size_t MAX_TAIL_WASTE_DIV = 8;			  // span尾部浪费不超过1/8
+	static const size_t SMALL_LOOKUP_MAX = 1024;		  // 这个大小以内按8字节查表，再往上按128字节查表
+	static const size_t MAX_NUM_CLASSES = 256;			  // 查表数组用unsigned char保存桶下标
+	static const size_t CLASS_LOOKUP_LEN = ((MAX_SIZE + 127 + (120 << 7)) >> 7) + 1;
+
+	// 一个桶的信息
+	struct SizeClassInfo
+	{
+		size_t _size = 0;  // 对象大小
+		size_t _pages = 0; // 一次向PageCache申请几页
+		size_t _batch = 0; // ThreadCache一次获取多少个对象
+	};
+
+	struct SizeClassTable
+	{
+		size_t _count = 0; // 桶的数量
+		SizeClassInfo _classes[MAX_NUM_CLASSES] = {};
+		// 大小到桶下标的映射，下标由SizeClass::LookupIndex计算
+		unsigned char _lookup[CLASS_LOOKUP_LEN] = {};
+	};
+
 	// 计算对象大小的对齐映射规则
 	class SizeClass
 	{
@@ -98,115 +298,136 @@ namespace mempool
 		}*/
 
 		// 计算需要申请内存的大小
-		static inline size_t _RoundUp(size_t bytes, size_t alignNum)
+		static constexpr size_t _RoundUp(size_t bytes, size_t alignNum)
 		{
 			return ((bytes + alignNum - 1) & ~(alignNum - 1));
 		}
 
-		static size_t RoundUp(size_t bytes)
+		// 查表的下标：1024字节以内是(size+7)>>3，再往上每128字节一项，接在后面
+		// 1024以上的桶大小都是128的倍数，所以按128取整不会跨过桶的边界
+		static constexpr size_t LookupIndex(size_t bytes)
 		{
-			if (bytes <= 128)
-			{
-				return _RoundUp(bytes, 8);
-			}
-			else if (bytes <= 1024)
-			{
-				return _RoundUp(bytes, 16);
-			}
-			else if (bytes <= 8 * 1024)
+			return bytes <= SMALL_LOOKUP_MAX ? (bytes + 7) >> 3 : (bytes + 127 + (120 << 7)) >> 7;
+		}
+
+		// 桶之间的间隔
+		static constexpr size_t ClassStep(size_t bytes)
+		{
+			if (bytes < 128)
 			{
-				return _RoundUp(bytes, 128);
+				return 8;
 			}
-			else if (bytes <= 64 * 1024)
+			if (bytes < SMALL_LOOKUP_MAX)
 			{
-				return _RoundUp(bytes, 1024);
+				return 16;
 			}
-			else if (bytes <= 256 * 1024)
+			size_t power = SMALL_LOOKUP_MAX;
+			while (power * 2 <= bytes)
 			{
-				return _RoundUp(bytes, 8 * 1024);
-			}
-			else
-			{ // 这里虽然左移13和8KB是一样的，但如果后续修改了PAGE_SHIFT就会不同
-				return _RoundUp(bytes, 1 << PAGE_SHIFT);
+				power *= 2;
 			}
+			return power / 8;
 		}
 
-		static inline size_t _Index(size_t bytes, size_t align_shift)
+		// ThreadCache一次获取多少个size大小的内存
+		static constexpr size_t ComputeBatch(size_t bytes)
 		{
-			return ((bytes + (1 << align_shift) - 1) >> align_shift) - 1;
+			// 这里定义阈值区间为[2,512]
+			// size大的时候，一次申请的数量少
+			// size小的时候，一次申请的数量多
+			size_t num = MAX_SIZE / bytes;
+			return num < 2 ? 2 : (num > 512 ? 512 : num);
 		}
 
-		// 计算映射的哪一个自由链表桶（ThreadCache）
-		static size_t Index(size_t bytes)
+		// 一次向PageCache申请的页数：先保证能放下一批对象，再增加页数直到尾部浪费不超过1/8
+		static constexpr size_t ComputePages(size_t bytes)
 		{
-			assert(bytes <= MAX_SIZE);
-
-			// 每个区间有多少个链
-			static int group_array[4] = {16, 56, 56, 56};
-			if (bytes <= 128)
-			{
-				return _Index(bytes, 3);
-			}
-			else if (bytes <= 1024)
-			{
-				return _Index(bytes - 128, 4) + group_array[0];
-			}
-			else if (bytes <= 8 * 1024)
-			{
-				return _Index(bytes - 1024, 7) + group_array[1] + group_array[0];
-			}
-			else if (bytes <= 64 * 1024)
+			size_t pages = (ComputeBatch(bytes) * bytes) >> PAGE_SHIFT;
+			pages = pages == 0 ? 1 : pages; // 至少会分配一页的空间
+			while (pages < NUM_PAGES - 1)
 			{
-				return _Index(bytes - 8 * 1024, 10) + group_array[2] + group_array[1] + group_array[0];
+				size_t spanBytes = pages << PAGE_SHIFT;
+				if (spanBytes >= bytes && spanBytes % bytes <= spanBytes / MAX_TAIL_WASTE_DIV)
+				{
+					break;
+				}
+				pages++;
 			}
-			else if (bytes <= 256 * 1024)
-			{
-				return _Index(bytes - 64 * 1024, 13) + group_array[3] + group_array[2] + group_array[1] + group_array[0];
-			}
-			else
-			{
-				// 超出MAX_SIZE了
-				assert(false);
-			}
-
-			return -1;
+			return pages;
 		}
 
-		// ThreadCache一次获取多少个size大小的内存
-		static size_t NumMoveSize(size_t bytes)
+		static constexpr SizeClassTable GenerateTable()
 		{
-			assert(bytes > 0);
-			// 这里定义阈值区间为[2,512]
-			// size大的时候，一次申请的数量少
-			// size小的时候，一次申请的数量多
-			int num = MAX_SIZE / bytes;
-			// 修正区间
-			if (num < 2)
+			SizeClassTable table;
+			for (size_t bytes = 8; bytes <= MAX_SIZE; bytes += ClassStep(bytes))
 			{
-				num = 2;
+				SizeClassInfo& info = table._classes[table._count++];
+				info._size = bytes;
+				info._pages = ComputePages(bytes);
+				info._batch = ComputeBatch(bytes);
 			}
-			else if (num > 512)
+			// 每个查表项映射到能放下它的最小的桶
+			size_t index = 0;
+			for (size_t i = 0; i < CLASS_LOOKUP_LEN; i++)
 			{
-				num = 512;
+				size_t bytes = i <= (SMALL_LOOKUP_MAX >> 3) ? i << 3 : (i << 7) - (120 << 7);
+				while (index + 1 < table._count && table._classes[index]._size < bytes)
+				{
+					index++;
+				}
+				table._lookup[i] = static_cast<unsigned char>(index);
 			}
-
-			return num;
+			return table;
 		}
 
-		// 计算一次向系统获取几个页
-		static size_t NumMovePage(size_t bytes)
-		{
-			size_t num = NumMoveSize(bytes);
-			size_t num_page = num * bytes;
+		static size_t RoundUp(size_t bytes);
+		static size_t Index(size_t bytes);
+		static size_t NumMoveSize(size_t bytes);
+		static size_t NumMovePage(size_t bytes);
 
-			num_page >>= PAGE_SHIFT;
-			if (num_page == 0)
-			{
-				num_page = 1; // 至少会分配一页的空间
-			}
+		// 桶对应的对象大小
+		static size_t ClassSize(size_t index);
+	};
+
+	// 编译期生成的桶信息，所有编译单元共用一份
+	inline constexpr SizeClassTable sizeClassTable = SizeClass::GenerateTable();
+	static const size_t NUM_FREELIST = sizeClassTable._count; // threadcache中freelist的长度
+	static_assert(NUM_FREELIST <= MAX_NUM_CLASSES, "too many size classes");
+	static_assert(sizeClassTable._classes[NUM_FREELIST - 1]._size == MAX_SIZE, "last size class must be MAX_SIZE");
 
-			return num_page;
+	inline size_t SizeClass::RoundUp(size_t bytes)
+	{
+		if (bytes <= MAX_SIZE)
+		{
+			return sizeClassTable._classes[sizeClassTable._lookup[LookupIndex(bytes)]]._size;
 		}
-	};
+		// 这里虽然左移13和8KB是一样的，但如果后续修改了PAGE_SHIFT就会不同
+		return _RoundUp(bytes, 1 << PAGE_SHIFT);
+	}
+
+	// 计算映射的哪一个自由链表桶（ThreadCache），只需要查一次表
+	inline size_t SizeClass::Index(size_t bytes)
+	{
+		assert(bytes <= MAX_SIZE);
+		return sizeClassTable._lookup[LookupIndex(bytes)];
+	}
+
+	inline size_t SizeClass::NumMoveSize(size_t bytes)
+	{
+		assert(bytes > 0);
+		return sizeClassTable._classes[Index(bytes)]._batch;
+	}
+
+	// 计算一次向系统获取几个页
+	inline size_t SizeClass::NumMovePage(size_t bytes)
+	{
+		return sizeClassTable._classes[Index(bytes)]._pages;
+	}
+
+	inline size_t SizeClass::ClassSize(size_t index)
+	{
+		assert(index < NUM_FREELIST);
+		return sizeClassTable._classes[index]._size;
+	}
 
 }
\ No newline at end of file
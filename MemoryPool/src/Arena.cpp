@@ -0,0 +1,107 @@
+#include "../include/Arena.h"
+#include "../include/PageCache.h"
+#include "../include/MallocExtension.h"
+
+namespace mempool
+{
+	Arena::~Arena()
+	{
+		while (_spans != nullptr)
+		{
+			Span* next = _spans->_next;
+			ReleaseSpan(_spans);
+			_spans = next;
+		}
+	}
+
+	// 当前span放不下，申请一个新的span
+	// 比下一次增长的页数还大的申请单独占用一个span，放在链表第二个，当前span剩下的部分还可以继续用
+	void* Arena::AllocateSlow(size_t bytes, size_t align)
+	{
+		if (bytes == 0)
+		{
+			return Allocate(1, align);
+		}
+		// span只保证按页对齐，超过一页的对齐多申请align字节
+		size_t need = bytes + (align > (1 << PAGE_SHIFT) ? align : 0);
+		size_t k = SizeClass::_RoundUp(need, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+		if (k > _nextPages && _spans != nullptr)
+		{
+			Span* span = NewSpan(k);
+			// NewSpan挂在了头部，换到当前span后面
+			_spans = span->_next;
+			span->_next = _spans->_next;
+			_spans->_next = span;
+			_allocated += bytes;
+			size_t start = static_cast<size_t>(span->_pageId << PAGE_SHIFT);
+			return reinterpret_cast<void*>((start + align - 1) & ~(align - 1));
+		}
+
+		k = k > _nextPages ? k : _nextPages;
+		if (_nextPages < ARENA_MAX_PAGES)
+		{
+			_nextPages *= 2;
+		}
+		Span* span = NewSpan(k);
+		_ptr = static_cast<size_t>(span->_pageId << PAGE_SHIFT);
+		_end = _ptr + (k << PAGE_SHIFT);
+		return Allocate(bytes, align);
+	}
+
+	// 释放所有span，保留一个能放下这一轮所有对象的span
+	void Arena::Reset()
+	{
+		_highWater = GetHighWaterMark();
+		// 多留1/8给对齐和span末尾浪费的部分
+		size_t keep = SizeClass::_RoundUp(_allocated + _allocated / 8, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+		keep = keep < ARENA_MIN_PAGES ? ARENA_MIN_PAGES : keep;
+		keep = keep > ARENA_KEEP_PAGES ? ARENA_KEEP_PAGES : keep;
+		_allocated = 0;
+		if (_spans == nullptr)
+		{
+			return;
+		}
+
+		// 只有一个不太大的span时直接复用，不需要访问PageCache
+		if (_spanCount > 1 || _spans->_n > ARENA_KEEP_PAGES)
+		{
+			while (_spans != nullptr)
+			{
+				Span* next = _spans->_next;
+				ReleaseSpan(_spans);
+				_spans = next;
+			}
+			_spanCount = 0;
+			_reserved = 0;
+			NewSpan(keep);
+		}
+		_ptr = static_cast<size_t>(_spans->_pageId << PAGE_SHIFT);
+		_end = _ptr + (_spans->_n << PAGE_SHIFT);
+	}
+
+	// 从当前线程所在节点的PageCache申请，和大块内存一样标记大小，计入大块内存的统计
+	Span* Arena::NewSpan(size_t k)
+	{
+		PageCache* pageCache = PageCache::GetInstance();
+		pageCache->Lock();
+		Span* span = pageCache->NewSpan(k);
+		span->_objSize = MAX_SIZE + 1;
+		pageCache->Unlock();
+		CurrentThreadStats()->RecordLarge(k << PAGE_SHIFT);
+
+		span->_next = _spans;
+		_spans = span;
+		_reserved += k << PAGE_SHIFT;
+		_spanCount++;
+		return span;
+	}
+
+	void Arena::ReleaseSpan(Span* span)
+	{
+		CurrentThreadStats()->RecordLarge(-static_cast<long long>(span->_n << PAGE_SHIFT));
+		PageCache* pageCache = PageCache::GetInstance(span->_node);
+		pageCache->Lock();
+		pageCache->ReleaseSpanToPageCache(span);
+		pageCache->Unlock();
+	}
+}
@@ -1,54 +1,64 @@
 #include "../include/CentralCache.h"
 #include "../include/PageCache.h"
+#include "../include/Numa.h"
+#include "../include/FixedMemPool.hpp"
+#include <new>
 
 namespace mempool {
-	// 获取一个非空的span
-	Span* CentralCache::GetOneSpan(SpanListLock& list, size_t bytes)
+	// 节点0以外的span链表，只在持有某个桶锁时申请，fork时持有所有桶锁就不会有人持有这个池的锁
+	static FixedMemoryPool<CentralBins> binsPool;
+
+	CentralBins* CentralBucket::NewBins()
 	{
-		// 查找当前哈希桶下标位置中是否还有没有使用完毕内存的Span对象
-		Span* itr = list.Begin();
-		while (itr != list.End())
+		return binsPool.New();
+	}
+
+	// 获取一个node节点上的非空span
+	Span* CentralCache::GetOneSpan(CentralBucket& bucket, size_t bytes, size_t node)
+	{
+		// 有其他线程还回来的对象的span先合并，已经分配完的span会重新变成部分使用的span
+		if (bucket._remoteSpans.load(std::memory_order_relaxed) != nullptr)
 		{
-			if (itr->_list != nullptr)
-			{
-				return itr;
-			}
-			else
+			DrainRemoteSpans(bucket);
+		}
+
+		// 先用最满的span，快空的span留着等它全部回收
+		Span* span = bucket.FullestPartial(node);
+		if (span != nullptr)
+		{
+			if (span->_list == nullptr && span->_remoteList.load(std::memory_order_relaxed) != nullptr)
 			{
-				itr = itr->_next;
+				DrainRemoteList(span);
+				bucket.Update(span);
 			}
+			return span;
 		}
+
 		// 没有的时候需要向PageCache申请
-		list.Unlock(); // 先解锁桶锁
+		bucket.Unlock(); // 先解锁桶锁
 
-		PageCache::GetInstance()->Lock();
+		// 从当前线程所在节点的PageCache申请
+		PageCache* pageCache = PageCache::GetInstance(node);
+		pageCache->Lock();
 		// 计算一次需要申请几个page的span
-		Span* span = PageCache::GetInstance()->NewSpan(SizeClass::NumMovePage(bytes));
+		span = pageCache->NewSpan(SizeClass::NumMovePage(bytes));
 		span->_isUsed = true;
 		span->_objSize = bytes;
-		PageCache::GetInstance()->Unlock();
+		pageCache->Unlock();
 		
-		// 获取到Span了之后，由CentralCache负责拆分内存并链接在Span的list上
-		// 这个时候还不需要解锁桶锁，因为此时这个Span只有当前线程知道
+		// 新的span不在这里切分，FetchRangeObj需要多少对象就切多少
+		// 这样不会一次性访问span的所有页，没有用到的页也不会产生缺页
 		char* start = reinterpret_cast<char*>(span->_pageId << PAGE_SHIFT); // 使用char*方便指针相加
 		size_t spanSize = span->_n << PAGE_SHIFT; // 这个span托管的内存的大小
-		char* end = start + spanSize;
-
-		// 开始链接
-		span->_list = start;
-		start += bytes; // 先从下一个内存的位置开始
-		void* cur = span->_list;
-		while (start < end)
-		{
-			NextObj(cur) = start;
-			cur = NextObj(cur);
-			start += bytes;
-		}
-		NextObj(cur) = nullptr; // 结束链接
+		span->_list = nullptr;
+		span->_capacity = spanSize / bytes;
+		span->_carve = start;
+		// span的大小不一定是对象大小的整数倍，最后不够一个对象的部分不能用
+		span->_carveEnd = start + span->_capacity * bytes;
 
 		// 将Span插入哈希桶，然后返回
-		list.Lock();
-		list.PushFront(span);
+		bucket.Lock();
+		bucket.Insert(span);
 
 		return span;
 
@@ -58,30 +68,137 @@ namespace mempool {
 	size_t  CentralCache::FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t bytes)
 	{
 		size_t index = SizeClass::Index(bytes);
+		size_t node = CurrentThreadNode();
+		// 先看本节点的传输缓存中有没有现成的一批，有的话不需要操作span
+		size_t actualNum = TransferCaches(node)[index].RemoveRange(start, end, batchNum, SizeClass::RoundUp(bytes));
+		if (actualNum != 0)
+		{
+			return actualNum;
+		}
+
 		_spanList[index].Lock();
 		// 获取一个span对象
-		Span* span = GetOneSpan(_spanList[index], bytes);
+		Span* span = GetOneSpan(_spanList[index], bytes, node);
 
-		// 从span中获取batchNum个对象，如果不够则能给多少给多少
-		start = span->_list;
-		end = start;
-		size_t i = 0;
-		size_t actualNum = 1; // 实际上给了多少个bytes大小的对象
-		while (i < (batchNum - 1) && NextObj(end) != nullptr)
+		// 先从还回来的对象中拿batchNum个，如果不够再从还没有切分的内存中切，还是不够则能给多少给多少
+		start = nullptr;
+		end = nullptr;
+		actualNum = 0; // 实际上给了多少个bytes大小的对象
+		if (span->_list != nullptr)
 		{
-			end = NextObj(end);
-			i++;
+			start = span->_list;
+			end = start;
+			actualNum = 1;
+			while (actualNum < batchNum && NextObj(end) != nullptr)
+			{
+				end = NextObj(end);
+				actualNum++;
+			}
+			span->_list = NextObj(end);
+		}
+		while (actualNum < batchNum && span->_carve != span->_carveEnd)
+		{
+			void* obj = span->_carve;
+			span->_carve += bytes;
+			if (start == nullptr)
+			{
+				start = obj;
+			}
+			else
+			{
+				NextObj(end) = obj;
+			}
+			end = obj;
 			actualNum++;
 		}
-		span->_list = NextObj(end);
 		NextObj(end) = nullptr;
 		span->_useCount += actualNum;
+		_spanList[index].Update(span);
 
 		_spanList[index].Unlock();
 
 		return actualNum;
 	}
 
+	// 回收ThreadCache中的一批对象，优先放进传输缓存，放不下再还给span
+	void CentralCache::ReleaseRangeObj(void* start, void* end, size_t n, size_t bytes)
+	{
+		size_t index = SizeClass::Index(bytes);
+		// 超过一次移动数量的链表（比如线程退出时整个还回来的）不放进传输缓存
+		if (n <= SizeClass::NumMoveSize(bytes)
+			&& TransferCaches(CurrentThreadNode())[index].InsertRange(start, end, n, SizeClass::RoundUp(bytes)))
+		{
+			return;
+		}
+		ReleaseListToSpans(start, bytes);
+	}
+
+	void CentralCache::ReleaseIdleTransfer(size_t node)
+	{
+		TransferCache* caches = _nodeTransfer[node].load(std::memory_order_acquire);
+		for (size_t i = 0; caches != nullptr && i < NUM_FREELIST; i++)
+		{
+			size_t bytes = SizeClass::ClassSize(i);
+			void* list = caches[i].TakeIdle(bytes);
+			if (list != nullptr)
+			{
+				ReleaseListToSpans(list, bytes);
+			}
+		}
+	}
+
+	// 获取所有桶的传输缓存的命中情况
+	TransferCacheStats CentralCache::GetTransferCacheStats()
+	{
+		TransferCacheStats stats;
+		for (size_t node = 0; node < MAX_NUMA_NODES; node++)
+		{
+			TransferCache* caches = _nodeTransfer[node].load(std::memory_order_acquire);
+			for (size_t i = 0; caches != nullptr && i < NUM_FREELIST; i++)
+			{
+				caches[i].GetStats(stats);
+			}
+		}
+		return stats;
+	}
+
+	// 获取一个桶当前的状态，内部加桶锁
+	void CentralCache::GetBucketStats(size_t index, CentralBucketStats& stats)
+	{
+		CentralBucket& bucket = _spanList[index];
+		bucket.Lock();
+		for (size_t node = 0; node < MAX_NUMA_NODES; node++)
+		{
+			for (size_t bin = 0; bin <= CentralBucket::FULL_BIN; bin++)
+			{
+				SpanList* list = bucket.Bin(node, bin);
+				if (list == nullptr)
+				{
+					break; // 这个节点还没有span
+				}
+				for (Span* span = list->Begin(); span != list->End(); span = span->_next)
+				{
+					// span的字节数减去已经分配出去的对象，末尾不够一个对象的部分也算在里面
+					stats._spans++;
+					stats._spanFreeBytes += (span->_n << PAGE_SHIFT) - span->_useCount * span->_objSize;
+					stats._occupancy[bin]++;
+				}
+			}
+		}
+		bucket.Unlock();
+
+		for (size_t node = 0; node < MAX_NUMA_NODES; node++)
+		{
+			TransferCache* caches = _nodeTransfer[node].load(std::memory_order_acquire);
+			if (caches != nullptr)
+			{
+				TransferCacheStats transfer;
+				caches[index].GetStats(transfer);
+				stats._transferBytes += transfer._bytes;
+			}
+		}
+	}
+
 	// 回收ThreadCache中的list
 	void  CentralCache::ReleaseListToSpans(void* start, size_t bytes)
 	{
@@ -93,34 +210,211 @@ namespace mempool {
 			void* next = NextObj(start);
 
 			// 得到当前内存对应的span，并将其链接回去
-			Span* span = PageCache::GetInstance()->MapObjectToSpan(start);
+			Span* span = PageCache::MapObjectToSpan(start);
 			NextObj(start) = span->_list;
 			span->_list = start;
 			span->_useCount--;
 
+			// 顺便把其他线程还回来的对象也合并了
+			if (span->_remoteList.load(std::memory_order_relaxed) != nullptr)
+			{
+				DrainRemoteList(span);
+			}
+
 			// 如果use count为0代表这个span中的所有内存都被回收了
-			// centralCache可以将其释放给PageCache
-			if (span->_useCount == 0)
+			// centralCache可以将其释放给PageCache，还在待合并栈中的等出栈的时候再释放
+			if (Releasable(span))
 			{
-				// 在CentralCache的缓存中删除对应span
-				_spanList[index].Erase(span);
-				span->_list = nullptr;
-				span->_next = nullptr;
-				span->_prev = nullptr;
+				ReleaseSpanToPageCache(_spanList[index], span);
+			}
+			else
+			{
+				_spanList[index].Update(span);
+			}
 
-				// 因为需要访问pagecahce了，所以需要先接触桶锁
-				_spanList[index].Unlock();
+			start = next;
+		}
 
-				PageCache::GetInstance()->Lock();
-				PageCache::GetInstance()->ReleaseSpanToPageCache(span);
-				PageCache::GetInstance()->Unlock();
+		_spanList[index].Unlock();
+	}
 
-				_spanList[index].Lock();
+	// 不属于当前线程的对象，无锁地挂到span的远程释放队列中
+	void CentralCache::RemoteFree(Span* span, void* obj)
+	{
+		size_t bytes = span->_objSize;
+		size_t index = SizeClass::Index(bytes);
+
+		// 先增加计数再挂链表：对象挂上去之前还算在_useCount里，span一定不会被回收
+		size_t n = span->_remoteCount.fetch_add(1, std::memory_order_relaxed) + 1;
+		// 攒够一批了，能拿到桶锁就顺便合并，拿不到也不等待，保证释放的时候不会阻塞
+		if (n >= SizeClass::NumMoveSize(bytes) && _spanList[index].TryLock())
+		{
+			span->_remoteCount.fetch_sub(1, std::memory_order_relaxed);
+			NextObj(obj) = span->_list;
+			span->_list = obj;
+			span->_useCount--;
+
+			if (DrainRemoteList(span))
+			{
+				ReleaseSpanToPageCache(_spanList[index], span);
+			}
+			else
+			{
+				_spanList[index].Update(span);
 			}
+			_spanList[index].Unlock();
+			return;
+		}
 
-			start = next;
+		// 第一次有远程释放时把span放进桶的待合并栈，这时对象还算在_useCount里，span不会被回收
+		PushRemoteSpan(_spanList[index], span);
+
+		// 头插到远程释放队列，挂上去之后就不能再访问span了，它随时可能被回收
+		void* head = span->_remoteList.load(std::memory_order_relaxed);
+		do
+		{
+			NextObj(obj) = head;
+		} while (!span->_remoteList.compare_exchange_weak(head, obj, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	// 已经在栈中的span不重复入栈
+	void CentralCache::PushRemoteSpan(CentralBucket& bucket, Span* span)
+	{
+		if (span->_remotePending.exchange(true, std::memory_order_acq_rel))
+		{
+			return;
 		}
+		Span* top = bucket._remoteSpans.load(std::memory_order_relaxed);
+		do
+		{
+			span->_remoteNext = top;
+		} while (!bucket._remoteSpans.compare_exchange_weak(top, span, std::memory_order_release, std::memory_order_relaxed));
+	}
 
-		_spanList[index].Unlock();
+	// 整个栈一次取出来，取出来的span还带着标记，桶锁临时解开的时候其他线程也不会回收它们
+	void CentralCache::DrainRemoteSpans(CentralBucket& bucket)
+	{
+		Span* span = bucket._remoteSpans.exchange(nullptr, std::memory_order_acquire);
+		while (span != nullptr)
+		{
+			Span* next = span->_remoteNext;
+			// 先清除标记再合并，之后再有远程释放的话span会重新入栈
+			span->_remotePending.store(false, std::memory_order_release);
+			bool releasable = DrainRemoteList(span);
+			// 计数已经增加、对象还没挂上来的远程释放，span重新入栈，下次再合并
+			if (span->_remoteCount.load(std::memory_order_relaxed) != 0)
+			{
+				PushRemoteSpan(bucket, span);
+				releasable = false;
+			}
+			if (releasable)
+			{
+				ReleaseSpanToPageCache(bucket, span);
+			}
+			else
+			{
+				bucket.Update(span);
+			}
+			span = next;
+		}
+	}
+
+	// 把span的远程释放队列合并到span的_list中，需要持有桶锁
+	bool CentralCache::DrainRemoteList(Span* span)
+	{
+		void* start = span->_remoteList.exchange(nullptr, std::memory_order_acquire);
+		if (start != nullptr)
+		{
+			// 找到队尾并统计数量
+			void* end = start;
+			size_t n = 1;
+			while (NextObj(end) != nullptr)
+			{
+				end = NextObj(end);
+				n++;
+			}
+			NextObj(end) = span->_list;
+			span->_list = start;
+			span->_useCount -= n;
+			span->_remoteCount.fetch_sub(n, std::memory_order_relaxed);
+		}
+		return Releasable(span);
+	}
+
+	// span全部回收后还给PageCache，调用前持有桶锁，函数内部会临时解开
+	void CentralCache::ReleaseSpanToPageCache(CentralBucket& bucket, Span* span)
+	{
+		// 在CentralCache的缓存中删除对应span
+		bucket.Erase(span);
+		span->_list = nullptr;
+		span->_carve = nullptr;
+		span->_carveEnd = nullptr;
+		span->_next = nullptr;
+		span->_prev = nullptr;
+
+		// 因为需要访问pagecahce了，所以需要先接触桶锁
+		bucket.Unlock();
+
+		// 还给申请这个span的节点
+		PageCache* pageCache = PageCache::GetInstance(span->_node);
+		pageCache->Lock();
+		pageCache->ReleaseSpanToPageCache(span);
+		pageCache->Unlock();
+
+		bucket.Lock();
+	}
+
+	TransferCache* CentralCache::NewTransferCaches(size_t node)
+	{
+		std::unique_lock<std::mutex> lock(_nodeMtx);
+		TransferCache* caches = _nodeTransfer[node].load(std::memory_order_relaxed);
+		if (caches == nullptr)
+		{
+			size_t bytes = SizeClass::_RoundUp(sizeof(TransferCache) * NUM_FREELIST, (size_t)1 << PAGE_SHIFT);
+			caches = static_cast<TransferCache*>(MetadataAlloc(bytes >> PAGE_SHIFT));
+			for (size_t i = 0; i < NUM_FREELIST; i++)
+			{
+				new (caches + i) TransferCache;
+			}
+			_nodeTransfer[node].store(caches, std::memory_order_release);
+		}
+		return caches;
+	}
+
+	// 持有所有桶锁和各个节点传输缓存的锁，用于fork前后
+	// 正常路径上这几种锁不会嵌套持有，所以这里按什么顺序加锁都不会死锁
+	// 先拿_nodeMtx，加锁期间不会有新的节点的传输缓存出现
+	void CentralCache::LockAll()
+	{
+		_nodeMtx.lock();
+		for (size_t i = 0; i < NUM_FREELIST; i++)
+		{
+			_spanList[i].Lock();
+		}
+		for (size_t node = 0; node < MAX_NUMA_NODES; node++)
+		{
+			TransferCache* caches = _nodeTransfer[node].load(std::memory_order_relaxed);
+			for (size_t i = 0; caches != nullptr && i < NUM_FREELIST; i++)
+			{
+				caches[i].Lock();
+			}
+		}
+	}
+
+	void CentralCache::UnlockAll()
+	{
+		for (size_t node = MAX_NUMA_NODES; node-- > 0;)
+		{
+			TransferCache* caches = _nodeTransfer[node].load(std::memory_order_relaxed);
+			for (size_t i = 0; caches != nullptr && i < NUM_FREELIST; i++)
+			{
+				caches[i].Unlock();
+			}
+		}
+		for (size_t i = 0; i < NUM_FREELIST; i++)
+		{
+			_spanList[i].Unlock();
+		}
+		_nodeMtx.unlock();
 	}
-}
\ No newline at end of file
+}
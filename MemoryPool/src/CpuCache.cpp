@@ -0,0 +1,282 @@
+#include "../include/CpuCache.h"
+#include "../include/CentralCache.h"
+#include "../include/MallocExtension.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <algorithm>
+#endif
+
+namespace mempool
+{
+#ifdef MEMPOOL_HAS_RSEQ
+#define MEMPOOL_STR_(x) #x
+#define MEMPOOL_STR(x) MEMPOOL_STR_(x)
+
+	// 当前线程的rseq结构体，由glibc在创建线程的时候注册
+	static inline struct rseq* RseqArea()
+	{
+		return reinterpret_cast<struct rseq*>(static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+	}
+
+	enum RseqResult
+	{
+		RSEQ_OK,	// 操作成功
+		RSEQ_FAIL,	// slab满了或者空了
+		RSEQ_ABORT, // 被抢占或者迁移到了其他CPU，需要重试
+	};
+
+	// rseq临界区的描述符和abort入口
+	// 内核发现线程在[1, 2)之间被抢占、迁移或者收到信号时，会跳到4处，4之前必须是RSEQ_SIG
+#define MEMPOOL_RSEQ_PROLOGUE                              \
+	".pushsection __rseq_cs, \"aw\"\n\t"                   \
+	".balign 32\n\t"                                       \
+	"3:\n\t"                                               \
+	".long 0x0, 0x0\n\t"                                   \
+	".quad 1f, (2f - 1f), 4f\n\t"                          \
+	".popsection\n\t"                                      \
+	".pushsection __rseq_failure, \"ax\"\n\t"              \
+	".byte 0x0f, 0xb9, 0x3d\n\t"                           \
+	".long " MEMPOOL_STR(RSEQ_SIG) "\n\t"                  \
+	"4:\n\t"                                               \
+	"jmp %l[abort]\n\t"                                    \
+	".popsection\n\t"                                      \
+	"leaq 3b(%%rip), %%rax\n\t"                            \
+	"movq %%rax, %[rseq_cs]\n\t"                           \
+	"1:\n\t"                                               \
+	"cmpl %[cpu], %[cpu_id]\n\t"                           \
+	"jnz %l[abort]\n\t"
+
+	// 在cpu号对应的slab上弹出栈顶对象，最后一条写current的指令是提交点
+	static RseqResult RseqPop(struct rseq* rs, uint32_t cpu, uint64_t* current, void** slots, uint64_t begin, void** out)
+	{
+		asm goto(
+			MEMPOOL_RSEQ_PROLOGUE
+			"movq %[current], %%rcx\n\t"
+			"cmpq %[begin], %%rcx\n\t"
+			"je %l[fail]\n\t"
+			"movq -8(%[slots], %%rcx, 8), %%rdx\n\t"
+			"movq %%rdx, (%[out])\n\t"
+			"decq %%rcx\n\t"
+			"movq %%rcx, %[current]\n\t"
+			"2:\n\t"
+			:
+			: [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs), [cpu] "r"(cpu),
+			  [current] "m"(*current), [begin] "r"(begin), [slots] "r"(slots), [out] "r"(out)
+			: "memory", "cc", "rax", "rcx", "rdx"
+			: abort, fail);
+		return RSEQ_OK;
+	abort:
+		return RSEQ_ABORT;
+	fail:
+		return RSEQ_FAIL;
+	}
+
+	// 在cpu号对应的slab上压入对象，同样以写current作为提交点
+	static RseqResult RseqPush(struct rseq* rs, uint32_t cpu, uint64_t* current, void** slots, uint64_t end, void* obj)
+	{
+		asm goto(
+			MEMPOOL_RSEQ_PROLOGUE
+			"movq %[current], %%rcx\n\t"
+			"cmpq %[end], %%rcx\n\t"
+			"je %l[fail]\n\t"
+			"movq %[obj], (%[slots], %%rcx, 8)\n\t"
+			"incq %%rcx\n\t"
+			"movq %%rcx, %[current]\n\t"
+			"2:\n\t"
+			:
+			: [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs), [cpu] "r"(cpu),
+			  [current] "m"(*current), [end] "r"(end), [slots] "r"(slots), [obj] "r"(obj)
+			: "memory", "cc", "rax", "rcx"
+			: abort, fail);
+		return RSEQ_OK;
+	abort:
+		return RSEQ_ABORT;
+	fail:
+		return RSEQ_FAIL;
+	}
+#endif
+
+	CpuCache::CpuCache()
+	{
+#ifdef MEMPOOL_HAS_RSEQ
+		// glibc没有注册rseq（比如通过tunable关掉了），全部走TLSThreadCache
+		if (__rseq_size == 0)
+		{
+			return;
+		}
+
+		// 计算每个桶的对象大小和在slab中的位置，slab开头的NUM_FREELIST个位置存放每个桶的栈顶下标
+		size_t slot = NUM_FREELIST;
+		for (size_t i = 0; i < NUM_FREELIST; i++)
+		{
+			_classSize[i] = SizeClass::ClassSize(i);
+			// 小对象多缓存一些，大对象少缓存一些，但不会超过一次移动的数量
+			size_t capacity = PERCPU_CLASS_BYTES / _classSize[i];
+			capacity = std::max<size_t>(capacity, 1);
+			capacity = std::min(capacity, SizeClass::NumMoveSize(_classSize[i]));
+			_begin[i] = slot;
+			_end[i] = slot + capacity;
+			slot += capacity;
+		}
+		_slabStride = SizeClass::_RoundUp(slot * sizeof(void*), 1 << PAGE_SHIFT);
+
+		long cpus = sysconf(_SC_NPROCESSORS_CONF);
+		_numCpus = cpus > 0 ? static_cast<size_t>(cpus) : 1;
+		// 没有用过的CPU对应的slab只会访问开头的栈顶下标，剩余的页不会被真正分配
+		_slabs = static_cast<char*>(MetadataAlloc((_numCpus * _slabStride) >> PAGE_SHIFT));
+		for (size_t cpu = 0; cpu < _numCpus; cpu++)
+		{
+			uint64_t* current = reinterpret_cast<uint64_t*>(_slabs + cpu * _slabStride);
+			for (size_t i = 0; i < NUM_FREELIST; i++)
+			{
+				current[i] = _begin[i];
+			}
+		}
+#endif
+	}
+
+	// 当前线程能否使用per-CPU缓存
+	bool CpuCache::IsActive()
+	{
+#ifdef MEMPOOL_HAS_RSEQ
+		if (_slabs == nullptr)
+		{
+			return false;
+		}
+		// 线程没有注册rseq的时候cpu_id是负数
+		int32_t cpu = static_cast<int32_t>(__atomic_load_n(&RseqArea()->cpu_id, __ATOMIC_RELAXED));
+		return cpu >= 0 && static_cast<size_t>(cpu) < _numCpus;
+#else
+		return false;
+#endif
+	}
+
+	bool CpuCache::Push(size_t index, void* obj)
+	{
+#ifdef MEMPOOL_HAS_RSEQ
+		struct rseq* rs = RseqArea();
+		while (true)
+		{
+			uint32_t cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+			char* slab = _slabs + cpu * _slabStride;
+			uint64_t* current = reinterpret_cast<uint64_t*>(slab) + index;
+			RseqResult ret = RseqPush(rs, cpu, current, reinterpret_cast<void**>(slab), _end[index], obj);
+			if (ret != RSEQ_ABORT)
+			{
+				return ret == RSEQ_OK;
+			}
+		}
+#else
+		(void)index;
+		(void)obj;
+		assert(false);
+		return false;
+#endif
+	}
+
+	bool CpuCache::Pop(size_t index, void*& obj)
+	{
+#ifdef MEMPOOL_HAS_RSEQ
+		struct rseq* rs = RseqArea();
+		while (true)
+		{
+			uint32_t cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+			char* slab = _slabs + cpu * _slabStride;
+			uint64_t* current = reinterpret_cast<uint64_t*>(slab) + index;
+			RseqResult ret = RseqPop(rs, cpu, current, reinterpret_cast<void**>(slab), _begin[index], &obj);
+			if (ret != RSEQ_ABORT)
+			{
+				return ret == RSEQ_OK;
+			}
+		}
+#else
+		(void)index;
+		(void)obj;
+		assert(false);
+		return false;
+#endif
+	}
+
+	void* CpuCache::Allocate(size_t bytes)
+	{
+		assert(bytes <= MAX_SIZE);
+		size_t index = SizeClass::Index(bytes);
+		void* obj = nullptr;
+		if (Pop(index, obj))
+		{
+			return obj;
+		}
+		return Refill(index, _classSize[index]);
+	}
+
+	void CpuCache::Deallocate(void* ptr, size_t bytes)
+	{
+		assert(ptr != nullptr);
+		assert(bytes <= MAX_SIZE);
+		size_t index = SizeClass::Index(bytes);
+		if (!Push(index, ptr))
+		{
+			Drain(index, _classSize[index], ptr);
+		}
+	}
+
+	// slab空了，从中心缓存获取半个slab的对象
+	void* CpuCache::Refill(size_t index, size_t bytes)
+	{
+		size_t batchNum = std::max<size_t>((_end[index] - _begin[index]) / 2, 1);
+		void* start = nullptr;
+		void* end = nullptr;
+		size_t actualNum = CentralCache::GetInstance()->FetchRangeObj(start, end, batchNum, bytes);
+		CurrentThreadStats()->RecordFetch(index, actualNum);
+
+		// 第一个直接返回，剩下的放进slab
+		// 期间线程可能被迁移到其他CPU，放不下的再还给中心缓存
+		void* obj = start;
+		void* cur = NextObj(start);
+		void* overflow = nullptr;
+		void* overflowEnd = nullptr;
+		size_t overflowNum = 0;
+		for (size_t i = 1; i < actualNum; i++)
+		{
+			void* next = NextObj(cur);
+			if (!Push(index, cur))
+			{
+				NextObj(cur) = overflow;
+				if (overflow == nullptr)
+				{
+					overflowEnd = cur;
+				}
+				overflow = cur;
+				overflowNum++;
+			}
+			cur = next;
+		}
+		if (overflowNum != 0)
+		{
+			CurrentThreadStats()->RecordReturn(index, overflowNum);
+			CentralCache::GetInstance()->ReleaseRangeObj(overflow, overflowEnd, overflowNum, bytes);
+		}
+		return obj;
+	}
+
+	// slab满了，弹出一部分对象和obj凑成和Refill一样大的一批，还给中心缓存
+	// 批次大小一致，传输缓存里的批次才能被其他CPU直接拿走
+	void CpuCache::Drain(size_t index, size_t bytes, void* obj)
+	{
+		size_t batchNum = std::max<size_t>((_end[index] - _begin[index]) / 2, 1);
+		void* start = obj;
+		void* end = obj;
+		NextObj(obj) = nullptr;
+		size_t n = 1;
+		void* cur = nullptr;
+		while (n < batchNum && Pop(index, cur))
+		{
+			NextObj(cur) = start;
+			start = cur;
+			n++;
+		}
+		CurrentThreadStats()->RecordReturn(index, n);
+		CentralCache::GetInstance()->ReleaseRangeObj(start, end, n, bytes);
+	}
+}
@@ -0,0 +1,474 @@
+#include "../include/GuardedPageAllocator.h"
+#include "../include/PageCache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifdef __linux__
+#include <csignal>
+#include <execinfo.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+namespace mempool
+{
+#ifdef _WIN32
+	_declspec(thread) long long TLSGuardCountdown = 0;
+	static _declspec(thread) size_t TLSGuardRate = 0;
+	static _declspec(thread) unsigned long long TLSGuardRandom = 0;
+#elif __linux__
+	__thread long long TLSGuardCountdown __attribute__((tls_model("initial-exec"))) = 0;
+	static __thread size_t TLSGuardRate __attribute__((tls_model("initial-exec"))) = 0; // 倒计时是按照哪个采样间隔生成的
+	static __thread unsigned long long TLSGuardRandom __attribute__((tls_model("initial-exec"))) = 0;
+#endif
+
+	static std::atomic<size_t> guardRate{0};
+	static std::atomic<size_t> guardedCount{0};
+	static std::mutex guardMtx;
+
+	// 保留的地址空间：保护页、槽0、保护页、槽1……槽GUARDED_SLOTS-1、保护页，每一块都是slotBytes
+	// 初始化完成之后才设置guardRegion，信号处理函数看到它不为空时其他变量都已经设置好了
+	static std::atomic<char*> guardRegion{nullptr};
+	static size_t slotBytes = 0;
+	static size_t regionBytes = 0;
+	static GuardedSlot slots[GUARDED_SLOTS];
+
+	// 空闲的槽按释放的先后排成环形队列，最久之前释放的先被复用
+	static size_t freeSlots[GUARDED_SLOTS];
+	static size_t freeHead = 0;
+	static size_t freeCount = 0;
+
+	// 每个线程自己的随机数，xorshift64
+	static unsigned long long NextRandom()
+	{
+		if (TLSGuardRandom == 0)
+		{
+			TLSGuardRandom = (reinterpret_cast<unsigned long long>(&TLSGuardRandom) ^ (NowMs() * 0x9E3779B97F4A7C15ULL)) | 1;
+		}
+		TLSGuardRandom ^= TLSGuardRandom >> 12;
+		TLSGuardRandom ^= TLSGuardRandom << 25;
+		TLSGuardRandom ^= TLSGuardRandom >> 27;
+		return TLSGuardRandom * 0x2545F4914F6CDD1DULL;
+	}
+
+	static size_t CurrentThreadId()
+	{
+#ifdef _WIN32
+		return GetCurrentThreadId();
+#elif __linux__
+		return static_cast<size_t>(syscall(SYS_gettid));
+#endif
+	}
+
+	static char* SlotAddress(char* region, size_t index)
+	{
+		return region + (2 * index + 1) * slotBytes;
+	}
+
+	// 槽在使用时可读写，空闲时不可访问，物理内存还给操作系统
+	static bool ProtectSlot(char* start, bool accessible)
+	{
+#ifdef _WIN32
+		if (accessible)
+		{
+			return VirtualAlloc(start, slotBytes, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+		}
+		return VirtualFree(start, slotBytes, MEM_DECOMMIT) != 0;
+#elif __linux__
+		if (accessible)
+		{
+			return mprotect(start, slotBytes, PROT_READ | PROT_WRITE) == 0;
+		}
+		bool ok = mprotect(start, slotBytes, PROT_NONE) == 0;
+		madvise(start, slotBytes, MADV_DONTNEED);
+		return ok;
+#endif
+	}
+
+	// 出错报告，只用snprintf和write，信号处理函数中也可以调用
+	static void WriteReport(const char* text)
+	{
+#ifdef _WIN32
+		fputs(text, stderr);
+		fflush(stderr);
+#elif __linux__
+		size_t len = 0;
+		while (text[len] != '\0')
+		{
+			len++;
+		}
+		while (len > 0)
+		{
+			ssize_t n = write(STDERR_FILENO, text, len);
+			if (n <= 0)
+			{
+				break;
+			}
+			text += n;
+			len -= n;
+		}
+#endif
+	}
+
+	static void WriteStack(const char* action, size_t thread, void* const* stack, int depth)
+	{
+		char buf[128];
+		snprintf(buf, sizeof(buf), "%s by thread %zu:\n", action, thread);
+		WriteReport(buf);
+#ifdef _WIN32
+		for (int i = 0; i < depth; i++)
+		{
+			snprintf(buf, sizeof(buf), "    #%d %p\n", i, stack[i]);
+			WriteReport(buf);
+		}
+#elif __linux__
+		// backtrace_symbols_fd不申请内存
+		backtrace_symbols_fd(stack, depth, STDERR_FILENO);
+#endif
+	}
+
+	// 输出错误类型、地址和对象的关系，以及对象申请和释放时的调用栈
+	static void Report(const char* error, const void* addr, GuardedSlot* slot)
+	{
+		char buf[256];
+		snprintf(buf, sizeof(buf), "==mempool== guarded allocation: %s on address %p\n", error, addr);
+		WriteReport(buf);
+		if (slot == nullptr || slot->_ptr == nullptr)
+		{
+			return;
+		}
+
+		size_t a = reinterpret_cast<size_t>(addr);
+		size_t begin = reinterpret_cast<size_t>(slot->_ptr);
+		size_t end = begin + slot->_size;
+		if (a < begin)
+		{
+			snprintf(buf, sizeof(buf), "%p is %zu bytes to the left of %zu-byte object at %p\n", addr, begin - a, slot->_size, slot->_ptr);
+		}
+		else if (a >= end)
+		{
+			snprintf(buf, sizeof(buf), "%p is %zu bytes to the right of %zu-byte object at %p\n", addr, a - end, slot->_size, slot->_ptr);
+		}
+		else
+		{
+			snprintf(buf, sizeof(buf), "%p is %zu bytes inside of %zu-byte object at %p\n", addr, a - begin, slot->_size, slot->_ptr);
+		}
+		WriteReport(buf);
+		WriteStack("allocated", slot->_allocThread, slot->_allocStack, slot->_allocDepth);
+		if (!slot->_inUse.load(std::memory_order_acquire) && slot->_freeDepth != 0)
+		{
+			WriteStack("freed", slot->_freeThread, slot->_freeStack, slot->_freeDepth);
+		}
+	}
+
+	// 访问了保留区域中不可访问的地址，判断出错的类型
+	// 槽本身不可访问说明对象已经释放；保护页按离哪一边的对象更近，算作那个对象的越界
+	static void ReportFault(char* region, const void* addr)
+	{
+		size_t unit = (reinterpret_cast<size_t>(addr) - reinterpret_cast<size_t>(region)) / slotBytes;
+		if (unit % 2 == 1)
+		{
+			GuardedSlot* slot = &slots[unit / 2];
+			Report(slot->_inUse.load(std::memory_order_acquire) ? "unknown fault" : "use-after-free", addr, slot);
+			return;
+		}
+
+		GuardedSlot* left = unit >= 2 ? &slots[unit / 2 - 1] : nullptr;
+		GuardedSlot* right = unit / 2 < GUARDED_SLOTS ? &slots[unit / 2] : nullptr;
+		size_t a = reinterpret_cast<size_t>(addr);
+		size_t leftDistance = static_cast<size_t>(-1);
+		size_t rightDistance = static_cast<size_t>(-1);
+		if (left != nullptr && left->_ptr != nullptr)
+		{
+			leftDistance = a - (reinterpret_cast<size_t>(left->_ptr) + left->_size);
+		}
+		if (right != nullptr && right->_ptr != nullptr)
+		{
+			rightDistance = reinterpret_cast<size_t>(right->_ptr) - a;
+		}
+		if (leftDistance == static_cast<size_t>(-1) && rightDistance == static_cast<size_t>(-1))
+		{
+			Report("wild access to guard page", addr, nullptr);
+		}
+		else if (leftDistance <= rightDistance)
+		{
+			Report("buffer overflow", addr, left);
+		}
+		else
+		{
+			Report("buffer underflow", addr, right);
+		}
+	}
+
+#ifdef _WIN32
+	static volatile LONG faultReported = 0;
+
+	// 只输出报告，继续交给后面的处理程序，没有处理的话程序照常崩溃
+	static LONG CALLBACK GuardFaultHandler(PEXCEPTION_POINTERS info)
+	{
+		char* region = guardRegion.load(std::memory_order_acquire);
+		if (info->ExceptionRecord->ExceptionCode == EXCEPTION_ACCESS_VIOLATION && region != nullptr)
+		{
+			char* addr = reinterpret_cast<char*>(info->ExceptionRecord->ExceptionInformation[1]);
+			if (addr >= region && addr < region + regionBytes && InterlockedExchange(&faultReported, 1) == 0)
+			{
+				ReportFault(region, addr);
+			}
+		}
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+
+	static void InstallFaultHandler()
+	{
+		AddVectoredExceptionHandler(1, GuardFaultHandler);
+	}
+#elif __linux__
+	static struct sigaction previousAction;
+
+	// 保留区域中的段错误输出报告后恢复原来的处理方式，返回后重新执行出错的指令
+	// 再次出错时由原来的处理函数处理，默认就是终止进程并产生core
+	static void GuardFaultHandler(int sig, siginfo_t* info, void* context)
+	{
+		char* region = guardRegion.load(std::memory_order_acquire);
+		char* addr = static_cast<char*>(info->si_addr);
+		if (region != nullptr && addr >= region && addr < region + regionBytes)
+		{
+			ReportFault(region, addr);
+			sigaction(SIGSEGV, &previousAction, nullptr);
+			return;
+		}
+
+		// 和保护页无关的段错误交给原来的处理函数
+		if ((previousAction.sa_flags & SA_SIGINFO) != 0)
+		{
+			previousAction.sa_sigaction(sig, info, context);
+		}
+		else if (previousAction.sa_handler != SIG_DFL && previousAction.sa_handler != SIG_IGN)
+		{
+			previousAction.sa_handler(sig);
+		}
+		else
+		{
+			signal(SIGSEGV, SIG_DFL);
+		}
+	}
+
+	static void InstallFaultHandler()
+	{
+		struct sigaction action = {};
+		action.sa_sigaction = GuardFaultHandler;
+		action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGSEGV, &action, &previousAction);
+	}
+#endif
+
+	// 第一次开启时保留地址空间、登记每个槽的span并安装信号处理函数
+	// 只保留地址不提交物理内存，开启之后不再释放
+	static bool InitRegion()
+	{
+		std::unique_lock<std::mutex> lock(guardMtx);
+		if (guardRegion.load(std::memory_order_relaxed) != nullptr)
+		{
+			return true;
+		}
+
+		// 槽至少一个系统页，并且是内存池页的整数倍，这样才能按页号登记span
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		size_t systemPage = info.dwPageSize;
+#elif __linux__
+		size_t systemPage = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+		slotBytes = systemPage > (1 << PAGE_SHIFT) ? systemPage : (1 << PAGE_SHIFT);
+		regionBytes = (2 * GUARDED_SLOTS + 1) * slotBytes;
+
+		// 多保留一个槽的大小，把起始位置对齐到slotBytes
+#ifdef _WIN32
+		char* raw = static_cast<char*>(VirtualAlloc(nullptr, regionBytes + slotBytes, MEM_RESERVE, PAGE_NOACCESS));
+		if (raw == nullptr)
+		{
+			return false;
+		}
+#elif __linux__
+		void* ptr = mmap(nullptr, regionBytes + slotBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (ptr == MAP_FAILED)
+		{
+			return false;
+		}
+		char* raw = static_cast<char*>(ptr);
+#endif
+		char* region = reinterpret_cast<char*>(SizeClass::_RoundUp(reinterpret_cast<size_t>(raw), slotBytes));
+
+		PageCache* pageCache = PageCache::GetInstance(0);
+		pageCache->Lock();
+		for (size_t i = 0; i < GUARDED_SLOTS; i++)
+		{
+			PageID id = reinterpret_cast<size_t>(SlotAddress(region, i)) >> PAGE_SHIFT;
+			Span* span = pageCache->NewExternalSpan(id, slotBytes >> PAGE_SHIFT);
+			// 按大块内存标记，释放时在大块内存的分支中检查_guard
+			span->_objSize = MAX_SIZE + 1;
+			span->_guard = &slots[i];
+			slots[i]._span = span;
+			freeSlots[i] = i;
+		}
+		pageCache->Unlock();
+		freeHead = 0;
+		freeCount = GUARDED_SLOTS;
+
+		InstallFaultHandler();
+		guardRegion.store(region, std::memory_order_release);
+		return true;
+	}
+
+	void GuardedPageAllocator::SetSampleRate(size_t n)
+	{
+		if (n != 0)
+		{
+			if (!InitRegion())
+			{
+				return; // 地址空间不够，保持关闭
+			}
+			heapSamplingUsed = true;
+			// 第一次调用backtrace会加载libgcc并申请内存，提前在这里调用一次
+			void* stack[1];
+			HeapProfiler::CaptureStack(stack, 1);
+		}
+		guardRate = n;
+	}
+
+	size_t GuardedPageAllocator::GetSampleRate()
+	{
+		return guardRate.load(std::memory_order_relaxed);
+	}
+
+	// 间隔在[1, 2n-1]中均匀分布，平均每n次申请使用一次保护页，又不会固定在循环中的同一个位置
+	bool GuardedPageAllocator::PickNextGuard()
+	{
+		size_t rate = guardRate.load(std::memory_order_relaxed);
+		if (rate == 0)
+		{
+			TLSGuardRate = 0;
+			TLSGuardCountdown = GUARD_RECHECK;
+			return false;
+		}
+		long long interval = static_cast<long long>(1 + NextRandom() % (2 * rate - 1));
+		if (TLSGuardRate != rate)
+		{
+			// 刚开启或者换了采样间隔，之前的倒计时作废，这次不使用保护页
+			TLSGuardRate = rate;
+			TLSGuardCountdown = interval - 1;
+			return false;
+		}
+		TLSGuardCountdown = interval - 1;
+		return true;
+	}
+
+	void* GuardedPageAllocator::Allocate(size_t size)
+	{
+		size = size == 0 ? 1 : size;
+		size_t index = 0;
+		{
+			std::unique_lock<std::mutex> lock(guardMtx);
+			if (size > slotBytes || freeCount == 0)
+			{
+				return nullptr;
+			}
+			index = freeSlots[freeHead];
+			freeHead = (freeHead + 1) % GUARDED_SLOTS;
+			freeCount--;
+		}
+
+		GuardedSlot& slot = slots[index];
+		char* start = SlotAddress(guardRegion.load(std::memory_order_relaxed), index);
+		if (!ProtectSlot(start, true))
+		{
+			// mprotect可能因为映射数量达到上限失败，放回队列，这次走普通的路径
+			std::unique_lock<std::mutex> lock(guardMtx);
+			freeSlots[(freeHead + freeCount) % GUARDED_SLOTS] = index;
+			freeCount++;
+			return nullptr;
+		}
+
+		// 随机放在槽的开头或者末尾，分别发现向前和向后的越界
+		// 放在末尾时按桶大小的最低位对齐，和普通路径的对象对齐一样，末尾可能留下几个字节发现不了
+		char* ptr = start;
+		if (NextRandom() & 1)
+		{
+			size_t rounded = SizeClass::RoundUp(size);
+			size_t align = rounded & (~rounded + 1);
+			ptr = start + slotBytes - SizeClass::_RoundUp(size, align);
+		}
+
+		// 第一层是Allocate自己，不记录
+		void* stack[MAX_STACK_DEPTH + 1];
+		int depth = HeapProfiler::CaptureStack(stack, MAX_STACK_DEPTH + 1);
+		slot._allocDepth = depth > 1 ? depth - 1 : 0;
+		memcpy(slot._allocStack, stack + 1, slot._allocDepth * sizeof(void*));
+		slot._allocThread = CurrentThreadId();
+		slot._freeDepth = 0;
+		slot._ptr = ptr;
+		slot._size = size;
+		slot._inUse.store(true, std::memory_order_release);
+		guardedCount++;
+		return ptr;
+	}
+
+	void GuardedPageAllocator::Deallocate(void* ptr, Span* span)
+	{
+		GuardedSlot* slot = span->_guard;
+		if (ptr != slot->_ptr)
+		{
+			Report("invalid free", ptr, slot);
+			abort();
+		}
+		if (!slot->_inUse.exchange(false, std::memory_order_acq_rel))
+		{
+			Report("double free", ptr, slot);
+			abort();
+		}
+
+		void* stack[MAX_STACK_DEPTH + 1];
+		int depth = HeapProfiler::CaptureStack(stack, MAX_STACK_DEPTH + 1);
+		slot->_freeDepth = depth > 1 ? depth - 1 : 0;
+		memcpy(slot->_freeStack, stack + 1, slot->_freeDepth * sizeof(void*));
+		slot->_freeThread = CurrentThreadId();
+
+		size_t index = slot - slots;
+		ProtectSlot(SlotAddress(guardRegion.load(std::memory_order_relaxed), index), false);
+		guardedCount--;
+
+		std::unique_lock<std::mutex> lock(guardMtx);
+		freeSlots[(freeHead + freeCount) % GUARDED_SLOTS] = index;
+		freeCount++;
+	}
+
+	bool GuardedPageAllocator::IsGuarded(void* ptr)
+	{
+		char* region = guardRegion.load(std::memory_order_acquire);
+		return region != nullptr && static_cast<char*>(ptr) >= region && static_cast<char*>(ptr) < region + regionBytes;
+	}
+
+	size_t GuardedPageAllocator::GetGuardedCount()
+	{
+		return guardedCount.load(std::memory_order_relaxed);
+	}
+
+	size_t GuardedPageAllocator::GetSlotBytes()
+	{
+		std::unique_lock<std::mutex> lock(guardMtx);
+		return slotBytes;
+	}
+
+	void GuardedPageAllocator::LockAll()
+	{
+		guardMtx.lock();
+	}
+
+	void GuardedPageAllocator::UnlockAll()
+	{
+		guardMtx.unlock();
+	}
+}
@@ -0,0 +1,327 @@
+#include "../include/HeapProfiler.h"
+#include "../include/PageCache.h"
+#include "../include/MallocExtension.h"
+#include "../include/FixedMemPool.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+namespace mempool
+{
+	static const long long SAMPLE_RECHECK_BYTES = 1024 * 1024; // 关闭采样时，每隔多少字节重新检查一次采样间隔
+
+#ifdef _WIN32
+	_declspec(thread) long long TLSSampleCountdown = 0;
+	static _declspec(thread) size_t TLSSampleRate = 0;
+	static _declspec(thread) unsigned long long TLSRandom = 0;
+#elif __linux__
+	__thread long long TLSSampleCountdown __attribute__((tls_model("initial-exec"))) = 0;
+	static __thread size_t TLSSampleRate __attribute__((tls_model("initial-exec"))) = 0; // 倒计时是按照哪个采样间隔生成的
+	static __thread unsigned long long TLSRandom __attribute__((tls_model("initial-exec"))) = 0;
+#endif
+
+	static std::atomic<size_t> sampleRate{0};
+	static FixedMemoryPool<HeapSample> samplePool;
+	static HeapSample* sampleHead = nullptr; // 存活的采样对象链表
+	static size_t sampleCount = 0;
+	static std::mutex sampleMtx;
+
+	// 每个线程自己的随机数，xorshift64*
+	static double NextRandom()
+	{
+		if (TLSRandom == 0)
+		{
+			TLSRandom = (reinterpret_cast<unsigned long long>(&TLSRandom) ^ (NowMs() * 0x9E3779B97F4A7C15ULL)) | 1;
+		}
+		TLSRandom ^= TLSRandom >> 12;
+		TLSRandom ^= TLSRandom << 25;
+		TLSRandom ^= TLSRandom >> 27;
+		unsigned long long x = TLSRandom * 0x2545F4914F6CDD1DULL;
+		// 取高53位，得到(0, 1]之间的均匀分布
+		return ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+	}
+
+	// 采样间隔服从指数分布，这样每个字节被采样的概率都相同（泊松过程）
+	static long long NextSampleInterval(size_t rate)
+	{
+		double interval = -std::log(NextRandom()) * rate;
+		return interval < 1 ? 1 : static_cast<long long>(interval);
+	}
+
+	void HeapProfiler::SetSampleRate(size_t bytes)
+	{
+		if (bytes != 0)
+		{
+			heapSamplingUsed = true;
+			// 第一次调用backtrace会加载libgcc并申请内存，提前在这里调用一次
+			void* stack[1];
+			CaptureStack(stack, 1);
+		}
+		sampleRate = bytes;
+	}
+
+	size_t HeapProfiler::GetSampleRate()
+	{
+		return sampleRate.load(std::memory_order_relaxed);
+	}
+
+	bool HeapProfiler::PickNextSample()
+	{
+		size_t rate = sampleRate.load(std::memory_order_relaxed);
+		if (rate == 0)
+		{
+			TLSSampleRate = 0;
+			TLSSampleCountdown = SAMPLE_RECHECK_BYTES;
+			return false;
+		}
+		if (TLSSampleRate != rate)
+		{
+			// 刚开启采样或者换了采样间隔，之前的倒计时作废，这次不采样
+			TLSSampleRate = rate;
+			TLSSampleCountdown = NextSampleInterval(rate);
+			return false;
+		}
+		TLSSampleCountdown = NextSampleInterval(rate);
+		return true;
+	}
+
+	void* HeapProfiler::SampledAlloc(size_t size)
+	{
+		void* stack[MAX_STACK_DEPTH + 1];
+		int depth = CaptureStack(stack, MAX_STACK_DEPTH + 1);
+
+		// 小对象也单独占用整页，采样间隔远大于一页，浪费的内存可以忽略
+		size_t kpage = SizeClass::_RoundUp(size, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+		HeapSample* sample = samplePool.New();
+		PageCache* pageCache = PageCache::GetInstance();
+		pageCache->Lock();
+		Span* span = pageCache->NewSpan(kpage);
+		// 按大块内存标记，释放时走PageCache的路径
+		span->_objSize = size > MAX_SIZE ? size : MAX_SIZE + 1;
+		span->_sample = sample;
+		pageCache->Unlock();
+		CurrentThreadStats()->RecordLarge(kpage << PAGE_SHIFT);
+
+		// 第一层是SampledAlloc自己，不记录
+		sample->_ptr = reinterpret_cast<void*>(span->_pageId << PAGE_SHIFT);
+		sample->_size = size;
+		sample->_rate = TLSSampleRate;
+		sample->_depth = depth > 1 ? depth - 1 : 0;
+		memcpy(sample->_stack, stack + 1, sample->_depth * sizeof(void*));
+
+		std::unique_lock<std::mutex> lock(sampleMtx);
+		sample->_next = sampleHead;
+		if (sampleHead != nullptr)
+		{
+			sampleHead->_prev = sample;
+		}
+		sampleHead = sample;
+		sampleCount++;
+		return sample->_ptr;
+	}
+
+	void HeapProfiler::SampledFree(Span* span)
+	{
+		HeapSample* sample = span->_sample;
+		{
+			std::unique_lock<std::mutex> lock(sampleMtx);
+			if (sample->_prev != nullptr)
+			{
+				sample->_prev->_next = sample->_next;
+			}
+			else
+			{
+				sampleHead = sample->_next;
+			}
+			if (sample->_next != nullptr)
+			{
+				sample->_next->_prev = sample->_prev;
+			}
+			sampleCount--;
+		}
+		span->_sample = nullptr;
+		samplePool.Delete(sample);
+	}
+
+	// 采样时先从samplePool拿记录，再加sampleMtx，两把锁不会嵌套
+	void HeapProfiler::LockAll()
+	{
+		samplePool.Lock();
+		sampleMtx.lock();
+	}
+
+	void HeapProfiler::UnlockAll()
+	{
+		sampleMtx.unlock();
+		samplePool.Unlock();
+	}
+
+	size_t HeapProfiler::GetSampleCount()
+	{
+		std::unique_lock<std::mutex> lock(sampleMtx);
+		return sampleCount;
+	}
+
+	// 复制一份存活的采样对象
+	// 复制的时候不能持有锁去申请内存，否则替换了malloc之后可能会在采样时再次加锁
+	static void CopySamples(std::vector<HeapSample>& samples)
+	{
+		while (true)
+		{
+			samples.reserve(HeapProfiler::GetSampleCount() + 16);
+			std::unique_lock<std::mutex> lock(sampleMtx);
+			if (sampleCount > samples.capacity())
+			{
+				continue;
+			}
+			for (HeapSample* cur = sampleHead; cur != nullptr; cur = cur->_next)
+			{
+				samples.push_back(*cur);
+			}
+			return;
+		}
+	}
+
+	// 同一个调用栈的采样对象汇总在一起
+	struct StackRecord
+	{
+		const HeapSample* _sample; // 调用栈取第一个采样对象的
+		size_t _count = 0;		   // 采样对象数量
+		size_t _bytes = 0;		   // 采样对象的字节数
+		double _estCount = 0;	   // 估算的实际对象数量
+		double _estBytes = 0;	   // 估算的实际字节数
+	};
+
+	static bool StackLess(const HeapSample& a, const HeapSample& b)
+	{
+		if (a._depth != b._depth)
+		{
+			return a._depth < b._depth;
+		}
+		return memcmp(a._stack, b._stack, a._depth * sizeof(void*)) < 0;
+	}
+
+	static void GroupByStack(std::vector<HeapSample>& samples, std::vector<StackRecord>& records)
+	{
+		std::sort(samples.begin(), samples.end(), StackLess);
+		for (size_t i = 0; i < samples.size(); i++)
+		{
+			const HeapSample& sample = samples[i];
+			if (records.empty() || StackLess(*records.back()._sample, sample))
+			{
+				StackRecord record;
+				record._sample = &sample;
+				records.push_back(record);
+			}
+			// 大小为size的对象被采样的概率是1-exp(-size/rate)，用它的倒数作为这个采样代表的对象数量
+			double scale = 1.0 / (1.0 - std::exp(-static_cast<double>(sample._size) / sample._rate));
+			StackRecord& record = records.back();
+			record._count++;
+			record._bytes += sample._size;
+			record._estCount += scale;
+			record._estBytes += scale * sample._size;
+		}
+	}
+
+	std::string HeapProfiler::DumpText()
+	{
+		std::vector<HeapSample> samples;
+		CopySamples(samples);
+		std::vector<StackRecord> records;
+		GroupByStack(samples, records);
+		std::sort(records.begin(), records.end(), [](const StackRecord& a, const StackRecord& b) {
+			return a._estBytes > b._estBytes;
+		});
+
+		double totalBytes = 0;
+		double totalCount = 0;
+		for (const StackRecord& record : records)
+		{
+			totalBytes += record._estBytes;
+			totalCount += record._estCount;
+		}
+
+		std::string out;
+		char line[256];
+		snprintf(line, sizeof(line), "heap profile: %zu live samples, sample rate %zu bytes, estimated %.0f bytes in %.0f objects\n",
+				 samples.size(), GetSampleRate(), totalBytes, totalCount);
+		out += line;
+		for (const StackRecord& record : records)
+		{
+			snprintf(line, sizeof(line), "%12.0f bytes %10.0f objects (%zu samples, %zu bytes sampled)\n",
+					 record._estBytes, record._estCount, record._count, record._bytes);
+			out += line;
+#ifdef __linux__
+			char** symbols = backtrace_symbols(record._sample->_stack, record._sample->_depth);
+#endif
+			for (int i = 0; i < record._sample->_depth; i++)
+			{
+#ifdef __linux__
+				snprintf(line, sizeof(line), "    #%-2d %s\n", i, symbols != nullptr ? symbols[i] : "");
+#else
+				snprintf(line, sizeof(line), "    #%-2d %p\n", i, record._sample->_stack[i]);
+#endif
+				out += line;
+			}
+#ifdef __linux__
+			free(symbols);
+#endif
+		}
+		return out;
+	}
+
+	std::string HeapProfiler::DumpPprof()
+	{
+		std::vector<HeapSample> samples;
+		CopySamples(samples);
+		std::vector<StackRecord> records;
+		GroupByStack(samples, records);
+
+		size_t totalCount = 0;
+		size_t totalBytes = 0;
+		for (const StackRecord& record : records)
+		{
+			totalCount += record._count;
+			totalBytes += record._bytes;
+		}
+
+		// 只记录了存活的对象，in-use和alloc两组数字相同；数字是原始的采样值，由pprof按照heap_v2的采样间隔换算
+		std::string out;
+		char line[256];
+		snprintf(line, sizeof(line), "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+				 totalCount, totalBytes, totalCount, totalBytes, GetSampleRate());
+		out += line;
+		for (const StackRecord& record : records)
+		{
+			snprintf(line, sizeof(line), "%6zu: %8zu [%6zu: %8zu] @",
+					 record._count, record._bytes, record._count, record._bytes);
+			out += line;
+			for (int i = 0; i < record._sample->_depth; i++)
+			{
+				snprintf(line, sizeof(line), " %p", record._sample->_stack[i]);
+				out += line;
+			}
+			out += "\n";
+		}
+
+		// pprof需要内存映射来把地址对应到动态库
+		out += "\nMAPPED_LIBRARIES:\n";
+#ifdef __linux__
+		FILE* maps = fopen("/proc/self/maps", "r");
+		if (maps != nullptr)
+		{
+			char buf[4096];
+			size_t n = 0;
+			while ((n = fread(buf, 1, sizeof(buf), maps)) > 0)
+			{
+				out.append(buf, n);
+			}
+			fclose(maps);
+		}
+#endif
+		return out;
+	}
+}
@@ -0,0 +1,322 @@
+#include "../include/MallocExtension.h"
+#include "../include/PageCache.h"
+#include "../include/CentralCache.h"
+#include "../include/FixedMemPool.hpp"
+
+#include <cstdio>
+#include <cstring>
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+namespace mempool
+{
+#ifdef _WIN32
+	_declspec(thread) ThreadStats* TLSThreadStats = nullptr;
+#elif __linux__
+	__thread ThreadStats* TLSThreadStats __attribute__((tls_model("initial-exec"))) = nullptr;
+#endif
+
+	// 所有线程的计数器都从这个定长内存池中获取
+	static FixedMemoryPool<ThreadStats> statsPool;
+	// 正在运行的线程的计数器链表
+	static ThreadStats* statsHead = nullptr;
+	// 已经退出的线程的计数器累加到这里，只在持有statsMtx的时候修改
+	static ThreadStats retiredStats;
+	static std::mutex statsMtx;
+
+#ifdef _WIN32
+	static VOID WINAPI ThreadStatsExit(PVOID stats)
+	{
+		if (stats != nullptr)
+		{
+			ThreadStats::Destroy(static_cast<ThreadStats*>(stats));
+		}
+	}
+#elif __linux__
+	static void ThreadStatsExit(void* stats)
+	{
+		ThreadStats::Destroy(static_cast<ThreadStats*>(stats));
+	}
+#endif
+
+	ThreadStats* ThreadStats::Create()
+	{
+		ThreadStats* stats = statsPool.New();
+		{
+			std::unique_lock<std::mutex> lock(statsMtx);
+			stats->_next = statsHead;
+			if (statsHead != nullptr)
+			{
+				statsHead->_prev = stats;
+			}
+			statsHead = stats;
+		}
+		// 注册线程退出时的回调，和ThreadCache一样
+#ifdef _WIN32
+		static DWORD flsIndex = FlsAlloc(ThreadStatsExit);
+		FlsSetValue(flsIndex, stats);
+#elif __linux__
+		static pthread_key_t key = []() {
+			pthread_key_t k;
+			pthread_key_create(&k, ThreadStatsExit);
+			return k;
+		}();
+		pthread_setspecific(key, stats);
+#endif
+		return stats;
+	}
+
+	// 把src的计数器加到dst上
+	static void MergeStats(ThreadStats& dst, const ThreadStats& src)
+	{
+		for (size_t i = 0; i < NUM_FREELIST; i++)
+		{
+			dst._allocs[i].Add(src._allocs[i].Get());
+			dst._frees[i].Add(src._frees[i].Get());
+			dst._requestedBytes[i].Add(src._requestedBytes[i].Get());
+			dst._fetchCalls[i].Add(src._fetchCalls[i].Get());
+			dst._fetchedObjs[i].Add(src._fetchedObjs[i].Get());
+			dst._returnedObjs[i].Add(src._returnedObjs[i].Get());
+		}
+		dst._largeAllocs.Add(src._largeAllocs.Get());
+		dst._largeFrees.Add(src._largeFrees.Get());
+		dst._largeBytes.Add(src._largeBytes.Get());
+	}
+
+	void ThreadStats::Destroy(ThreadStats* stats)
+	{
+		{
+			std::unique_lock<std::mutex> lock(statsMtx);
+			MergeStats(retiredStats, *stats);
+			if (stats->_prev != nullptr)
+			{
+				stats->_prev->_next = stats->_next;
+			}
+			else
+			{
+				statsHead = stats->_next;
+			}
+			if (stats->_next != nullptr)
+			{
+				stats->_next->_prev = stats->_prev;
+			}
+		}
+		if (TLSThreadStats == stats)
+		{
+			TLSThreadStats = nullptr;
+		}
+		statsPool.Delete(stats);
+	}
+
+	void MallocExtension::GetMallocStats(MallocStats& stats)
+	{
+		stats = MallocStats();
+
+		// 汇总所有线程的计数器，ThreadStats比较大，不放在栈上
+		ThreadStats* sum = statsPool.New();
+		{
+			std::unique_lock<std::mutex> lock(statsMtx);
+			MergeStats(*sum, retiredStats);
+			for (ThreadStats* cur = statsHead; cur != nullptr; cur = cur->_next)
+			{
+				MergeStats(*sum, *cur);
+			}
+		}
+		const ThreadStats& total = *sum;
+
+		for (size_t i = 0; i < NUM_FREELIST; i++)
+		{
+			SizeClassStats& cls = stats._classes[i];
+			cls._objSize = SizeClass::ClassSize(i);
+			cls._allocs = total._allocs[i].Get();
+			cls._frees = total._frees[i].Get();
+			cls._cacheMisses = total._fetchCalls[i].Get();
+
+			// 不同线程的计数器不是同一时刻读到的，相减可能是负数，这种情况按0算
+			long long live = static_cast<long long>(cls._allocs - cls._frees);
+			live = live < 0 ? 0 : live;
+			cls._inUseBytes = live * cls._objSize;
+
+			// 从中心缓存拿到的对象，减去还回去的，再减去应用程序正在使用的，剩下的就在前端缓存里
+			long long cached = static_cast<long long>(total._fetchedObjs[i].Get() - total._returnedObjs[i].Get()) - live;
+			cls._frontCacheBytes = cached < 0 ? 0 : cached * cls._objSize;
+
+			// 按平均申请大小估算正在使用的对象浪费的字节数
+			if (cls._allocs != 0)
+			{
+				double avgRequested = static_cast<double>(total._requestedBytes[i].Get()) / cls._allocs;
+				cls._wastedBytes = static_cast<size_t>(live * (cls._objSize - avgRequested));
+			}
+
+			CentralBucketStats bucket;
+			CentralCache::GetInstance()->GetBucketStats(i, bucket);
+			cls._spansInUse = bucket._spans;
+			for (size_t bin = 0; bin <= NUM_OCCUPANCY_BINS; bin++)
+			{
+				cls._spanOccupancy[bin] = bucket._occupancy[bin];
+				stats._spanOccupancy[bin] += bucket._occupancy[bin];
+			}
+
+			stats._inUseBytes += cls._inUseBytes;
+			stats._frontCacheBytes += cls._frontCacheBytes;
+			stats._wastedBytes += cls._wastedBytes;
+			stats._centralCacheFreeBytes += bucket._spanFreeBytes;
+			stats._transferCacheBytes += bucket._transferBytes;
+		}
+
+		stats._largeAllocs = total._largeAllocs.Get();
+		stats._largeFrees = total._largeFrees.Get();
+		long long largeBytes = static_cast<long long>(total._largeBytes.Get());
+		stats._largeInUseBytes = largeBytes < 0 ? 0 : largeBytes;
+		stats._inUseBytes += stats._largeInUseBytes;
+		statsPool.Delete(sum);
+
+		stats._mappedBytes = systemMappedBytes.load(std::memory_order_relaxed);
+		stats._metadataBytes = metadataMappedBytes.load(std::memory_order_relaxed);
+		// 所有NUMA节点的PageCache加在一起
+		for (size_t node = 0; node < MAX_NUMA_NODES; node++)
+		{
+			PageCache* pageCache = PageCache::GetInstance(node);
+			stats._releasedBytes += pageCache->GetReleasedBytes();
+			FreeSpanStats freeSpans;
+			pageCache->GetFreeSpanStats(freeSpans);
+			stats._pageCacheFreeBytes += freeSpans._pages << PAGE_SHIFT;
+			stats._pageCacheFreeSpans += freeSpans._spans;
+			if ((freeSpans._largestPages << PAGE_SHIFT) > stats._pageCacheLargestFree)
+			{
+				stats._pageCacheLargestFree = freeSpans._largestPages << PAGE_SHIFT;
+			}
+		}
+	}
+
+	// 字节数后面加上MiB，方便阅读
+	static void AppendLine(std::string& out, const char* prefix, size_t bytes, const char* desc)
+	{
+		char line[128];
+		snprintf(line, sizeof(line), "MALLOC: %s %14zu (%10.1f MiB) %s\n", prefix, bytes, bytes / 1048576.0, desc);
+		out += line;
+	}
+
+	std::string MallocExtension::GetStats()
+	{
+		static MallocStats stats;
+		static std::mutex mtx;
+		std::unique_lock<std::mutex> lock(mtx);
+		GetMallocStats(stats);
+
+		std::string out;
+		const size_t pageCacheBytes = stats._pageCacheFreeBytes - stats._releasedBytes;
+		out += "------------------------------------------------\n";
+		AppendLine(out, " ", stats._inUseBytes, "Bytes in use by application");
+		AppendLine(out, "+", pageCacheBytes, "Bytes in page cache freelist");
+		AppendLine(out, "+", stats._centralCacheFreeBytes, "Bytes in central cache freelist");
+		AppendLine(out, "+", stats._transferCacheBytes, "Bytes in transfer cache freelist");
+		AppendLine(out, "+", stats._frontCacheBytes, "Bytes in thread/cpu cache freelists");
+		AppendLine(out, "+", stats._metadataBytes, "Bytes in malloc metadata");
+		AppendLine(out, "+", stats._releasedBytes, "Bytes released to OS");
+		out += "MALLOC:   ------------\n";
+		AppendLine(out, "=", stats._mappedBytes, "Bytes mapped (includes metadata)");
+		AppendLine(out, " ", stats._wastedBytes, "Bytes wasted to internal fragmentation");
+		out += "------------------------------------------------\n";
+
+		char line[160];
+		snprintf(line, sizeof(line), "Large allocations: %zu allocs, %zu frees, %zu bytes in use\n",
+				 stats._largeAllocs, stats._largeFrees, stats._largeInUseBytes);
+		out += line;
+		// 空闲span多但是最大的很小，说明页级别的碎片多
+		snprintf(line, sizeof(line), "Page cache: %zu free spans, largest %zu bytes\n",
+				 stats._pageCacheFreeSpans, stats._pageCacheLargestFree);
+		out += line;
+		// 中心缓存span的使用率分布，快空的span多说明碎片多
+		out += "Central cache spans by occupancy:";
+		for (size_t bin = 0; bin < NUM_OCCUPANCY_BINS; bin++)
+		{
+			snprintf(line, sizeof(line), " %zu-%zu%%: %zu", bin * 100 / NUM_OCCUPANCY_BINS,
+					 (bin + 1) * 100 / NUM_OCCUPANCY_BINS, stats._spanOccupancy[bin]);
+			out += line;
+		}
+		snprintf(line, sizeof(line), " full: %zu\n", stats._spanOccupancy[NUM_OCCUPANCY_BINS]);
+		out += line;
+		out += "class     size       allocs        frees       misses  spans       in use     cached     wasted\n";
+		for (size_t i = 0; i < NUM_FREELIST; i++)
+		{
+			const SizeClassStats& cls = stats._classes[i];
+			if (cls._allocs == 0 && cls._spansInUse == 0)
+			{
+				continue; // 没有用过的桶不输出
+			}
+			snprintf(line, sizeof(line), "%5zu %8zu %12zu %12zu %12zu %6zu %12zu %10zu %10zu\n",
+					 i, cls._objSize, cls._allocs, cls._frees, cls._cacheMisses, cls._spansInUse,
+					 cls._inUseBytes, cls._frontCacheBytes, cls._wastedBytes);
+			out += line;
+		}
+		return out;
+	}
+
+	bool MallocExtension::GetNumericProperty(const char* name, size_t* value)
+	{
+		if (name == nullptr || value == nullptr)
+		{
+			return false;
+		}
+		if (strcmp(name, "heap.mapped_bytes") == 0)
+		{
+			// 只需要一个计数器的不用汇总全部统计
+			*value = systemMappedBytes.load(std::memory_order_relaxed);
+			return true;
+		}
+		if (strcmp(name, "heap.metadata_bytes") == 0)
+		{
+			*value = metadataMappedBytes.load(std::memory_order_relaxed);
+			return true;
+		}
+		if (strcmp(name, "heap.released_bytes") == 0)
+		{
+			*value = 0;
+			for (size_t node = 0; node < MAX_NUMA_NODES; node++)
+			{
+				*value += PageCache::GetInstance(node)->GetReleasedBytes();
+			}
+			return true;
+		}
+
+		static MallocStats stats;
+		static std::mutex mtx;
+		std::unique_lock<std::mutex> lock(mtx);
+		GetMallocStats(stats);
+		if (strcmp(name, "generic.current_allocated_bytes") == 0)
+		{
+			*value = stats._inUseBytes;
+		}
+		else if (strcmp(name, "generic.heap_size") == 0)
+		{
+			*value = stats._mappedBytes - stats._releasedBytes;
+		}
+		else if (strcmp(name, "heap.pagecache_free_bytes") == 0)
+		{
+			*value = stats._pageCacheFreeBytes - stats._releasedBytes;
+		}
+		else if (strcmp(name, "heap.central_cache_free_bytes") == 0)
+		{
+			*value = stats._centralCacheFreeBytes;
+		}
+		else if (strcmp(name, "heap.transfer_cache_free_bytes") == 0)
+		{
+			*value = stats._transferCacheBytes;
+		}
+		else if (strcmp(name, "heap.thread_cache_free_bytes") == 0)
+		{
+			*value = stats._frontCacheBytes;
+		}
+		else if (strcmp(name, "heap.internal_fragmentation_bytes") == 0)
+		{
+			*value = stats._wastedBytes;
+		}
+		else
+		{
+			return false;
+		}
+		return true;
+	}
+}
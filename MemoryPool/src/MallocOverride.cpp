@@ -0,0 +1,484 @@
+// 替换glibc的malloc系列函数和全局operator new/delete
+// 编译成libmempool.so之后，通过 LD_PRELOAD=./libmempool.so ./a.out 让任意程序使用内存池
+#include "../include/ConcurrentAlloc.hpp"
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <new>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// glibc自己的实现，用来处理不属于内存池的指针
+extern "C"
+{
+	void __libc_free(void* ptr);
+}
+
+namespace mempool
+{
+	static const size_t MALLOC_ALIGN = alignof(std::max_align_t); // malloc返回值至少要满足的对齐
+	static const size_t MAX_MALLOC_SIZE = static_cast<size_t>(1) << 46; // 超过这个大小RoundUp会溢出，直接失败
+	static const size_t BOOTSTRAP_BYTES = 256 * 1024; // 重入时使用的静态内存大小
+
+	// 内存池内部（异常、dlsym等）重入malloc时，从这块静态内存中分配，这部分内存永远不会回收
+	// 每块内存前面放一个MALLOC_ALIGN大小的头部，记录申请的大小
+	alignas(64) static char bootstrapBuf[BOOTSTRAP_BYTES];
+	static std::atomic<size_t> bootstrapUsed{0};
+
+	// 当前线程是否正在内存池内部
+	static __thread bool inPool __attribute__((tls_model("initial-exec"))) = false;
+
+	// 释放时可能嵌套在另一次内存池调用中，退出时恢复原来的值，不能直接清掉外层的标记
+	struct PoolGuard
+	{
+		PoolGuard() : _prev(inPool) { inPool = true; }
+		~PoolGuard() { inPool = _prev; }
+		bool _prev;
+	};
+
+	static bool IsBootstrap(void* ptr)
+	{
+		return ptr >= bootstrapBuf && ptr < bootstrapBuf + BOOTSTRAP_BYTES;
+	}
+
+	static void* BootstrapAlloc(size_t size, size_t align)
+	{
+		if (align < MALLOC_ALIGN)
+		{
+			align = MALLOC_ALIGN;
+		}
+		size_t need = SizeClass::_RoundUp(size, MALLOC_ALIGN) + align;
+		size_t offset = bootstrapUsed.fetch_add(need, std::memory_order_relaxed);
+		if (offset + need > BOOTSTRAP_BYTES)
+		{
+			return nullptr;
+		}
+		char* ptr = reinterpret_cast<char*>(SizeClass::_RoundUp(reinterpret_cast<size_t>(bootstrapBuf + offset + MALLOC_ALIGN), align));
+		*reinterpret_cast<size_t*>(ptr - MALLOC_ALIGN) = size;
+		return ptr;
+	}
+
+	// 8字节以内的对象放不下需要16字节对齐的类型，其余的按照malloc的约定向上取整到16字节
+	// 桶的大小都是16的倍数后，span内按照对象大小切分出来的地址也都是16字节对齐的
+	static size_t AdjustSize(size_t size)
+	{
+		return size <= sizeof(void*) ? sizeof(void*) : SizeClass::_RoundUp(size, MALLOC_ALIGN);
+	}
+
+	static void* PoolMalloc(size_t size)
+	{
+		if (inPool)
+		{
+			return BootstrapAlloc(size, MALLOC_ALIGN);
+		}
+		if (size >= MAX_MALLOC_SIZE)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+		PoolGuard guard;
+		try
+		{
+			return ConcurrentAlloc(AdjustSize(size));
+		}
+		catch (const std::bad_alloc&)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+	}
+
+	// 返回指针所属的span，不是内存池分配的返回nullptr
+	static Span* PoolSpan(void* ptr)
+	{
+		Span* span = PageCache::MapObjectToSpan(ptr);
+		return (span != nullptr && span->_isUsed) ? span : nullptr;
+	}
+
+	static void PoolFree(void* ptr)
+	{
+		if (ptr == nullptr || IsBootstrap(ptr))
+		{
+			return;
+		}
+		if (PoolSpan(ptr) == nullptr)
+		{
+			__libc_free(ptr); // 替换之前或者由glibc内部分配的内存
+			return;
+		}
+		PoolGuard guard;
+		ConcurrentFree(ptr);
+	}
+
+	static void* PoolMemalign(size_t align, size_t size)
+	{
+		if (align <= MALLOC_ALIGN)
+		{
+			return PoolMalloc(size);
+		}
+		if (inPool)
+		{
+			return BootstrapAlloc(size, align);
+		}
+		if (size >= MAX_MALLOC_SIZE || align >= MAX_MALLOC_SIZE)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+		PoolGuard guard;
+		try
+		{
+			return ConcurrentAlignedAlloc(size, align);
+		}
+		catch (const std::bad_alloc&)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+	}
+
+	static size_t PoolUsableSize(void* ptr)
+	{
+		if (ptr == nullptr)
+		{
+			return 0;
+		}
+		if (IsBootstrap(ptr))
+		{
+			return *reinterpret_cast<size_t*>(static_cast<char*>(ptr) - MALLOC_ALIGN);
+		}
+		Span* span = PoolSpan(ptr);
+		if (span == nullptr)
+		{
+			// 不是内存池的指针，问glibc
+			typedef size_t (*UsableSizeFunc)(void*);
+			static UsableSizeFunc libcUsableSize = reinterpret_cast<UsableSizeFunc>(dlsym(RTLD_NEXT, "malloc_usable_size"));
+			return libcUsableSize != nullptr ? libcUsableSize(ptr) : 0;
+		}
+		if (span->_guard != nullptr)
+		{
+			// 保护页对象只能使用申请的大小，再往后就算越界
+			return GuardedPageAllocator::GetSize(span);
+		}
+		if (span->_objSize > MAX_SIZE)
+		{
+			// 大块内存独占整个span
+			return (span->_pageId << PAGE_SHIFT) + (span->_n << PAGE_SHIFT) - reinterpret_cast<size_t>(ptr);
+		}
+		return span->_objSize;
+	}
+
+	static void* PoolRealloc(void* ptr, size_t size)
+	{
+		if (ptr == nullptr)
+		{
+			return PoolMalloc(size);
+		}
+		if (size == 0)
+		{
+			PoolFree(ptr);
+			return nullptr;
+		}
+		if (size >= MAX_MALLOC_SIZE)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+		if (!inPool && !IsBootstrap(ptr) && PoolSpan(ptr) != nullptr)
+		{
+			PoolGuard guard;
+			try
+			{
+				return ConcurrentRealloc(ptr, AdjustSize(size));
+			}
+			catch (const std::bad_alloc&)
+			{
+				errno = ENOMEM;
+				return nullptr; // 失败时原来的内存保持不变
+			}
+		}
+
+		// 启动阶段的内存和glibc的内存，只能重新申请再复制
+		size_t oldSize = PoolUsableSize(ptr);
+		void* newPtr = PoolMalloc(size);
+		if (newPtr == nullptr)
+		{
+			return nullptr; // 失败时原来的内存保持不变
+		}
+		memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+		PoolFree(ptr);
+		return newPtr;
+	}
+
+	// operator new失败时需要调用new_handler，没有的话抛异常
+	static void* PoolNew(size_t size, size_t align)
+	{
+		while (true)
+		{
+			void* ptr = PoolMemalign(align, size);
+			if (ptr != nullptr)
+			{
+				return ptr;
+			}
+			std::new_handler handler = std::get_new_handler();
+			if (handler == nullptr)
+			{
+				throw std::bad_alloc();
+			}
+			handler();
+		}
+	}
+
+	// 知道对象大小的时候省掉一次查询span，大小需要和申请时一样经过AdjustSize
+	static void PoolSizedFree(void* ptr, size_t size)
+	{
+		if (ptr == nullptr || IsBootstrap(ptr))
+		{
+			return;
+		}
+		PoolGuard guard;
+		ConcurrentFree(ptr, AdjustSize(size));
+	}
+
+	// fork的时候其他线程可能正持有锁，子进程中只剩下当前线程，需要在fork前把所有锁拿到手
+	static void ForkPrepare()
+	{
+		GuardedPageAllocator::LockAll();
+		CentralCache::GetInstance()->LockAll();
+		PageCache::LockAll();
+		ThreadCache::LockAll();
+		HeapProfiler::LockAll();
+	}
+
+	static void ForkParent()
+	{
+		HeapProfiler::UnlockAll();
+		ThreadCache::UnlockAll();
+		PageCache::UnlockAll();
+		CentralCache::GetInstance()->UnlockAll();
+		GuardedPageAllocator::UnlockAll();
+	}
+
+	// 退出时把存活的采样对象写到MEMPOOL_HEAP_PROFILE指定的文件，可以直接交给pprof
+	static void DumpHeapProfileAtExit()
+	{
+		FILE* file = fopen(getenv("MEMPOOL_HEAP_PROFILE"), "w");
+		if (file != nullptr)
+		{
+			std::string profile = HeapProfiler::DumpPprof();
+			fwrite(profile.data(), 1, profile.size(), file);
+			fclose(file);
+		}
+	}
+
+	__attribute__((constructor)) static void InitOverride()
+	{
+		pthread_atfork(ForkPrepare, ForkParent, ForkParent);
+
+		// MEMPOOL_SAMPLE_RATE=平均多少字节采样一次，不设置的时候不采样
+		const char* rate = getenv("MEMPOOL_SAMPLE_RATE");
+		if (rate != nullptr)
+		{
+			HeapProfiler::SetSampleRate(strtoull(rate, nullptr, 10));
+		}
+		// MEMPOOL_GUARDED_SAMPLE_RATE=平均每多少次申请使用一次保护页，不设置的时候不使用
+		const char* guardedRate = getenv("MEMPOOL_GUARDED_SAMPLE_RATE");
+		if (guardedRate != nullptr)
+		{
+			GuardedPageAllocator::SetSampleRate(strtoull(guardedRate, nullptr, 10));
+		}
+		if (getenv("MEMPOOL_HEAP_PROFILE") != nullptr)
+		{
+			atexit(DumpHeapProfileAtExit);
+		}
+	}
+}
+
+using namespace mempool;
+
+extern "C"
+{
+	void* malloc(size_t size)
+	{
+		return PoolMalloc(size);
+	}
+
+	void free(void* ptr)
+	{
+		PoolFree(ptr);
+	}
+
+	void* calloc(size_t num, size_t size)
+	{
+		size_t bytes = num * size;
+		if (size != 0 && bytes / size != num)
+		{
+			errno = ENOMEM; // 乘法溢出
+			return nullptr;
+		}
+		void* ptr = PoolMalloc(bytes);
+		if (ptr != nullptr)
+		{
+			memset(ptr, 0, bytes);
+		}
+		return ptr;
+	}
+
+	void* realloc(void* ptr, size_t size)
+	{
+		return PoolRealloc(ptr, size);
+	}
+
+	int posix_memalign(void** memptr, size_t alignment, size_t size)
+	{
+		if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0)
+		{
+			return EINVAL;
+		}
+		void* ptr = PoolMemalign(alignment, size);
+		if (ptr == nullptr)
+		{
+			return ENOMEM;
+		}
+		*memptr = ptr;
+		return 0;
+	}
+
+	void* aligned_alloc(size_t alignment, size_t size)
+	{
+		if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+		{
+			errno = EINVAL;
+			return nullptr;
+		}
+		return PoolMemalign(alignment, size);
+	}
+
+	void* memalign(size_t alignment, size_t size)
+	{
+		return aligned_alloc(alignment, size);
+	}
+
+	void* valloc(size_t size)
+	{
+		return PoolMemalign(sysconf(_SC_PAGESIZE), size);
+	}
+
+	void* pvalloc(size_t size)
+	{
+		size_t pageSize = sysconf(_SC_PAGESIZE);
+		return PoolMemalign(pageSize, SizeClass::_RoundUp(size == 0 ? 1 : size, pageSize));
+	}
+
+	size_t malloc_usable_size(void* ptr)
+	{
+		return PoolUsableSize(ptr);
+	}
+}
+
+void* operator new(size_t size)
+{
+	return PoolNew(size, MALLOC_ALIGN);
+}
+
+void* operator new[](size_t size)
+{
+	return PoolNew(size, MALLOC_ALIGN);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return PoolMalloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return PoolMalloc(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	PoolFree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	PoolFree(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	PoolFree(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	PoolFree(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept
+{
+	PoolSizedFree(ptr, size);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept
+{
+	PoolSizedFree(ptr, size);
+}
+
+// C++17的对齐版本，对齐后的大小和申请时不一样，释放统一走查询span的路径
+void* operator new(size_t size, std::align_val_t align)
+{
+	return PoolNew(size, static_cast<size_t>(align));
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+	return PoolNew(size, static_cast<size_t>(align));
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	return PoolMemalign(static_cast<size_t>(align), size);
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	return PoolMemalign(static_cast<size_t>(align), size);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	PoolFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+	PoolFree(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept
+{
+	PoolFree(ptr);
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept
+{
+	PoolFree(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	PoolFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	PoolFree(ptr);
+}
+#endif
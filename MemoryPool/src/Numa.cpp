@@ -0,0 +1,198 @@
+#include "../include/Numa.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+namespace mempool
+{
+#ifdef _WIN32
+	_declspec(thread) size_t TLSNumaNode = 0;
+#elif __linux__
+	__thread size_t TLSNumaNode __attribute__((tls_model("initial-exec"))) = 0;
+
+	static const int MPOL_PREFERRED_MODE = 1; // 和<numaif.h>中的MPOL_PREFERRED相同，不依赖libnuma
+	static const size_t SYSFS_MAX_NODES = 64; // 最多查看多少个节点目录
+
+	// 读取整个文件，只用系统调用，这时候可能正在malloc里面，不能用fopen
+	static size_t ReadSmallFile(const char* path, char* buf, size_t size)
+	{
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			return 0;
+		}
+		size_t len = 0;
+		while (len + 1 < size)
+		{
+			ssize_t n = read(fd, buf + len, size - 1 - len);
+			if (n <= 0)
+			{
+				break;
+			}
+			len += n;
+		}
+		close(fd);
+		buf[len] = '\0';
+		return len;
+	}
+
+	// 解析"0-3,8-11"格式的CPU列表，把里面的CPU标记为node
+	static void ParseCpuList(const char* list, unsigned char* cpuNode, size_t node)
+	{
+		const char* p = list;
+		while (*p >= '0' && *p <= '9')
+		{
+			size_t first = 0;
+			while (*p >= '0' && *p <= '9')
+			{
+				first = first * 10 + (*p++ - '0');
+			}
+			size_t last = first;
+			if (*p == '-')
+			{
+				p++;
+				last = 0;
+				while (*p >= '0' && *p <= '9')
+				{
+					last = last * 10 + (*p++ - '0');
+				}
+			}
+			for (size_t cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS; cpu++)
+			{
+				cpuNode[cpu] = static_cast<unsigned char>(node);
+			}
+			if (*p == ',')
+			{
+				p++;
+			}
+		}
+	}
+#endif
+
+	// 读取每个节点的CPU列表，没有NUMA信息的时候只有一个节点
+	// 存在的节点按编号顺序依次使用下标0、1、2……的PageCache，节点编号不连续时也不会空出下标
+	// 节点比MAX_NUMA_NODES多的时候，后面的节点和前面的节点共用PageCache
+	NumaTopology::NumaTopology()
+	{
+#ifdef __linux__
+		char path[64] = "/sys/devices/system/node/node";
+		const size_t prefix = 29; // "/sys/devices/system/node/node"的长度
+		char buf[4096];
+		size_t found = 0;
+		for (size_t node = 0; node < SYSFS_MAX_NODES; node++)
+		{
+			// 拼出nodeN/cpulist
+			size_t len = prefix;
+			if (node >= 10)
+			{
+				path[len++] = static_cast<char>('0' + node / 10);
+			}
+			path[len++] = static_cast<char>('0' + node % 10);
+			const char* suffix = "/cpulist";
+			for (size_t i = 0; suffix[i] != '\0'; i++)
+			{
+				path[len++] = suffix[i];
+			}
+			path[len] = '\0';
+
+			if (ReadSmallFile(path, buf, sizeof(buf)) == 0)
+			{
+				continue; // 节点编号可能不连续
+			}
+			size_t heap = found % MAX_NUMA_NODES;
+			if (found < MAX_NUMA_NODES)
+			{
+				_heapNode[heap] = static_cast<unsigned short>(node);
+			}
+			ParseCpuList(buf, _cpuNode, heap);
+			found++;
+		}
+		if (found != 0)
+		{
+			_numNodes = found < MAX_NUMA_NODES ? found : MAX_NUMA_NODES;
+		}
+#elif _WIN32
+		ULONG highest = 0;
+		if (GetNumaHighestNodeNumber(&highest))
+		{
+			_numNodes = highest + 1 < MAX_NUMA_NODES ? highest + 1 : MAX_NUMA_NODES;
+		}
+		for (size_t i = 0; i < MAX_NUMA_NODES; i++)
+		{
+			_heapNode[i] = static_cast<unsigned short>(i);
+		}
+#endif
+	}
+
+	// 当前线程正在运行的CPU所属的节点
+	size_t NumaTopology::CurrentNode() const
+	{
+		size_t (*fake)() = _fakeCurrentNode.load(std::memory_order_acquire);
+		if (fake != nullptr)
+		{
+			return fake() % NumNodes();
+		}
+		if (_numNodes == 1)
+		{
+			return 0; // 单节点不需要查CPU
+		}
+#ifdef __linux__
+		int cpu = sched_getcpu();
+		if (cpu < 0 || static_cast<size_t>(cpu) >= NUMA_MAX_CPUS)
+		{
+			return 0;
+		}
+		return _cpuNode[cpu];
+#elif _WIN32
+		PROCESSOR_NUMBER processor;
+		GetCurrentProcessorNumberEx(&processor);
+		USHORT node = 0;
+		if (!GetNumaProcessorNodeEx(&processor, &node))
+		{
+			return 0;
+		}
+		return node % MAX_NUMA_NODES;
+#endif
+	}
+
+	// 把物理内存优先放在node节点上，节点内存不够的时候内核仍然可以用其他节点的
+	void NumaTopology::BindMemory(void* ptr, size_t n, size_t node) const
+	{
+		if (_numNodes == 1 || _fakeNodes.load(std::memory_order_relaxed) != 0)
+		{
+			return;
+		}
+#ifdef __linux__
+		const size_t bits = sizeof(unsigned long) * 8;
+		unsigned long mask[SYSFS_MAX_NODES / bits] = {};
+		size_t sysNode = _heapNode[node];
+		mask[sysNode / bits] |= 1UL << (sysNode % bits);
+		// 内核会把maxnode减一再读取，和libnuma一样多传一位
+		// 失败的时候（比如内核不支持NUMA）退回到第一次访问时分配
+		syscall(SYS_mbind, ptr, n << PAGE_SHIFT, MPOL_PREFERRED_MODE, mask, sizeof(mask) * 8 + 1, 0);
+#elif _WIN32
+		// VirtualAllocExNuma只能在申请的时候指定节点，这里依赖第一次访问时分配
+		(void)ptr;
+		(void)n;
+		(void)node;
+#endif
+	}
+
+	void NumaTopology::SetFakeTopology(size_t nodes, size_t (*currentNode)())
+	{
+		if (nodes > MAX_NUMA_NODES)
+		{
+			nodes = MAX_NUMA_NODES;
+		}
+		if (nodes == 0)
+		{
+			currentNode = nullptr;
+		}
+		_fakeCurrentNode.store(currentNode, std::memory_order_release);
+		_fakeNodes.store(nodes, std::memory_order_release);
+	}
+}
@@ -1,4 +1,5 @@
 #include "../include/PageCache.h"
+#include "../include/CentralCache.h"
 
 namespace mempool
 {
@@ -8,171 +9,674 @@ namespace mempool
 		// 一页是8KB，在这个页内的所有地址/8KB计算出来的页号都一样！
 		// 因为整除后余数被省略了
 		PageID id = (reinterpret_cast<PageID>(obj) >> PAGE_SHIFT);
-		// 查询的时候加锁
-		std::unique_lock<std::mutex> lock(_pageMtx);
-		auto ret = _idSpanMap.find(id);
-		if(ret != _idSpanMap.end())
+		// 基数树的节点只增不删，所以查询的时候不需要加锁
+		// 找不到的时候返回nullptr
+		return static_cast<Span*>(SharedPageMap().Get(id));
+	}
+
+	// 按节点顺序加锁，解锁的顺序反过来
+	void PageCache::LockAll()
+	{
+		for (size_t i = 0; i < MAX_NUMA_NODES; i++)
 		{
-			return ret->second;
+			GetInstance(i)->Lock();
 		}
-		else 
+	}
+
+	void PageCache::UnlockAll()
+	{
+		for (size_t i = MAX_NUMA_NODES; i > 0; i--)
 		{
-			return nullptr;
+			GetInstance(i - 1)->Unlock();
 		}
 	}
 
+	// 正在使用的span：小span每一页都设置映射，大span的对象只在首页，再加上尾页用于相邻span的合并
 	void PageCache::SetMapObjectToSpan(Span* span)
 	{
+		if (span->_n >= NUM_PAGES)
+		{
+			SetBoundaryMap(span);
+			return;
+		}
+		_idSpanMap.Ensure(span->_pageId, span->_n);
 		for (PageID i = span->_pageId; i < span->_pageId + span->_n; i++)
 		{
-			_idSpanMap[i] = span;
+			_idSpanMap.Set(i, span);
 		}
 	}
 
+	// 空闲span只设置首尾两页的映射
+	// 中间的页可能还留着以前的span的映射，但合并时只会查相邻span的尾页或者首页，不会查到中间
+	void PageCache::SetBoundaryMap(Span* span)
+	{
+		PageID last = span->_pageId + span->_n - 1;
+		_idSpanMap.Ensure(span->_pageId, 1);
+		_idSpanMap.Ensure(last, 1);
+		_idSpanMap.Set(span->_pageId, span);
+		_idSpanMap.Set(last, span);
+	}
+
+	// 清掉[start, start+n)的映射，这段地址之后可能被其他分配器拿到，查询时不能再找到span
+	void PageCache::ClearMap(PageID start, size_t n)
+	{
+		for (PageID i = start; i < start + n; i++)
+		{
+			// 有值说明节点已经分配了，没有值的不需要清
+			if (_idSpanMap.Get(i) != nullptr)
+			{
+				_idSpanMap.Set(i, nullptr);
+			}
+		}
+	}
 
 	// 释放空闲span回到Pagecache，并合并相邻的span
+	// 合并之后超过128页的放进_largeSpans，留给之后的大块内存复用，不用每次都mmap/munmap
+	// 物理内存空闲超过释放间隔之后由ReleaseFreeMemory还给操作系统
 	void PageCache::ReleaseSpanToPageCache(Span* span)
 	{
 		assert(span != nullptr);
+		AddHugePageUsed(span, false);
+		span->_isUsed = false;
+		span->_isReleased = false;
+		span->_freeTime = NowMs();
+		MergeAndInsert(span);
+	}
 
-		// 大于128pages的无法处理，直接返回给堆
-		if (span->_n >= NUM_PAGES)
-		{
-			SystemFree(reinterpret_cast<void*>(span->_pageId << PAGE_SHIFT));
-			_spanPool.Delete(span); // 释放定长内存池里面的内存
-			// 因为大于128Pages的并不是PageCache管理的，所以不需要操作idMap
-			return;
-		}
-
-		// 向前合并
+	// 和前后相邻的空闲span合并，然后插入空闲链表
+	void PageCache::MergeAndInsert(Span* span)
+	{
+		// 向前合并，前一页如果属于空闲的span，一定是它的尾页
 		while (true)
 		{
-			PageID prevId = span->_pageId - 1; // 前一个页的id
-			// 如果存在，肯定是另外一个Span对象管理的
-			auto ret = _idSpanMap.find(prevId);
-			if (ret == _idSpanMap.end())
-			{
-				break; // 找不到，不合并
-			}
-			// 找到了
-			Span* prev = ret->second;
-			if (prev->_isUsed)
-			{
-				break; // 正在使用，不合并
-			}
-			//判断页面数量有没有超，超过128都没有办法管理
-			if (prev->_n + span->_n >= NUM_PAGES)
+			Span* prev = static_cast<Span*>(_idSpanMap.Get(span->_pageId - 1));
+			// 找不到或者正在使用都不合并，其他节点的span由其他的锁保护，先确认节点相同再看其他字段
+			// 这一页也可能是其他span中间的页，留着以前的映射，所以还要确认它正好在span前面
+			if (prev == nullptr || prev->_node.load(std::memory_order_relaxed) != _node || prev->_isUsed
+				|| prev->_pageId + prev->_n != span->_pageId)
 			{
 				break;
 			}
 
+			// 合并后的span有一部分还有物理内存，整体按照没有释放来算
+			ClearReleased(prev);
+			EraseFreeSpan(prev);
 			// 合并，使用span来合并，因为后续都是操作span
 			span->_pageId = prev->_pageId;
 			span->_n += prev->_n;
-
-			_spanList[prev->_n].Erase(prev);
 			_spanPool.Delete(prev);
 		}
 
-		// 向后合并
+		// 向后合并，后一页如果属于空闲的span，一定是它的首页
 		while (true)
 		{
-			PageID nextId = span->_pageId - 1; // 后一个Span的id
-			auto ret = _idSpanMap.find(nextId);
-			if (ret == _idSpanMap.end())
-			{
-				// 找不到，不合并
-				break;
-			}
-			Span* next = ret->second;
-			if (next->_isUsed)
-			{
-				break; // 正在使用，不合并
-			}
-			//判断页面数量有没有超，超过128都没有办法管理
-			if (next->_n + span->_n >= NUM_PAGES)
+			PageID nextId = span->_pageId + span->_n;
+			Span* next = static_cast<Span*>(_idSpanMap.Get(nextId));
+			if (next == nullptr || next->_node.load(std::memory_order_relaxed) != _node || next->_isUsed
+				|| next->_pageId != nextId)
 			{
 				break;
 			}
-			// 合并
-			span->_n += next->_n;
 
-			_spanList[next->_n].Erase(next);
+			ClearReleased(next);
+			EraseFreeSpan(next);
+			span->_n += next->_n;
 			_spanPool.Delete(next);
 		}
 
-
 		// 插入链表
-		_spanList[span->_n].PushFront(span);
-		span->_isUsed = false;
+		InsertFreeSpan(span);
 
-		// 需要重新设置idmap
+		// 合并之后首尾两页变了，需要重新设置
+		SetBoundaryMap(span);
+	}
+
+	// 取出一个页数不小于k的空闲span，没有的时候返回nullptr
+	Span* PageCache::FindFreeSpan(size_t k)
+	{
+		if (k < NUM_PAGES)
+		{
+			// 位图中第一个页数不小于k的非空链表
+			size_t i = _nonEmpty.FindNext(k);
+			if (i < NUM_PAGES)
+			{
+				return PickSpan(i);
+			}
+		}
+		// 在超过128页的空闲span中找页数不小于k的最小的一个
+		auto itr = _largeSpans.lower_bound(k);
+		if (itr == _largeSpans.end())
+		{
+			return nullptr;
+		}
+		Span* span = *itr;
+		_largeSpans.erase(itr);
+		return span;
+	}
+
+	// 只建立页号映射，内存由调用方管理
+	Span* PageCache::NewExternalSpan(PageID id, size_t n)
+	{
+		Span* span = NewSpanObject();
+		span->_pageId = id;
+		span->_n = n;
+		span->_isUsed = true;
 		SetMapObjectToSpan(span);
+		return span;
 	}
 
 	// 获取一个K页的span
 	Span* PageCache::NewSpan(size_t k)
 	{
-		// 超过管理范围，直接申请并设置span
-		if (k >= NUM_PAGES)
+		// 页数正好的直接用，更大的进行拆分
+		Span* span = FindFreeSpan(k);
+		if (span == nullptr)
+		{
+			// 没有，向系统申请
+			if (k >= NUM_PAGES)
+			{
+				return NewSystemSpan(k, 1);
+			}
+			// 新的内存也先和相邻的空闲span合并，插入之后一定能找到
+			MergeAndInsert(GrowHeap());
+			span = FindFreeSpan(k);
+			assert(span != nullptr);
+		}
+
+		if (span->_n > k)
 		{
-			void* ptr = SystemAlloc(k); // 这里直接传入K就可以了
-			Span* span = _spanPool.New();
+			// 前k页分出去，剩下的继续使用原来的span对象，尾页的映射不用修改
+			Span* rest = span;
+			span = NewSpanObject();
+			span->_pageId = rest->_pageId;
 			span->_n = k;
+
+			rest->_pageId += k; // 页号增加
+			rest->_n -= k; // 页面数量减少
+			// 已经释放的span被拆分时，只有分配出去的部分不再算作已释放
+			if (rest->_isReleased)
+			{
+				_releasedPages.fetch_sub(k, std::memory_order_relaxed);
+			}
+			InsertFreeSpan(rest);
+			SetBoundaryMap(rest);
+		}
+		else
+		{
+			ClearReleased(span);
+		}
+
+		span->_isUsed = true;
+		AddHugePageUsed(span, true);
+		SetMapObjectToSpan(span);
+		return span;
+	}
+
+	// 向系统申请一段新的内存，返回对应的空闲span，还没有插入链表
+	Span* PageCache::GrowHeap()
+	{
+		Span* span = NewSpanObject();
+		if (_hugePageMode)
+		{
+			// 按2MB对齐申请一个完整的大页，拆分之后剩下的部分放进_largeSpans
+			void* ptr = SystemAllocAligned(HUGEPAGE_PAGES, HUGEPAGE_PAGES);
+			SystemHugePage(ptr, HUGEPAGE_PAGES);
 			span->_pageId = reinterpret_cast<PageID>(ptr) >> PAGE_SHIFT;
-			// 这里必须要设置，否则释放内存时无法确认是否大于256KB
-			_idSpanMap[span->_pageId] = span; 
-			return span;
+			span->_n = HUGEPAGE_PAGES;
+		}
+		else
+		{
+			span->_n = NUM_PAGES - 1; // 按最大量128页进行申请
+			span->_pageId = reinterpret_cast<PageID>(SystemAlloc(span->_n)) >> PAGE_SHIFT;
 		}
+		// 物理内存放在这个PageCache的节点上
+		NumaTopology::GetInstance()->BindMemory(reinterpret_cast<void*>(span->_pageId << PAGE_SHIFT), span->_n, _node);
+		span->_freeTime = NowMs();
+		return span;
+	}
 
-		// 判断list里面有没有合适的span
-		if (!_spanList[k].Empty())
+	// 调整大块内存span的页数，尽量不移动数据
+	bool PageCache::ResizeSpan(Span* span, size_t k)
+	{
+		assert(span->_isUsed);
+		if (k == span->_n)
 		{
-			Span* span = _spanList[k].PopFront();
-			SetMapObjectToSpan(span);
-			return span;
+			return true;
 		}
-		// 没有，找大的进行拆分
-		for (size_t i = k + 1; i < NUM_PAGES; i++)
+		// 直接向系统申请的span，通过mremap调整，数据不需要复制
+		if (span->_n >= NUM_PAGES)
 		{
-			// 跳过为空的
-			if (_spanList[i].Empty())
+			if (k < NUM_PAGES)
 			{
-				continue;
+				return false; // 回到PageCache的管理范围，由调用方重新申请
 			}
-			// 找到了，进行拆分
-			Span* bigSpan = _spanList[i].PopFront();
-			Span* span = _spanPool.New();
-			
+			return RemapSystemSpan(span, k);
+		}
+		if (k >= NUM_PAGES)
+		{
+			return false;
+		}
+
+		if (k < span->_n)
+		{
+			// 收缩：尾部多余的页作为一个新的span还给PageCache
+			Span* tail = NewSpanObject();
+			tail->_pageId = span->_pageId + k;
+			tail->_n = span->_n - k;
+			tail->_isUsed = true;
 			span->_n = k;
-			span->_pageId = bigSpan->_pageId;
+			ReleaseSpanToPageCache(tail);
+			return true;
+		}
 
-			bigSpan->_pageId += k; // 页号增加
-			bigSpan->_n -= k; // 页面数量减少
-			_spanList[bigSpan->_n].PushFront(bigSpan);
-			
-			SetMapObjectToSpan(span);
-			return span;
+		// 扩展：后面紧挨着的空闲span足够大时，从它的开头拿走需要的页
+		size_t need = k - span->_n;
+		PageID nextId = span->_pageId + span->_n;
+		Span* next = static_cast<Span*>(_idSpanMap.Get(nextId));
+		if (next == nullptr || next->_node.load(std::memory_order_relaxed) != _node || next->_isUsed
+			|| next->_pageId != nextId || next->_n < need)
+		{
+			return false;
+		}
+		EraseFreeSpan(next);
+		if (next->_isReleased)
+		{
+			_releasedPages.fetch_sub(need, std::memory_order_relaxed);
+		}
+		AddHugePageUsed(nextId, need, true);
+		if (next->_n == need)
+		{
+			_spanPool.Delete(next);
+		}
+		else
+		{
+			next->_pageId += need;
+			next->_n -= need;
+			InsertFreeSpan(next);
+			SetBoundaryMap(next); // 首页变了
+		}
+		span->_n = k;
+		SetMapObjectToSpan(span);
+		return true;
+	}
+
+	// 通过mremap调整直接向系统申请的span
+	bool PageCache::RemapSystemSpan(Span* span, size_t k)
+	{
+		void* oldPtr = reinterpret_cast<void*>(span->_pageId << PAGE_SHIFT);
+		void* ptr = SystemRemap(oldPtr, span->_n, k, nullptr);
+		if (ptr == nullptr)
+		{
+			// 原地放不下，先保留一段按页对齐的地址，再让内核把原来的物理页整体搬过去
+			void* target = nullptr;
+			try
+			{
+				target = SystemAlloc(k);
+			}
+			catch (const std::bad_alloc&)
+			{
+				return false; // 持有锁的时候不能把异常抛出去
+			}
+			ptr = SystemRemap(oldPtr, span->_n, k, target);
+			if (ptr == nullptr)
+			{
+				SystemFree(target, k);
+				return false;
+			}
+		}
+
+		AddHugePageUsed(span, false);
+		// 还给操作系统的地址不能再查到span，中间的页也可能留着以前的映射，一起清掉
+		if (ptr != oldPtr)
+		{
+			ClearMap(span->_pageId, span->_n);
+		}
+		else if (k < span->_n)
+		{
+			ClearMap(span->_pageId + k, span->_n - k);
+		}
+		span->_pageId = reinterpret_cast<PageID>(ptr) >> PAGE_SHIFT;
+		span->_n = k;
+		AddHugePageUsed(span, true);
+		SetMapObjectToSpan(span);
+		return true;
+	}
+
+	// 获取一个K页并且起始页号是alignPages倍数的span
+	Span* PageCache::NewAlignedSpan(size_t k, size_t alignPages)
+	{
+		assert(alignPages > 0 && (alignPages & (alignPages - 1)) == 0);
+		if (alignPages == 1)
+		{
+			return NewSpan(k);
+		}
+		// 多拿alignPages-1页，里面一定有一段对齐的K页
+		size_t total = k + alignPages - 1;
+		if (total >= NUM_PAGES)
+		{
+			return NewSystemSpan(k, alignPages);
 		}
-		// 还是没有，申请
-		void* ptr = SystemAlloc(NUM_PAGES-1); // 按最大量128页进行申请
-		Span* span = _spanPool.New();
-		span->_n = (NUM_PAGES - 1);
+		Span* span = NewSpan(total);
+		PageID alignedId = (span->_pageId + alignPages - 1) & ~static_cast<PageID>(alignPages - 1);
+		size_t headPages = alignedId - span->_pageId;
+		size_t tailPages = total - k - headPages;
+
+		// 中间对齐的部分继续使用这个span，需要先设置映射，这样归还首尾的时候不会和它合并
+		Span* head = nullptr;
+		if (headPages != 0)
+		{
+			head = NewSpanObject();
+			head->_pageId = span->_pageId;
+			head->_n = headPages;
+			head->_isUsed = true;
+		}
+		Span* tail = nullptr;
+		if (tailPages != 0)
+		{
+			tail = NewSpanObject();
+			tail->_pageId = alignedId + k;
+			tail->_n = tailPages;
+			tail->_isUsed = true;
+		}
+		span->_pageId = alignedId;
+		span->_n = k;
+		SetMapObjectToSpan(span);
+
+		// 首尾多余的页还给PageCache，和普通的释放一样会合并相邻的空闲span
+		if (head != nullptr)
+		{
+			ReleaseSpanToPageCache(head);
+		}
+		if (tail != nullptr)
+		{
+			ReleaseSpanToPageCache(tail);
+		}
+		return span;
+	}
+
+	// 超过管理范围的span直接向系统申请，只设置首页的映射
+	Span* PageCache::NewSystemSpan(size_t k, size_t alignPages)
+	{
+		void* ptr = SystemAllocAligned(k, alignPages);
+		NumaTopology::GetInstance()->BindMemory(ptr, k, _node);
+		Span* span = NewSpanObject();
+		span->_n = k;
 		span->_pageId = reinterpret_cast<PageID>(ptr) >> PAGE_SHIFT;
-		_spanList[span->_n].PushFront(span);
-
-		//// 申请的内存不为128才会有剩余的span
-		//if (k != (NUM_PAGES - 1))
-		//{
-		//	Span* leftSpan = _spanPool.New();
-		//	leftSpan->_pageId = span->_pageId + k;
-		//	leftSpan->_n = NUM_PAGES - k - 1;
-		//	_spanList[leftSpan->_n].PushFront(leftSpan); // 插入
-		//}
-		//SetMapObjectToSpan(span);
-		//return span;
-
-		// 上面这种方式没有复用代码，我们可以直接将最大页插入链表，然后复用上述拆分部分的代码
-		return NewSpan(k); // 因为已经申请了一个最大块，递归处理肯定能进行拆分
+		span->_isUsed = true;
+		AddHugePageUsed(span, true);
+		// 这里必须要设置，否则释放内存时无法确认是否大于256KB
+		SetMapObjectToSpan(span);
+		return span;
+	}
+
+	// 当前PageCache中空闲span的字节数
+	size_t PageCache::GetFreeBytes()
+	{
+		FreeSpanStats stats;
+		GetFreeSpanStats(stats);
+		return stats._pages << PAGE_SHIFT;
+	}
+
+	// 当前PageCache中空闲span的分布
+	void PageCache::GetFreeSpanStats(FreeSpanStats& stats)
+	{
+		std::unique_lock<std::mutex> lock(_pageMtx);
+		stats = FreeSpanStats();
+		for (size_t i = _nonEmpty.FindNext(1); i < NUM_PAGES; i = _nonEmpty.FindNext(i + 1))
+		{
+			for (Span* span = _spanList[i].Begin(); span != _spanList[i].End(); span = span->_next)
+			{
+				stats._spans++;
+				stats._pages += span->_n;
+			}
+			stats._largestPages = i;
+		}
+		for (Span* span : _largeSpans)
+		{
+			stats._spans++;
+			stats._pages += span->_n;
+		}
+		stats._largeSpans = _largeSpans.size();
+		if (!_largeSpans.empty())
+		{
+			stats._largestPages = (*_largeSpans.rbegin())->_n; // 按页数排序，最后一个最大
+		}
+	}
+
+	// 检查每个空闲span的首尾页映射是否正确，以及相邻的空闲span是否都已经合并
+	bool PageCache::CheckFreeSpans()
+	{
+		std::unique_lock<std::mutex> lock(_pageMtx);
+		auto check = [this](Span* span) {
+			PageID last = span->_pageId + span->_n - 1;
+			if (span->_isUsed || span->_node.load(std::memory_order_relaxed) != _node
+				|| _idSpanMap.Get(span->_pageId) != span || _idSpanMap.Get(last) != span)
+			{
+				return false;
+			}
+			Span* prev = static_cast<Span*>(_idSpanMap.Get(span->_pageId - 1));
+			if (prev != nullptr && prev->_node.load(std::memory_order_relaxed) == _node && !prev->_isUsed
+				&& prev->_pageId + prev->_n == span->_pageId)
+			{
+				return false;
+			}
+			Span* next = static_cast<Span*>(_idSpanMap.Get(last + 1));
+			return next == nullptr || next->_node.load(std::memory_order_relaxed) != _node || next->_isUsed
+				|| next->_pageId != last + 1;
+		};
+		for (size_t i = 1; i < NUM_PAGES; i++)
+		{
+			if (_spanList[i].Empty() == _nonEmpty.Test(i))
+			{
+				return false;
+			}
+			for (Span* span = _spanList[i].Begin(); span != _spanList[i].End(); span = span->_next)
+			{
+				if (span->_n != i || !check(span))
+				{
+					return false;
+				}
+			}
+		}
+		for (Span* span : _largeSpans)
+		{
+			if (!check(span))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// 空闲span插入链表，已经释放的放在链表末尾
+	void PageCache::InsertFreeSpan(Span* span)
+	{
+		if (span->_n >= NUM_PAGES)
+		{
+			_largeSpans.insert(span);
+			return;
+		}
+		if (span->_isReleased)
+		{
+			_spanList[span->_n].PushBack(span);
+		}
+		else
+		{
+			_spanList[span->_n].PushFront(span);
+		}
+		_nonEmpty.Set(span->_n);
+	}
+
+	// 从链表或者_largeSpans中删除空闲span，链表空了要同时清掉位图
+	void PageCache::EraseFreeSpan(Span* span)
+	{
+		if (span->_n >= NUM_PAGES)
+		{
+			_largeSpans.erase(span);
+			return;
+		}
+		_spanList[span->_n].Erase(span);
+		if (_spanList[span->_n].Empty())
+		{
+			_nonEmpty.Clear(span->_n);
+		}
+	}
+
+	// span被分配出去或者被合并了，不再算作已释放
+	void PageCache::ClearReleased(Span* span)
+	{
+		if (span->_isReleased)
+		{
+			_releasedPages.fetch_sub(span->_n, std::memory_order_relaxed);
+			span->_isReleased = false;
+		}
+	}
+
+	// 把空闲超过释放间隔的span的物理内存还给操作系统
+	size_t PageCache::ReleaseFreeMemory(size_t bytes)
+	{
+		// 闲置的对象占着span，span就不能全部回收合并，先把它们还回去
+		CentralCache::GetInstance()->ReleaseIdleTransfer(_node);
+
+		std::unique_lock<std::mutex> lock(_pageMtx);
+		size_t now = NowMs();
+		size_t interval = _releaseIntervalMs.load(std::memory_order_relaxed);
+		size_t released = 0;
+		// 先释放大的span，超过128页的span没有按是否释放排序，需要全部看一遍
+		for (auto itr = _largeSpans.rbegin(); itr != _largeSpans.rend() && released < bytes; ++itr)
+		{
+			Span* span = *itr;
+			if (!span->_isReleased && now - span->_freeTime >= interval)
+			{
+				SystemRelease(reinterpret_cast<void*>(span->_pageId << PAGE_SHIFT), span->_n);
+				span->_isReleased = true;
+				_releasedPages.fetch_add(span->_n, std::memory_order_relaxed);
+				released += span->_n << PAGE_SHIFT;
+			}
+		}
+		for (size_t i = NUM_PAGES - 1; i > 0 && released < bytes; i--)
+		{
+			// 没有释放的span都在链表前面，遇到已经释放的就可以停下了
+			Span* itr = _spanList[i].Begin();
+			while (itr != _spanList[i].End() && !itr->_isReleased && released < bytes)
+			{
+				Span* next = itr->_next;
+				// 大页模式下，span所在的大页如果大部分都在使用，释放它会把大页拆散，跳过
+				bool dense = _hugePageMode
+					&& (HugePageUsed(itr->_pageId) >= HUGEPAGE_PAGES / 2
+						|| HugePageUsed(itr->_pageId + itr->_n - 1) >= HUGEPAGE_PAGES / 2);
+				if (!dense && now - itr->_freeTime >= interval)
+				{
+					SystemRelease(reinterpret_cast<void*>(itr->_pageId << PAGE_SHIFT), itr->_n);
+					itr->_isReleased = true;
+					_releasedPages.fetch_add(itr->_n, std::memory_order_relaxed);
+					released += itr->_n << PAGE_SHIFT;
+
+					_spanList[i].Erase(itr);
+					_spanList[i].PushBack(itr);
+				}
+				itr = next;
+			}
+		}
+		return released;
+	}
+
+	// 启动后台线程，每隔periodMs毫秒对所有节点调用一次ReleaseFreeMemory
+	void PageCache::StartScavenger(size_t periodMs)
+	{
+		std::unique_lock<std::mutex> lock(_scavengerMtx);
+		if (_scavenger.joinable())
+		{
+			return; // 已经启动了
+		}
+		_scavengerStop = false;
+		_scavenger = std::thread([this, periodMs]() {
+			std::unique_lock<std::mutex> lock(_scavengerMtx);
+			while (!_scavengerCond.wait_for(lock, std::chrono::milliseconds(periodMs), [this]() { return _scavengerStop; }))
+			{
+				lock.unlock();
+				for (size_t i = 0; i < MAX_NUMA_NODES; i++)
+				{
+					GetInstance(i)->ReleaseFreeMemory(static_cast<size_t>(-1));
+				}
+				lock.lock();
+			}
+		});
+	}
+
+	void PageCache::StopScavenger()
+	{
+		{
+			std::unique_lock<std::mutex> lock(_scavengerMtx);
+			if (!_scavenger.joinable())
+			{
+				return;
+			}
+			_scavengerStop = true;
+		}
+		_scavengerCond.notify_all();
+		_scavenger.join();
+	}
+
+	// 从链表中取出一个span，大页模式下优先取所在大页使用率最高的
+	// 这样新分配的span会集中在少数大页中，空闲的大页可以完整地保留或者释放
+	Span* PageCache::PickSpan(size_t n)
+	{
+		SpanList& list = _spanList[n];
+		assert(!list.Empty());
+		if (!_hugePageMode)
+		{
+			Span* span = list.PopFront();
+			if (list.Empty())
+			{
+				_nonEmpty.Clear(n);
+			}
+			return span;
+		}
+
+		// 只看链表前面一部分还有物理内存的span，避免链表很长的时候遍历太久
+		const size_t MAX_SCAN = 16;
+		Span* best = list.Begin();
+		size_t bestUsed = HugePageUsed(best->_pageId);
+		Span* itr = best->_next;
+		for (size_t i = 1; i < MAX_SCAN && itr != list.End() && !itr->_isReleased; i++)
+		{
+			size_t used = HugePageUsed(itr->_pageId);
+			if (used > bestUsed)
+			{
+				best = itr;
+				bestUsed = used;
+			}
+			itr = itr->_next;
+		}
+		EraseFreeSpan(best);
+		return best;
+	}
+
+	// 修改span覆盖的每个大页中正在使用的页数，调用时需要持有锁
+	void PageCache::AddHugePageUsed(PageID start, size_t n, bool used)
+	{
+		const size_t shift = HUGEPAGE_SHIFT - PAGE_SHIFT;
+		PageID id = start;
+		PageID end = start + n;
+		while (id < end)
+		{
+			// 当前大页的范围是[hugeStart, hugeEnd)
+			PageID hugeId = id >> shift;
+			PageID hugeEnd = (hugeId + 1) << shift;
+			size_t n = (end < hugeEnd ? end : hugeEnd) - id;
+
+			_hugePageUsed.Ensure(hugeId, 1);
+			size_t count = reinterpret_cast<size_t>(_hugePageUsed.Get(hugeId));
+			count = used ? count + n : count - n;
+			_hugePageUsed.Set(hugeId, reinterpret_cast<void*>(count));
+			id += n;
+		}
+	}
+
+	// span所在的大页中有多少页正在使用
+	size_t PageCache::HugePageUsed(PageID id)
+	{
+		return reinterpret_cast<size_t>(_hugePageUsed.Get(id >> (HUGEPAGE_SHIFT - PAGE_SHIFT)));
 	}
 }
\ No newline at end of file
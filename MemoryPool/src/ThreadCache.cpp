@@ -1,21 +1,58 @@
 #include "../include/ThreadCache.h"
 #include "../include/CentralCache.h"
+#include "../include/PageCache.h"
+#include "../include/FixedMemPool.hpp"
+#include "../include/MallocExtension.h"
 
 #ifdef __linux__
 #include <algorithm>
+#include <pthread.h>
 #endif
 
 namespace mempool
 {
+#ifdef _WIN32
+	_declspec(thread) ThreadCache* TLSThreadCache = nullptr;
+#elif __linux__
+	__thread ThreadCache* TLSThreadCache __attribute__((tls_model("initial-exec"))) = nullptr;
+#endif
+
+	// 所有线程的ThreadCache对象都从这个定长内存池中获取，线程退出后还回来给下一个线程复用
+	static FixedMemoryPool<ThreadCache> tcPool;
+
+	// 正在使用的ThreadCache链表和额度，都在持有tcMtx的时候修改
+	static ThreadCache* tcHead = nullptr;
+	static size_t overallBudget = THREAD_CACHE_BUDGET;
+	// 还没有分给任何线程的额度，新线程至少会拿到MIN_THREAD_CACHE，所以可能是负数
+	static long long unclaimedBudget = THREAD_CACHE_BUDGET;
+	static std::mutex tcMtx;
+
+#ifdef _WIN32
+	static VOID WINAPI ThreadCacheExit(PVOID tc)
+	{
+		if (tc != nullptr)
+		{
+			ThreadCache::Destroy(static_cast<ThreadCache*>(tc));
+		}
+	}
+#elif __linux__
+	// pthread_key的析构回调只会在value不为空的时候调用
+	static void ThreadCacheExit(void* tc)
+	{
+		ThreadCache::Destroy(static_cast<ThreadCache*>(tc));
+	}
+#endif
+
 	void* ThreadCache::Allocate(size_t bytes)
 	{
-		assert(bytes < MAX_SIZE);
+		assert(bytes <= MAX_SIZE);
 		// 计算对应哈希表哪一个下标
 		size_t index = SizeClass::Index(bytes);
 		// 判断freelist中是否还有内存
 		if (_freeList[index].Size() != 0)
 		{
 			// 有，直接分配
+			AddCacheSize(-static_cast<long long>(SizeClass::ClassSize(index)));
 			return _freeList[index].Pop();
 		}
 		else
@@ -28,15 +65,21 @@ namespace mempool
 	void ThreadCache::Deallocate(void* ptr, size_t bytes) 
 	{
 		assert(ptr != nullptr);
-		assert(bytes < MAX_SIZE);
+		assert(bytes <= MAX_SIZE);
 
 		size_t index = SizeClass::Index(bytes);
 		_freeList[index].Push(ptr); // 插入对应位置
+		AddCacheSize(SizeClass::ClassSize(index));
 
 		// 当前链表长度已经大于一次性向中心缓存申请的长度，代表链表中的内存大概率用不完
 		if (_freeList[index].Size() >= _freeList[index].GetMaxSize())
 		{
-			ReleaseToCentralCache(_freeList[index], bytes);
+			ReleaseToCentralCache(index, _freeList[index].GetMaxSize());
+		}
+		// 整个线程缓存的内存超过了分到的额度
+		if (GetCacheSize() > GetMaxCacheSize())
+		{
+			Scavenge();
 		}
 	}
 
@@ -57,6 +100,7 @@ namespace mempool
 		void* start = nullptr;
 		void* end = nullptr;
 		size_t actualNum = CentralCache::GetInstance()->FetchRangeObj(start, end, batchNum, bytes);
+		CurrentThreadStats()->RecordFetch(index, actualNum);
 
 		if (actualNum == 1)
 		{
@@ -66,16 +110,203 @@ namespace mempool
 		else
 		{
 			_freeList[index].PushRange(NextObj(start), end, actualNum - 1);
+			AddCacheSize((actualNum - 1) * bytes);
 			return start;
 		}
 	}
 
-	void ThreadCache::ReleaseToCentralCache(FreeList& list, size_t bytes)
+	void ThreadCache::ReleaseToCentralCache(size_t index, size_t n)
 	{
 		void* start = nullptr;
 		void* end = nullptr;
-		list.PopRange(start, end, list.GetMaxSize()); // 将这个链表全部pop
+		size_t bytes = SizeClass::ClassSize(index);
+		_freeList[index].PopRange(start, end, n);
+		AddCacheSize(-static_cast<long long>(n * bytes));
+		CurrentThreadStats()->RecordReturn(index, n);
 		// 释放
-		CentralCache::GetInstance()->ReleaseListToSpans(start,bytes);
+		CentralCache::GetInstance()->ReleaseRangeObj(start, end, n, bytes);
+	}
+
+	void ThreadCache::Scavenge()
+	{
+		// 链表最短的时候还剩下的对象，说明最近一直没有用到，还回去一半
+		for (size_t i = 0; i < NUM_FREELIST; i++)
+		{
+			size_t lowWater = _freeList[i].GetLowWater();
+			if (lowWater > 0)
+			{
+				ReleaseToCentralCache(i, lowWater > 1 ? lowWater / 2 : 1);
+			}
+			_freeList[i].ResetLowWater();
+		}
+		// 还是超过额度，从大对象开始把整个链表还回去
+		for (size_t i = NUM_FREELIST; i > 0 && GetCacheSize() > GetMaxCacheSize(); i--)
+		{
+			if (!_freeList[i - 1].Empty())
+			{
+				ReleaseToCentralCache(i - 1, _freeList[i - 1].Size());
+			}
+		}
+		IncreaseCacheLimit();
+	}
+
+	void ThreadCache::IncreaseCacheLimit()
+	{
+		std::unique_lock<std::mutex> lock(tcMtx);
+		if (unclaimedBudget > 0)
+		{
+			size_t n = unclaimedBudget < static_cast<long long>(THREAD_CACHE_STEAL) ? unclaimedBudget : THREAD_CACHE_STEAL;
+			unclaimedBudget -= n;
+			_maxSize.store(GetMaxCacheSize() + n, std::memory_order_relaxed);
+			return;
+		}
+		// 找空闲额度（额度减去已经缓存的字节数）最多的线程，拿走它的一部分额度
+		// 被拿走额度的线程缓存超过额度之后，会在它自己释放内存的时候还给中心缓存
+		ThreadCache* victim = nullptr;
+		long long victimFree = 0;
+		for (ThreadCache* cur = tcHead; cur != nullptr; cur = cur->_next)
+		{
+			size_t maxSize = cur->GetMaxCacheSize();
+			long long free = static_cast<long long>(maxSize) - static_cast<long long>(cur->GetCacheSize());
+			if (cur != this && maxSize >= MIN_THREAD_CACHE + THREAD_CACHE_STEAL && free > victimFree)
+			{
+				victim = cur;
+				victimFree = free;
+			}
+		}
+		if (victim != nullptr)
+		{
+			victim->_maxSize.store(victim->GetMaxCacheSize() - THREAD_CACHE_STEAL, std::memory_order_relaxed);
+			_maxSize.store(GetMaxCacheSize() + THREAD_CACHE_STEAL, std::memory_order_relaxed);
+		}
+	}
+
+	void ThreadCache::SetOverallBudget(size_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(tcMtx);
+		unclaimedBudget += static_cast<long long>(bytes) - static_cast<long long>(overallBudget);
+		overallBudget = bytes;
+		// 额度不够分了，按比例减少每个线程超过最小额度的部分
+		if (unclaimedBudget < 0)
+		{
+			long long claimed = static_cast<long long>(bytes) - unclaimedBudget; // 已经分出去的额度
+			for (ThreadCache* cur = tcHead; cur != nullptr && unclaimedBudget < 0; cur = cur->_next)
+			{
+				size_t maxSize = cur->GetMaxCacheSize();
+				if (maxSize <= MIN_THREAD_CACHE)
+				{
+					continue;
+				}
+				size_t extra = maxSize - MIN_THREAD_CACHE;
+				size_t cut = static_cast<size_t>(static_cast<double>(-unclaimedBudget) * maxSize / claimed) + 1;
+				cut = cut < extra ? cut : extra;
+				cur->_maxSize.store(maxSize - cut, std::memory_order_relaxed);
+				unclaimedBudget += cut;
+			}
+		}
+	}
+
+	size_t ThreadCache::GetOverallBudget()
+	{
+		std::unique_lock<std::mutex> lock(tcMtx);
+		return overallBudget;
+	}
+
+	void ThreadCache::ReleaseAll()
+	{
+		for (size_t i = 0; i < NUM_FREELIST; i++)
+		{
+			if (_freeList[i].Empty())
+			{
+				continue;
+			}
+			void* start = nullptr;
+			void* end = nullptr;
+			size_t n = _freeList[i].Size();
+			_freeList[i].PopRange(start, end, n);
+			// 同一个链表中的对象大小都一样，通过span获取对象的大小
+			size_t bytes = PageCache::MapObjectToSpan(start)->_objSize;
+			CurrentThreadStats()->RecordReturn(i, n);
+			CentralCache::GetInstance()->ReleaseRangeObj(start, end, n, bytes);
+		}
+		_size.store(0, std::memory_order_relaxed);
+	}
+
+	// 持有tcMtx和tcPool的锁时不会再去拿中心缓存和PageCache的锁，fork前在它们之后加锁
+	void ThreadCache::LockAll()
+	{
+		tcPool.Lock();
+		tcMtx.lock();
+	}
+
+	void ThreadCache::UnlockAll()
+	{
+		tcMtx.unlock();
+		tcPool.Unlock();
+	}
+
+	ThreadCache* ThreadCache::Create()
+	{
+		ThreadCache* tc = tcPool.New();
+		// 绑定到当前CPU所在的NUMA节点，之后这个线程申请的span都在这个节点上
+		tc->_node = NumaTopology::GetInstance()->CurrentNode();
+		TLSNumaNode = tc->_node + 1;
+		{
+			// 加入链表并分配初始额度，额度已经分完的时候也给最小额度，之后再从其他线程那里拿
+			std::unique_lock<std::mutex> lock(tcMtx);
+			size_t n = MIN_THREAD_CACHE;
+			if (unclaimedBudget > static_cast<long long>(THREAD_CACHE_INIT))
+			{
+				n = THREAD_CACHE_INIT;
+			}
+			unclaimedBudget -= n;
+			tc->_maxSize.store(n, std::memory_order_relaxed);
+			tc->_next = tcHead;
+			if (tcHead != nullptr)
+			{
+				tcHead->_prev = tc;
+			}
+			tcHead = tc;
+		}
+		// 注册线程退出时的回调，C++11后static变量的初始化是线程安全的
+#ifdef _WIN32
+		static DWORD flsIndex = FlsAlloc(ThreadCacheExit);
+		FlsSetValue(flsIndex, tc);
+#elif __linux__
+		static pthread_key_t key = []() {
+			pthread_key_t k;
+			pthread_key_create(&k, ThreadCacheExit);
+			return k;
+		}();
+		pthread_setspecific(key, tc);
+#endif
+		return tc;
+	}
+
+	void ThreadCache::Destroy(ThreadCache* tc)
+	{
+		tc->ReleaseAll();
+		{
+			// 额度还回去，从链表中删除
+			std::unique_lock<std::mutex> lock(tcMtx);
+			unclaimedBudget += tc->GetMaxCacheSize();
+			if (tc->_prev != nullptr)
+			{
+				tc->_prev->_next = tc->_next;
+			}
+			else
+			{
+				tcHead = tc->_next;
+			}
+			if (tc->_next != nullptr)
+			{
+				tc->_next->_prev = tc->_prev;
+			}
+		}
+		if (TLSThreadCache == tc)
+		{
+			TLSThreadCache = nullptr;
+		}
+		tcPool.Delete(tc);
 	}
-}	
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include "../include/TransferCache.h"
+
+namespace mempool
+{
+	// 放入一批对象，传输缓存满了的时候返回false
+	bool TransferCache::InsertRange(void* start, void* end, size_t n, size_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		if (_used == MAX_TRANSFER_BATCHES || _bytes + n * bytes > TRANSFER_CACHE_BYTES)
+		{
+			_stats._insertMisses++;
+			return false;
+		}
+
+		_slots[_used]._start = start;
+		_slots[_used]._end = end;
+		_slots[_used]._n = n;
+		_used++;
+		_bytes += n * bytes;
+		_stats._insertHits++;
+		return true;
+	}
+
+	// 取出一批不超过batchNum个的对象，返回取到的数量
+	size_t TransferCache::RemoveRange(void*& start, void*& end, size_t batchNum, size_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		// 从栈顶开始找，批次数量太多的不能给，否则ThreadCache的链表会超过它的阈值
+		for (size_t i = _used; i > 0; i--)
+		{
+			Batch& batch = _slots[i - 1];
+			if (batch._n > batchNum)
+			{
+				continue;
+			}
+
+			start = batch._start;
+			end = batch._end;
+			size_t n = batch._n;
+			// 用栈顶的批次填补空位
+			batch = _slots[_used - 1];
+			_used--;
+			_bytes -= n * bytes;
+			if (_used < _lowWater)
+			{
+				_lowWater = _used;
+			}
+			_stats._removeHits++;
+			return n;
+		}
+
+		_stats._removeMisses++;
+		return 0;
+	}
+
+	// 栈底的_lowWater个批次从上次调用到现在都没有被取走，全部串起来交给调用方
+	// 取走中间的批次时会用栈顶的填补空位，所以这只是大概的结果，新放入的批次偶尔也会被一起取出
+	void* TransferCache::TakeIdle(size_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		void* list = nullptr;
+		for (size_t i = 0; i < _lowWater; i++)
+		{
+			NextObj(_slots[i]._end) = list;
+			list = _slots[i]._start;
+			_bytes -= _slots[i]._n * bytes;
+		}
+		// 剩下的批次移到栈底
+		for (size_t i = _lowWater; i < _used; i++)
+		{
+			_slots[i - _lowWater] = _slots[i];
+		}
+		_used -= _lowWater;
+		_lowWater = _used;
+		return list;
+	}
+
+	// 累加当前桶的命中情况
+	void TransferCache::GetStats(TransferCacheStats& stats)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		stats._insertHits += _stats._insertHits;
+		stats._insertMisses += _stats._insertMisses;
+		stats._removeHits += _stats._removeHits;
+		stats._removeMisses += _stats._removeMisses;
+		stats._bytes += _bytes;
+	}
+}
@@ -0,0 +1,189 @@
+// STL容器使用默认分配器和内存池适配器的性能对比
+// make stlbench.out && ./stlbench.out [最大线程数] [操作次数倍率]
+// 每个线程操作自己的容器，分别测试std::map、std::unordered_map和std::list
+#include "include/Allocator.hpp"
+using namespace mempool;
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <list>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <memory_resource>
+
+typedef std::chrono::steady_clock Clock;
+
+static const size_t KEYS = 1 << 16; // map中键的范围，元素数量在它的一半左右波动
+
+// 随机插入、查找和删除，一半的操作会申请或者释放节点
+template <class Map>
+static size_t MapWorkload(Map& map, size_t ops, std::mt19937& rng)
+{
+	size_t found = 0;
+	for (size_t i = 0; i < ops; i++)
+	{
+		int key = static_cast<int>(rng() % KEYS);
+		switch (rng() % 4)
+		{
+		case 0:
+			map.emplace(key, i);
+			break;
+		case 1:
+			map.erase(key);
+			break;
+		default:
+			found += map.find(key) != map.end();
+			break;
+		}
+	}
+	map.clear();
+	return found;
+}
+
+// 队列的用法：两头插入，从头部取出，偶尔整个清空
+template <class List>
+static size_t ListWorkload(List& list, size_t ops, std::mt19937& rng)
+{
+	size_t sum = 0;
+	for (size_t i = 0; i < ops; i++)
+	{
+		unsigned int r = rng() % 8;
+		if (r < 3)
+		{
+			list.push_back(i);
+		}
+		else if (r < 5)
+		{
+			list.push_front(i);
+		}
+		else if (r < 7 && !list.empty())
+		{
+			sum += list.front();
+			list.pop_front();
+		}
+		else if (list.size() > 4096)
+		{
+			list.clear();
+		}
+	}
+	list.clear();
+	return sum;
+}
+
+// 每个容器对应的几种分配器
+template <template <class> class Alloc>
+struct StdContainers
+{
+	typedef std::map<int, size_t, std::less<int>, Alloc<std::pair<const int, size_t>>> Map;
+	typedef std::unordered_map<int, size_t, std::hash<int>, std::equal_to<int>, Alloc<std::pair<const int, size_t>>> HashMap;
+	typedef std::list<size_t, Alloc<size_t>> List;
+
+	static Map NewMap() { return Map(); }
+	static HashMap NewHashMap() { return HashMap(); }
+	static List NewList() { return List(); }
+};
+
+template <class Resource>
+struct PmrContainers
+{
+	typedef std::pmr::map<int, size_t> Map;
+	typedef std::pmr::unordered_map<int, size_t> HashMap;
+	typedef std::pmr::list<size_t> List;
+
+	static Map NewMap() { return Map(Resource::Get()); }
+	static HashMap NewHashMap() { return HashMap(Resource::Get()); }
+	static List NewList() { return List(Resource::Get()); }
+};
+
+struct NewDeleteResource
+{
+	static std::pmr::memory_resource* Get() { return std::pmr::new_delete_resource(); }
+};
+
+struct PoolResource
+{
+	static std::pmr::memory_resource* Get() { return MemoryResource::GetInstance(); }
+};
+
+// threads个线程同时运行workload，返回每秒多少百万次操作
+template <class F>
+static double Run(size_t threads, size_t ops, F workload)
+{
+	std::atomic<size_t> sink{0};
+	std::vector<std::thread> pool;
+	Clock::time_point begin = Clock::now();
+	for (size_t i = 0; i < threads; i++)
+	{
+		pool.emplace_back([&, i]() {
+			std::mt19937 rng(static_cast<unsigned int>(i + 1));
+			sink += workload(ops, rng);
+		});
+	}
+	for (std::thread& t : pool)
+	{
+		t.join();
+	}
+	double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+	return threads * ops / seconds / 1e6;
+}
+
+template <class C>
+static void Report(const char* alloc, size_t threads, size_t ops)
+{
+	double map = Run(threads, ops, [](size_t n, std::mt19937& rng) {
+		typename C::Map m = C::NewMap();
+		return MapWorkload(m, n, rng);
+	});
+	double hashMap = Run(threads, ops, [](size_t n, std::mt19937& rng) {
+		typename C::HashMap m = C::NewHashMap();
+		return MapWorkload(m, n, rng);
+	});
+	double list = Run(threads, ops, [](size_t n, std::mt19937& rng) {
+		typename C::List l = C::NewList();
+		return ListWorkload(l, n, rng);
+	});
+	printf("%-18s %7zu %10.2f %14.2f %10.2f\n", alloc, threads, map, hashMap, list);
+	fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+	size_t maxThreads = std::thread::hardware_concurrency();
+	maxThreads = maxThreads < 4 ? 4 : maxThreads;
+	double scale = 1.0;
+	if (argc > 1)
+	{
+		maxThreads = strtoul(argv[1], nullptr, 10);
+	}
+	if (argc > 2)
+	{
+		scale = atof(argv[2]);
+	}
+	if (maxThreads == 0 || scale <= 0)
+	{
+		printf("usage: %s [max threads] [ops scale]\n", argv[0]);
+		return 1;
+	}
+	size_t ops = static_cast<size_t>(2000000 * scale);
+	ops = ops < 1 ? 1 : ops;
+
+	printf("allocator          threads  map(Mops/s)  unordered_map  list\n");
+	for (size_t threads = 1;; threads *= 2)
+	{
+		threads = threads > maxThreads ? maxThreads : threads;
+		Report<StdContainers<std::allocator>>("std::allocator", threads, ops);
+		Report<StdContainers<Allocator>>("mempool::Allocator", threads, ops);
+		Report<PmrContainers<NewDeleteResource>>("pmr new_delete", threads, ops);
+		Report<PmrContainers<PoolResource>>("pmr MemoryResource", threads, ops);
+		if (threads == maxThreads)
+		{
+			break;
+		}
+	}
+	return 0;
+}
@@ -1,16 +1,38 @@
 #include "include/Span.hpp"
 #include "include/FixedMemPool.hpp"
 #include "include/ConcurrentAlloc.hpp"
+#include "include/CpuCache.h"
+#include "include/MallocExtension.h"
+#include "include/HeapProfiler.h"
+#include "include/GuardedPageAllocator.h"
+#include "include/Allocator.hpp"
+#include "include/Arena.h"
 using namespace mempool;
 
 #include <cstdio>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <vector>
 #include <ctime>
 #include <thread>
+#include <random>
+#include <algorithm>
+#include <map>
+#include <list>
+#include <memory>
+#include <unordered_map>
 using namespace std;
 
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
 struct TreeNode
 {
 	int _val;
@@ -68,6 +90,109 @@ int TestFixedMemPool()
 
 	cout << "new cost time:" << end1 - begin1 << endl;
 	cout << "memory pool cost time:" << end2 - begin2 << endl;
+
+	// 1到MaxThreads个线程同时申请释放，对比加锁的定长内存池和每个线程缓存magazine的版本
+	const size_t MaxThreads = 4;
+	const size_t Batch = 64;
+	auto run = [&](size_t threads, auto& pool, auto alloc, auto free) {
+		std::vector<std::thread> workers;
+		auto begin = std::chrono::steady_clock::now();
+		for (size_t t = 0; t < threads; t++)
+		{
+			workers.emplace_back([&]() {
+				std::vector<TreeNode*> v(Batch);
+				for (size_t j = 0; j < Rounds * N / Batch; ++j)
+				{
+					alloc(pool, v.data());
+					free(pool, v.data());
+				}
+			});
+		}
+		for (auto& w : workers)
+		{
+			w.join();
+		}
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+	};
+	ConcurrentFixedPool<TreeNode> CPool;
+	for (size_t threads = 1; threads <= MaxThreads; threads++)
+	{
+		long long locked = run(threads, TNPool,
+			[](FixedMemoryPool<TreeNode>& pool, TreeNode** v) { for (size_t i = 0; i < Batch; i++) v[i] = pool.New(); },
+			[](FixedMemoryPool<TreeNode>& pool, TreeNode** v) { for (size_t i = 0; i < Batch; i++) pool.Delete(v[i]); });
+		long long magazine = run(threads, CPool,
+			[](ConcurrentFixedPool<TreeNode>& pool, TreeNode** v) { for (size_t i = 0; i < Batch; i++) v[i] = pool.New(); },
+			[](ConcurrentFixedPool<TreeNode>& pool, TreeNode** v) { for (size_t i = 0; i < Batch; i++) pool.Delete(v[i]); });
+		long long batch = run(threads, CPool,
+			[](ConcurrentFixedPool<TreeNode>& pool, TreeNode** v) { pool.NewBatch(v, Batch); },
+			[](ConcurrentFixedPool<TreeNode>& pool, TreeNode** v) { pool.DeleteBatch(v, Batch); });
+		cout << threads << " threads fixed pool: " << locked << "ms, magazine pool: " << magazine
+			 << "ms, batch: " << batch << "ms" << endl;
+	}
+
+	// 对象全部释放之后，chunk可以全部还给操作系统
+	std::vector<TreeNode*> v3(N);
+	CPool.NewBatch(v3.data(), N);
+	for (auto e : v3)
+	{
+		assert(e->_val == 0 && e->_left == nullptr);
+	}
+	std::unordered_map<TreeNode*, bool> unique;
+	for (auto e : v3)
+	{
+		unique[e] = true;
+	}
+	assert(unique.size() == N);
+	size_t chunks = CPool.ChunkCount();
+	std::thread other([&]() {
+		CPool.DeleteBatch(v3.data(), N / 2); // 在其他线程释放一半，线程退出时还给depot
+	});
+	other.join();
+	for (size_t i = N / 2; i < N; i++)
+	{
+		CPool.Delete(v3[i]);
+	}
+	size_t remain = CPool.ReleaseFreeChunks();
+	assert(remain == 0);
+	cout << "magazine pool chunks: " << chunks << " -> " << remain << endl;
+
+	// 连续创建的内存池编号连续，第1个和第POOL_THREAD_SLOTS+1个在线程的缓存数组中冲突
+	// 交替使用它们时两个都应该留在当前线程的缓存中，不会互相挤掉
+	std::vector<std::unique_ptr<ConcurrentFixedPool<TreeNode>>> pools;
+	for (size_t i = 0; i <= POOL_THREAD_SLOTS; i++)
+	{
+		pools.emplace_back(new ConcurrentFixedPool<TreeNode>);
+	}
+	ConcurrentFixedPool<TreeNode>& first = *pools.front();
+	ConcurrentFixedPool<TreeNode>& last = *pools.back();
+	for (size_t i = 0; i < N; i++)
+	{
+		TreeNode* a = first.New();
+		TreeNode* b = last.New();
+		assert(a != b);
+		first.Delete(a);
+		last.Delete(b);
+	}
+	assert(first.CachedInThisThread() && last.CachedInThisThread());
+
+	// 同时使用的内存池比位置多时只能挤掉别的，对象仍然要正确地申请和释放
+	std::vector<TreeNode*> objs;
+	for (size_t round = 0; round < 4; round++)
+	{
+		for (auto& pool : pools)
+		{
+			objs.push_back(pool->New());
+		}
+		for (size_t i = 0; i < pools.size(); i++)
+		{
+			pools[i]->Delete(objs[i]);
+		}
+		objs.clear();
+	}
+	for (auto& pool : pools)
+	{
+		assert(pool->ReleaseFreeChunks() == 0);
+	}
 	return 0;
 }
 
@@ -188,10 +313,1381 @@ void TestBigAlloc()
 	ConcurrentFree(ptr);
 }
 
+// 测试带size的释放接口，对比不带size时需要查询span的耗时
+void TestSizedFree()
+{
+	const size_t Rounds = 10;  // 申请释放的轮次
+	const size_t N = 100000;   // 每轮申请释放多少次
+	const size_t sizes[] = { 8, 16, 24, 48, 96, 128, 200, 512, 1000, 4096 };
+	const size_t numSizes = sizeof(sizes) / sizeof(sizes[0]);
+
+	std::vector<void*> v;
+	v.reserve(N);
+	size_t unsizedTime = 0;
+	size_t sizedTime = 0;
+	for (size_t j = 0; j < Rounds; ++j)
+	{
+		// 不带size的释放
+		for (size_t i = 0; i < N; ++i)
+		{
+			v.push_back(ConcurrentAlloc(sizes[i % numSizes]));
+		}
+		size_t begin1 = clock();
+		for (size_t i = 0; i < N; ++i)
+		{
+			ConcurrentFree(v[i]);
+		}
+		size_t end1 = clock();
+		unsizedTime += end1 - begin1;
+		v.clear();
+
+		// 带size的释放
+		for (size_t i = 0; i < N; ++i)
+		{
+			v.push_back(ConcurrentAlloc(sizes[i % numSizes]));
+		}
+		size_t begin2 = clock();
+		for (size_t i = 0; i < N; ++i)
+		{
+			ConcurrentFree(v[i], sizes[i % numSizes]);
+		}
+		size_t end2 = clock();
+		sizedTime += end2 - begin2;
+		v.clear();
+	}
+
+	cout << "unsized free cost time:" << unsizedTime << endl;
+	cout << "sized free cost time:" << sizedTime << endl;
+
+	// 通过PoolObject使用sized operator delete
+	struct PoolNode : public PoolObject
+	{
+		TreeNode _node;
+	};
+	PoolNode* node = new PoolNode;
+	delete node;
+	PoolNode* nodes = new PoolNode[16];
+	delete[] nodes;
+}
+
+// 测试线程退出后ThreadCache是否被回收并给下一个线程复用
+void TestThreadExit()
+{
+	ThreadCache* first = nullptr;
+	bool reused = true;
+	for (int i = 0; i < 10; i++)
+	{
+		std::thread t([&]() {
+			std::vector<void*> v;
+			for (int j = 0; j < 100; j++)
+			{
+				v.push_back(ConcurrentAlloc(16 + j));
+			}
+			for (auto e : v)
+			{
+				ConcurrentFree(e);
+			}
+			// 线程是依次启动的，上一个线程退出时归还的ThreadCache会被这个线程拿到
+			if (first == nullptr)
+			{
+				first = TLSThreadCache;
+			}
+			else if (first != TLSThreadCache)
+			{
+				reused = false;
+			}
+		});
+		t.join();
+	}
+	cout << "thread cache reused: " << (reused ? "yes" : "no") << endl;
+}
+
+// ThreadCache的总额度：多个线程同时缓存很多对象，总量不会超过额度
+// 额度用完之后，需要缓存更多内存的线程从空闲额度最多的线程那里拿
+void TestThreadCacheBudget()
+{
+	if (CpuCache::GetInstance()->IsActive())
+	{
+		cout << "thread cache budget: per-cpu cache active, skipped" << endl;
+		return;
+	}
+	ConcurrentFree(ConcurrentAlloc(8)); // 保证主线程有ThreadCache
+	const size_t oldBudget = ThreadCache::GetOverallBudget();
+	const size_t Budget = 2 * 1024 * 1024;
+	const size_t Threads = 8;
+	ThreadCache::SetOverallBudget(Budget);
+
+	// 每个线程在32个桶中各缓存一批对象，没有额度限制的话每个线程会缓存几MB
+	auto churn = []() {
+		std::vector<void*> v;
+		for (int round = 0; round < 4; round++)
+		{
+			for (size_t i = 0; i < 4000; i++)
+			{
+				v.push_back(ConcurrentAlloc(64 + (i % 32) * 512));
+			}
+			for (auto e : v)
+			{
+				ConcurrentFree(e);
+			}
+			v.clear();
+		}
+	};
+	std::vector<size_t> cached(Threads), limits(Threads);
+	std::atomic<size_t> finished{0};
+	std::vector<std::thread> threads;
+	for (size_t id = 0; id < Threads; id++)
+	{
+		threads.emplace_back([&, id]() {
+			churn();
+			// 最后一次释放之后缓存不超过额度，之后额度可能被其他线程拿走，等下次释放时才会还回去
+			cached[id] = TLSThreadCache->GetCacheSize();
+			assert(cached[id] <= TLSThreadCache->GetMaxCacheSize());
+			// 所有线程都不再释放内存之后再统计额度
+			finished++;
+			while (finished.load() < Threads)
+			{
+				std::this_thread::yield();
+			}
+			limits[id] = TLSThreadCache->GetMaxCacheSize();
+			finished++;
+			while (finished.load() < 2 * Threads)
+			{
+				std::this_thread::yield();
+			}
+		});
+	}
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	size_t totalCached = 0;
+	size_t totalLimit = 0;
+	for (size_t id = 0; id < Threads; id++)
+	{
+		totalCached += cached[id];
+		totalLimit += limits[id];
+	}
+	// 额度分完之后新线程也会拿到最小额度
+	assert(totalLimit <= Budget + Threads * MIN_THREAD_CACHE);
+
+	// 一个空闲的线程拿着额度，把总额度设置成刚好分完，另一个线程需要更多的时候只能从其他线程拿
+	std::atomic<ThreadCache*> idle{nullptr};
+	std::atomic<bool> stop{false};
+	std::thread idleThread([&]() {
+		ConcurrentFree(ConcurrentAlloc(8));
+		idle = TLSThreadCache;
+		while (!stop.load())
+		{
+			std::this_thread::yield();
+		}
+	});
+	while (idle.load() == nullptr)
+	{
+		std::this_thread::yield();
+	}
+	const size_t othersBefore = idle.load()->GetMaxCacheSize() + TLSThreadCache->GetMaxCacheSize();
+	ThreadCache::SetOverallBudget(othersBefore);
+	size_t busyLimit = 0;
+	std::thread busy([&]() {
+		churn();
+		busyLimit = TLSThreadCache->GetMaxCacheSize();
+	});
+	busy.join();
+	const size_t othersAfter = idle.load()->GetMaxCacheSize() + TLSThreadCache->GetMaxCacheSize();
+	stop = true;
+	idleThread.join();
+	assert(busyLimit > MIN_THREAD_CACHE);
+	assert(othersAfter < othersBefore);
+	ThreadCache::SetOverallBudget(oldBudget);
+
+	cout << "thread cache budget: " << Budget << ", " << Threads << " threads cached " << totalCached
+		 << " bytes (limits " << totalLimit << "), stolen " << othersBefore - othersAfter << " bytes" << endl;
+}
+
+// 新的span按需切分：第一次申请某个大小的对象，不会访问span中所有的页
+void TestLazyCarve()
+{
+#ifdef __linux__
+	// 找一个其他测试没有用过、span有很多页的桶，这个桶一定会拿到新的span
+	MallocStats stats;
+	MallocExtension::GetMallocStats(stats);
+	size_t index = NUM_FREELIST;
+	for (size_t i = 0; i < NUM_FREELIST; i++)
+	{
+		if (stats._classes[i]._allocs == 0 && sizeClassTable._classes[i]._pages >= 16)
+		{
+			index = i;
+			break;
+		}
+	}
+	assert(index != NUM_FREELIST);
+	const size_t Size = SizeClass::ClassSize(index);
+	// 缺页按操作系统的页统计
+	const size_t osPages = (SizeClass::NumMovePage(Size) << PAGE_SHIFT) / sysconf(_SC_PAGESIZE);
+
+	// 空闲的页都还给操作系统，新的span不管从哪里来，访问到的页都会重新缺页
+	PageCache::GetInstance()->SetReleaseInterval(0);
+	PageCache::GetInstance()->ReleaseFreeMemory(static_cast<size_t>(-1));
+	PageCache::GetInstance()->SetReleaseInterval(10 * 1000);
+	struct rusage before, after;
+	getrusage(RUSAGE_THREAD, &before);
+	void* ptr = ConcurrentAlloc(Size);
+	getrusage(RUSAGE_THREAD, &after);
+	size_t faults = after.ru_minflt - before.ru_minflt;
+	memset(ptr, 0, Size);
+	ConcurrentFree(ptr);
+	assert(faults < osPages / 2);
+	cout << "lazy carve: first alloc of " << Size << " bytes faulted " << faults << " of " << osPages << " pages" << endl;
+#endif
+}
+
+// 测试中心缓存按使用率分档：先从更满的span分配，分布可以通过统计接口看到
+void TestSpanOccupancy()
+{
+	// 找一个没有用过、一个span能切出足够多对象的桶，直接操作中心缓存，不经过ThreadCache
+	MallocStats stats;
+	MallocExtension::GetMallocStats(stats);
+	size_t index = NUM_FREELIST;
+	for (size_t i = 0; i < NUM_FREELIST; i++)
+	{
+		const SizeClassInfo& info = sizeClassTable._classes[i];
+		if (stats._classes[i]._allocs == 0 && stats._classes[i]._spansInUse == 0
+			&& (info._pages << PAGE_SHIFT) / info._size >= 16)
+		{
+			index = i;
+			break;
+		}
+	}
+	assert(index != NUM_FREELIST);
+	const size_t Size = SizeClass::ClassSize(index);
+	const size_t capacity = (SizeClass::NumMovePage(Size) << PAGE_SHIFT) / Size;
+	CentralCache* central = CentralCache::GetInstance();
+	PageCache* pageCache = PageCache::GetInstance();
+
+	// 拿到两个span的全部对象，前一半来自a，后一半来自b
+	std::vector<void*> objs;
+	for (size_t i = 0; i < capacity * 2; i++)
+	{
+		void* start = nullptr;
+		void* end = nullptr;
+		central->FetchRangeObj(start, end, 1, Size);
+		objs.push_back(start);
+	}
+	Span* a = pageCache->MapObjectToSpan(objs.front());
+	Span* b = pageCache->MapObjectToSpan(objs.back());
+	assert(a != b && a->_capacity == capacity);
+
+	// a还回去3/4，b还回去1/4
+	auto release = [&](Span* span, size_t count) {
+		void* list = nullptr;
+		for (auto itr = objs.begin(); itr != objs.end() && count > 0;)
+		{
+			if (pageCache->MapObjectToSpan(*itr) == span)
+			{
+				NextObj(*itr) = list;
+				list = *itr;
+				itr = objs.erase(itr);
+				count--;
+			}
+			else
+			{
+				++itr;
+			}
+		}
+		central->ReleaseListToSpans(list, Size);
+	};
+	release(a, capacity * 3 / 4);
+	release(b, capacity / 4);
+
+	CentralBucketStats bucket;
+	central->GetBucketStats(index, bucket);
+	assert(bucket._spans == 2);
+	size_t binA = (capacity - capacity * 3 / 4) * NUM_OCCUPANCY_BINS / capacity;
+	size_t binB = (capacity - capacity / 4) * NUM_OCCUPANCY_BINS / capacity;
+	assert(binA < binB);
+	assert(bucket._occupancy[binA] == 1 && bucket._occupancy[binB] == 1);
+
+	// 再申请的对象来自更满的b
+	void* start = nullptr;
+	void* end = nullptr;
+	central->FetchRangeObj(start, end, 1, Size);
+	assert(pageCache->MapObjectToSpan(start) == b);
+	objs.push_back(start);
+
+	MallocExtension::GetMallocStats(stats);
+	assert(stats._classes[index]._spanOccupancy[binA] == 1);
+	assert(MallocExtension::GetStats().find("Central cache spans by occupancy:") != std::string::npos);
+
+	// 全部还回去之后两个span都还给了PageCache
+	release(a, capacity);
+	release(b, capacity);
+	assert(objs.empty());
+	CentralBucketStats after;
+	central->GetBucketStats(index, after);
+	assert(after._spans == 0);
+	cout << "span occupancy: " << Size << " bytes, " << capacity << " objects per span, bins " << binA << " and " << binB << endl;
+}
+
+// 测试跨线程释放：一个线程申请，另一个从来没有申请过内存的线程释放
+void TestCrossThreadFree()
+{
+	const size_t N = 10000;
+	std::vector<void*> v;
+	for (size_t i = 0; i < N; i++)
+	{
+		v.push_back(ConcurrentAlloc(32));
+	}
+	std::thread consumer([&]() {
+		for (auto e : v)
+		{
+			ConcurrentFree(e);
+		}
+	});
+	consumer.join();
+
+	// 释放的对象回到了span中，申请线程再次申请的时候可以拿到同一批内存
+	std::unordered_map<void*, bool> freed;
+	for (auto e : v)
+	{
+		freed[e] = true;
+	}
+	size_t reused = 0;
+	std::vector<void*> v2;
+	for (size_t i = 0; i < N; i++)
+	{
+		void* ptr = ConcurrentAlloc(32);
+		if (freed.count(ptr))
+		{
+			reused++;
+		}
+		v2.push_back(ptr);
+	}
+	for (auto e : v2)
+	{
+		ConcurrentFree(e);
+	}
+	cout << "cross thread free reused: " << reused << "/" << N << endl;
+
+	// 释放线程自己也申请这个大小，对象先进它的ThreadCache，但是链表长度受这个桶的阈值限制
+	// 超出的部分成批还给中心缓存，释放线程还在运行的时候申请线程就能重新拿到大部分对象
+	std::vector<void*> produced;
+	for (size_t i = 0; i < N; i++)
+	{
+		produced.push_back(ConcurrentAlloc(32));
+	}
+	std::atomic<int> step{0};
+	bool checked = false;
+	size_t kept = 0;
+	std::thread worker([&]() {
+		std::vector<void*> own;
+		for (size_t i = 0; i < 64; i++)
+		{
+			own.push_back(ConcurrentAlloc(32));
+		}
+		for (auto e : own)
+		{
+			ConcurrentFree(e);
+		}
+		for (auto e : produced)
+		{
+			ConcurrentFree(e);
+		}
+		checked = TLSThreadCache != nullptr && TLSThreadCache->IsAllocating(32);
+		kept = checked ? TLSThreadCache->GetCacheSize() : 0;
+		step = 1;
+		while (step != 2)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	});
+	while (step != 1)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	freed.clear();
+	for (auto e : produced)
+	{
+		freed[e] = true;
+	}
+	size_t returned = 0;
+	v.clear();
+	for (size_t i = 0; i < N; i++)
+	{
+		void* ptr = ConcurrentAlloc(32);
+		if (freed.count(ptr))
+		{
+			returned++;
+		}
+		v.push_back(ptr);
+	}
+	step = 2;
+	worker.join();
+	if (checked)
+	{
+		assert(kept < N * 32 / 10);
+		assert(returned > N * 8 / 10);
+	}
+	for (auto e : v)
+	{
+		ConcurrentFree(e);
+	}
+	cout << "allocating consumer kept " << kept << " bytes, producer got back " << returned << "/" << N << endl;
+}
+
+// 测试传输缓存：多个线程反复申请释放同一个大小的对象，批次在线程之间直接交换
+void TestTransferCache()
+{
+	auto work = []() {
+		std::vector<void*> v;
+		for (int round = 0; round < 10; round++)
+		{
+			for (int i = 0; i < 2000; i++)
+			{
+				v.push_back(ConcurrentAlloc(64));
+			}
+			for (auto e : v)
+			{
+				ConcurrentFree(e);
+			}
+			v.clear();
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; i++)
+	{
+		threads.emplace_back(work);
+	}
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+
+	TransferCacheStats stats = CentralCache::GetInstance()->GetTransferCacheStats();
+	cout << "transfer cache insert hit/miss: " << stats._insertHits << "/" << stats._insertMisses
+		 << " remove hit/miss: " << stats._removeHits << "/" << stats._removeMisses
+		 << " hit rate: " << stats.HitRate() << endl;
+}
+
+// 测试per-CPU缓存，需要使用make test_percpu.out编译
+void TestCpuCache()
+{
+	if (!CpuCache::GetInstance()->IsActive())
+	{
+		cout << "per-cpu cache: inactive" << endl;
+		return;
+	}
+
+	// 线程数远多于核数，前端缓存的内存也不会随着线程数增长
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 64; i++)
+	{
+		threads.emplace_back([]() {
+			std::vector<void*> v;
+			for (int round = 0; round < 10; round++)
+			{
+				for (int j = 0; j < 1000; j++)
+				{
+					v.push_back(ConcurrentAlloc(8 + (j % 64) * 16));
+				}
+				for (auto e : v)
+				{
+					ConcurrentFree(e);
+				}
+				v.clear();
+			}
+		});
+	}
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	cout << "per-cpu cache: active, slab bytes: " << CpuCache::GetInstance()->GetSlabBytes() << endl;
+}
+
+// 测试PageCache的查找：位图找非空链表，超过128页的空闲span按最合适的大小复用
+void TestPageCacheSearch()
+{
+	Bitmap<NUM_PAGES> bitmap;
+	assert(bitmap.FindNext(0) == NUM_PAGES);
+	bitmap.Set(5);
+	bitmap.Set(64);
+	bitmap.Set(NUM_PAGES - 1);
+	assert(bitmap.FindNext(0) == 5 && bitmap.FindNext(5) == 5);
+	assert(bitmap.FindNext(6) == 64 && bitmap.FindNext(65) == NUM_PAGES - 1);
+	bitmap.Clear(64);
+	assert(bitmap.FindNext(6) == NUM_PAGES - 1 && !bitmap.Test(64));
+
+	// 释放的大块内存留在PageCache中，之后更小的大块内存直接从它拆分，不再向系统申请
+	// 释放时可能和相邻的空闲span合并，所以不检查具体的地址
+	const size_t Big = 4 * 1024 * 1024;
+	const size_t Small = 3 * 1024 * 1024;
+	void* big = ConcurrentAlloc(Big);
+	ConcurrentFree(big);
+	FreeSpanStats stats;
+	PageCache::GetInstance()->GetFreeSpanStats(stats);
+	assert(stats._largeSpans >= 1 && stats._largestPages >= (Big >> PAGE_SHIFT));
+	size_t mapped = systemMappedBytes.load();
+	void* small = ConcurrentAlloc(Small);
+	void* rest = ConcurrentAlloc(Big - Small);
+	assert(systemMappedBytes.load() == mapped);
+	memset(small, 1, Small);
+	memset(rest, 1, Big - Small);
+	ConcurrentFree(small);
+	ConcurrentFree(rest);
+	PageCache::GetInstance()->GetFreeSpanStats(stats);
+	cout << "pagecache search: large span reused, large free spans " << stats._largeSpans << endl;
+}
+
+// 测试span的合并：随机申请释放不同页数的span之后，空闲span的首尾页映射正确，相邻的空闲span都已经合并
+void TestSpanCoalesce()
+{
+	std::mt19937 rng(7);
+	std::vector<void*> v;
+	FreeSpanStats before;
+	PageCache::GetInstance()->GetFreeSpanStats(before);
+	for (int round = 0; round < 8; round++)
+	{
+		// 33到160页，一部分由PageCache的链表分配，一部分超过128页
+		for (int i = 0; i < 64; i++)
+		{
+			v.push_back(ConcurrentAlloc((33 + rng() % 128) << PAGE_SHIFT));
+		}
+		std::shuffle(v.begin(), v.end(), rng);
+		for (int i = 0; i < 48; i++)
+		{
+			ConcurrentFree(v.back());
+			v.pop_back();
+		}
+		assert(PageCache::GetInstance()->CheckFreeSpans());
+	}
+	for (auto e : v)
+	{
+		ConcurrentFree(e);
+	}
+	assert(PageCache::GetInstance()->CheckFreeSpans());
+
+	FreeSpanStats after;
+	PageCache::GetInstance()->GetFreeSpanStats(after);
+	cout << "span coalesce: free spans " << before._spans << " -> " << after._spans
+		 << ", largest " << before._largestPages << " -> " << after._largestPages << " pages" << endl;
+}
+
+// 假的NUMA拓扑：每个线程自己决定在哪个节点上
+static thread_local size_t fakeNumaNode = 0;
+static size_t FakeCurrentNode()
+{
+	return fakeNumaNode;
+}
+
+// 测试每个NUMA节点的PageCache：span从线程所在节点申请，不管在哪个线程释放都还给申请它的节点
+void TestNumaHeaps()
+{
+	const size_t N = 16;
+	NumaTopology::GetInstance()->SetFakeTopology(2, FakeCurrentNode);
+	assert(NumaTopology::GetInstance()->NumNodes() == 2);
+
+	void* large[2][N];
+	size_t pages[2] = {0, 0};
+	for (size_t node = 0; node < 2; node++)
+	{
+		std::thread t([&, node]() {
+			fakeNumaNode = node;
+			void* small = ConcurrentAlloc(64);
+			// 新线程的ThreadCache绑定到所在的节点
+			if (TLSThreadCache != nullptr)
+			{
+				assert(TLSThreadCache->GetNode() == node);
+			}
+			for (size_t i = 0; i < N; i++)
+			{
+				large[node][i] = ConcurrentAlloc((40 + i) << PAGE_SHIFT);
+				Span* span = PageCache::MapObjectToSpan(large[node][i]);
+				assert(span->_node == node);
+				pages[node] += span->_n;
+			}
+			ConcurrentFree(small);
+		});
+		t.join();
+	}
+
+	// 小对象也只从本节点的span中切分，另一个节点的线程还回来的对象不会被拿走
+	for (size_t round = 0; round < 4; round++)
+	{
+		std::thread t([&, round]() {
+			fakeNumaNode = round % 2;
+			void* objs[N * 8];
+			for (size_t i = 0; i < N * 8; i++)
+			{
+				objs[i] = ConcurrentAlloc(48);
+				if (TLSThreadCache != nullptr)
+				{
+					assert(PageCache::MapObjectToSpan(objs[i])->_node == round % 2);
+				}
+			}
+			for (size_t i = 0; i < N * 8; i++)
+			{
+				ConcurrentFree(objs[i]);
+			}
+		});
+		t.join();
+	}
+
+	// 节点1的线程释放节点0申请的内存，span回到节点0的PageCache
+	FreeSpanStats before[2];
+	PageCache::GetInstance(0)->GetFreeSpanStats(before[0]);
+	PageCache::GetInstance(1)->GetFreeSpanStats(before[1]);
+	std::thread t([&]() {
+		fakeNumaNode = 1;
+		for (size_t i = 0; i < N; i++)
+		{
+			ConcurrentFree(large[0][i]);
+		}
+	});
+	t.join();
+	FreeSpanStats after[2];
+	PageCache::GetInstance(0)->GetFreeSpanStats(after[0]);
+	PageCache::GetInstance(1)->GetFreeSpanStats(after[1]);
+	assert(after[0]._pages == before[0]._pages + pages[0]);
+	assert(after[1]._pages == before[1]._pages);
+
+	// 反过来在节点0释放节点1申请的内存，两个节点的空闲span不会互相合并
+	for (size_t i = 0; i < N; i++)
+	{
+		ConcurrentFree(large[1][i]);
+	}
+	PageCache::GetInstance(1)->GetFreeSpanStats(after[1]);
+	assert(after[1]._pages == before[1]._pages + pages[1]);
+	assert(PageCache::GetInstance(0)->CheckFreeSpans());
+	assert(PageCache::GetInstance(1)->CheckFreeSpans());
+
+	NumaTopology::GetInstance()->SetFakeTopology(0, nullptr);
+	cout << "numa heaps: node0 free spans " << after[0]._spans << ", node1 free spans " << after[1]._spans
+		 << ", real nodes " << NumaTopology::GetInstance()->NumNodes() << endl;
+}
+
+// 测试把PageCache中空闲的span还给操作系统
+void TestReleaseFreeMemory()
+{
+	std::vector<void*> v;
+	for (int i = 0; i < 20; i++)
+	{
+		v.push_back(ConcurrentAlloc(300 * 1024));
+	}
+	for (auto e : v)
+	{
+		ConcurrentFree(e);
+	}
+	v.clear();
+
+	// 刚释放的span还没有达到释放间隔，不会被释放
+	PageCache::GetInstance()->SetReleaseInterval(60 * 1000);
+	size_t released1 = PageCache::GetInstance()->ReleaseFreeMemory(static_cast<size_t>(-1));
+	PageCache::GetInstance()->SetReleaseInterval(0);
+	size_t released2 = PageCache::GetInstance()->ReleaseFreeMemory(static_cast<size_t>(-1));
+	cout << "released bytes: " << released1 << " -> " << released2
+		 << ", pagecache released bytes: " << PageCache::GetInstance()->GetReleasedBytes() << endl;
+
+	// 重新申请的时候会复用已经释放的span
+	for (int i = 0; i < 20; i++)
+	{
+		v.push_back(ConcurrentAlloc(300 * 1024));
+	}
+	cout << "pagecache released bytes after reuse: " << PageCache::GetInstance()->GetReleasedBytes() << endl;
+	for (auto e : v)
+	{
+		ConcurrentFree(e);
+	}
+
+	// 后台线程
+	PageCache::GetInstance()->StartScavenger(10);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	PageCache::GetInstance()->StopScavenger();
+	PageCache::GetInstance()->SetReleaseInterval(10 * 1000);
+	cout << "pagecache released bytes after scavenger: " << PageCache::GetInstance()->GetReleasedBytes() << endl;
+
+	// 其他线程释放的小对象留在传输缓存中，两次释放之间没有被用到，第二次释放时还给span
+	std::thread t([]() {
+		std::vector<void*> objs;
+		for (int i = 0; i < 10000; i++)
+		{
+			objs.push_back(ConcurrentAlloc(64));
+		}
+		for (auto e : objs)
+		{
+			ConcurrentFree(e);
+		}
+	});
+	t.join();
+	size_t cached = CentralCache::GetInstance()->GetTransferCacheStats()._bytes;
+	for (size_t round = 0; round < 2; round++)
+	{
+		for (size_t node = 0; node < MAX_NUMA_NODES; node++)
+		{
+			PageCache::GetInstance(node)->ReleaseFreeMemory(0);
+		}
+	}
+	assert(CentralCache::GetInstance()->GetTransferCacheStats()._bytes == 0);
+	cout << "transfer cache bytes after release: " << cached << " -> 0" << endl;
+}
+
+#ifdef __linux__
+// 打开当前进程的dTLB读取缺失计数器，不支持的时候返回-1
+static int OpenTLBMissCounter()
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+#endif
+
+// 对比普通模式和透明大页模式下随机访问大量内存的dTLB缺失次数
+// 每种模式在一个子进程里面跑，保证PageCache是干净的
+void TestHugePageTLB()
+{
+#ifdef __linux__
+	const size_t N = 8192;			 // 对象数量
+	const size_t ObjSize = 16 * 1024; // 一共128MB
+	const size_t Accesses = 4 * 1000 * 1000;
+
+	for (int mode = 0; mode < 2; mode++)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			PageCache::GetInstance()->SetHugePageMode(mode == 1);
+			std::vector<char*> v;
+			for (size_t i = 0; i < N; i++)
+			{
+				char* ptr = static_cast<char*>(ConcurrentAlloc(ObjSize));
+				memset(ptr, 1, ObjSize);
+				v.push_back(ptr);
+			}
+
+			int fd = OpenTLBMissCounter();
+			std::mt19937 rng(12345);
+			size_t sum = 0;
+			if (fd >= 0)
+			{
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+			auto begin = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < Accesses; i++)
+			{
+				size_t r = rng();
+				sum += v[r % N][(r >> 13) % ObjSize];
+			}
+			auto end = std::chrono::steady_clock::now();
+			long long misses = -1;
+			if (fd >= 0)
+			{
+				ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+				if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+				{
+					misses = -1;
+				}
+				close(fd);
+			}
+
+			cout << (mode == 1 ? "hugepage" : "normal  ") << " mode: "
+				 << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms, dTLB misses: ";
+			if (misses >= 0)
+			{
+				cout << misses;
+			}
+			else
+			{
+				cout << "n/a (perf counters unavailable)";
+			}
+			cout << " (" << sum << ")" << endl;
+			_exit(0);
+		}
+		waitpid(pid, nullptr, 0);
+	}
+#endif
+}
+
+// 对齐申请：每种对齐和大小组合都检查地址是否对齐，写满之后再释放
+void TestAlignedAlloc()
+{
+	const size_t aligns[] = { 8, 16, 32, 64, 4096, 8192, 16 * 1024, 64 * 1024, 2 * 1024 * 1024 };
+	const size_t sizes[] = { 1, 24, 100, 1000, 5000, 70 * 1024, 300 * 1024, 2 * 1024 * 1024 };
+	std::vector<void*> v;
+	size_t misaligned = 0;
+	for (size_t align : aligns)
+	{
+		for (size_t size : sizes)
+		{
+			for (int i = 0; i < 8; i++)
+			{
+				void* ptr = ConcurrentAlignedAlloc(size, align);
+				if ((reinterpret_cast<size_t>(ptr) & (align - 1)) != 0)
+				{
+					misaligned++;
+				}
+				memset(ptr, 0x5a, size);
+				v.push_back(ptr);
+			}
+		}
+	}
+	// 交错释放，让首尾多余的页和其他span合并
+	for (size_t i = 0; i < v.size(); i += 2)
+	{
+		ConcurrentFree(v[i]);
+	}
+	for (size_t i = 1; i < v.size(); i += 2)
+	{
+		ConcurrentFree(v[i]);
+	}
+	assert(misaligned == 0);
+	cout << "aligned alloc: " << v.size() << " allocations, misaligned: " << misaligned << endl;
+}
+
+// 测试STL适配器：容器释放时带上大小，申请和释放的统计要对得上，对齐要求比指针大的类型也要对齐
+void TestStlAdapters()
+{
+	struct alignas(64) CacheLine
+	{
+		char _data[64];
+	};
+	MallocStats before;
+	MallocExtension::GetMallocStats(before);
+	{
+		std::vector<int, Allocator<int>> v;
+		std::map<int, int, std::less<int>, Allocator<std::pair<const int, int>>> m;
+		std::list<CacheLine, Allocator<CacheLine>> l;
+		for (int i = 0; i < 100000; i++)
+		{
+			v.push_back(i);
+			m[i % 5000] += i;
+			if (i % 100 == 0)
+			{
+				l.emplace_back();
+				assert(reinterpret_cast<size_t>(&l.back()) % alignof(CacheLine) == 0);
+			}
+		}
+		for (int i = 0; i < 5000; i += 2)
+		{
+			m.erase(i);
+		}
+		assert(v.size() == 100000 && m.size() == 2500 && l.size() == 1000);
+
+		std::pmr::vector<int> pv(MemoryResource::GetInstance());
+		std::pmr::unordered_map<int, std::pmr::string> pm(MemoryResource::GetInstance());
+		for (int i = 0; i < 10000; i++)
+		{
+			pv.push_back(i);
+			pm[i] = std::pmr::string(100, 'a'); // 字符串也从同一个内存资源申请
+		}
+		assert(pm[9999].get_allocator().resource() == MemoryResource::GetInstance());
+
+		// 直接通过memory_resource按各种对齐申请
+		const size_t aligns[] = {1, 8, 16, 64, 4096, 16 * 1024};
+		std::pmr::memory_resource* res = MemoryResource::GetInstance();
+		for (size_t align : aligns)
+		{
+			for (size_t size : {1, 100, 5000, 300 * 1024})
+			{
+				void* ptr = res->allocate(size, align);
+				assert(reinterpret_cast<size_t>(ptr) % align == 0);
+				memset(ptr, 0x5a, size);
+				res->deallocate(ptr, size, align);
+			}
+		}
+		MemoryResource other;
+		assert(res->is_equal(other) && !res->is_equal(*std::pmr::new_delete_resource()));
+	}
+	MallocStats after;
+	MallocExtension::GetMallocStats(after);
+	assert(after._inUseBytes == before._inUseBytes);
+	cout << "stl adapters: in use " << before._inUseBytes << " -> " << after._inUseBytes << " bytes" << endl;
+}
+
+// 测试Arena：对齐、Reset之后只保留一个span并且同样的请求不再申请span，再和逐个释放比较耗时
+void TestArena()
+{
+	const size_t Rounds = 100;
+	const size_t N = 2000;
+	Arena arena;
+	std::vector<char*> ptrs;
+	for (size_t i = 0; i < N; i++)
+	{
+		size_t align = static_cast<size_t>(1) << (i % 7); // 1到64
+		char* ptr = static_cast<char*>(arena.Allocate(1 + i % 200, align));
+		assert(reinterpret_cast<size_t>(ptr) % align == 0);
+		memset(ptr, static_cast<int>(i), 1 + i % 200);
+		ptrs.push_back(ptr);
+	}
+	for (size_t i = 0; i < N; i++)
+	{
+		assert(ptrs[i][0] == static_cast<char>(i) && ptrs[i][i % 200] == static_cast<char>(i));
+	}
+	// 超过一页的对齐和单独占用span的大块内存
+	void* big = arena.Allocate(300 * 1024, 16 * 1024);
+	assert(reinterpret_cast<size_t>(big) % (16 * 1024) == 0);
+	memset(big, 1, 300 * 1024);
+	size_t used = arena.GetAllocatedBytes();
+	size_t spans = arena.GetSpanCount();
+	assert(spans > 1);
+
+	arena.Reset();
+	assert(arena.GetSpanCount() == 1 && arena.GetAllocatedBytes() == 0 && arena.GetHighWaterMark() == used);
+	for (size_t i = 0; i < N; i++)
+	{
+		arena.Allocate(1 + i % 200, static_cast<size_t>(1) << (i % 7));
+	}
+	arena.Allocate(300 * 1024, 16 * 1024);
+	assert(arena.GetSpanCount() == 1); // 保留的span放得下同样的一轮
+	arena.Reset();
+
+	// 通过pmr和标准分配器接口使用
+	{
+		std::pmr::vector<int> v(&arena);
+		std::pmr::map<int, std::pmr::string> m(&arena);
+		std::list<int, ArenaAllocator<int>> l{ArenaAllocator<int>(&arena)};
+		for (int i = 0; i < 10000; i++)
+		{
+			v.push_back(i);
+			l.push_back(i);
+			m[i % 100] = "arena";
+		}
+		assert(v[9999] == 9999 && l.back() == 9999 && m.size() == 100);
+	}
+	arena.Reset();
+
+	// 每轮申请N个对象后全部释放：逐个ConcurrentFree和一次Reset
+	std::vector<void*> v(N);
+	size_t begin1 = clock();
+	for (size_t j = 0; j < Rounds; j++)
+	{
+		for (size_t i = 0; i < N; i++)
+		{
+			v[i] = ConcurrentAlloc(16 + i % 200);
+		}
+		for (size_t i = 0; i < N; i++)
+		{
+			ConcurrentFree(v[i], 16 + i % 200);
+		}
+	}
+	size_t end1 = clock();
+	size_t begin2 = clock();
+	for (size_t j = 0; j < Rounds; j++)
+	{
+		for (size_t i = 0; i < N; i++)
+		{
+			v[i] = arena.Allocate(16 + i % 200);
+		}
+		arena.Reset();
+	}
+	size_t end2 = clock();
+	cout << "arena: " << spans << " spans -> " << arena.GetSpanCount() << " after reset, high water "
+		 << arena.GetHighWaterMark() << " bytes, free cost time:" << end1 - begin1
+		 << ", reset cost time:" << end2 - begin2 << endl;
+}
+
+// realloc：同一个桶内、大块内存原地扩展/收缩、mremap三种情况都检查数据是否保留
+// 再和申请+复制+释放的方式比较逐步扩大缓冲区的耗时
+void TestRealloc()
+{
+	const size_t MaxBytes = 64 * 1024 * 1024;
+	size_t moved = 0;
+	size_t steps = 0;
+	char* buf = static_cast<char*>(ConcurrentRealloc(nullptr, 1));
+	buf[0] = 'x';
+	size_t size = 1;
+	size_t begin1 = clock();
+	while (size < MaxBytes)
+	{
+		size_t newSize = size + size / 4 + 1; // 每次扩大25%，和常见的vector/string增长方式类似
+		char* newBuf = static_cast<char*>(ConcurrentRealloc(buf, newSize));
+		assert(newBuf[0] == 'x');
+		assert(size == 1 || newBuf[size - 1] == static_cast<char>(size));
+		if (newBuf != buf)
+		{
+			moved++;
+		}
+		buf = newBuf;
+		size = newSize;
+		buf[size - 1] = static_cast<char>(size); // 最后一个字节作为标记，下次扩大之后检查
+		steps++;
+	}
+	size_t end1 = clock();
+
+	// 从大到小收缩回去
+	while (size > 1)
+	{
+		size_t newSize = size / 3;
+		newSize = newSize == 0 ? 1 : newSize;
+		buf = static_cast<char*>(ConcurrentRealloc(buf, newSize));
+		assert(buf[0] == 'x');
+		size = newSize;
+	}
+	ConcurrentFree(buf);
+
+	// 同样的增长方式，每次都申请+复制+释放
+	size_t begin2 = clock();
+	buf = static_cast<char*>(ConcurrentAlloc(1));
+	size = 1;
+	while (size < MaxBytes)
+	{
+		size_t newSize = size + size / 4 + 1;
+		char* newBuf = static_cast<char*>(ConcurrentAlloc(newSize));
+		memcpy(newBuf, buf, size);
+		ConcurrentFree(buf);
+		buf = newBuf;
+		size = newSize;
+	}
+	ConcurrentFree(buf);
+	size_t end2 = clock();
+
+	cout << "realloc steps: " << steps << ", moved: " << moved << endl;
+	cout << "realloc cost time:" << end1 - begin1 << endl;
+	cout << "alloc+copy+free cost time:" << end2 - begin2 << endl;
+}
+
+// 统计接口：申请一批对象后检查计数器的变化，再输出一份报告
+void TestMallocStats()
+{
+	const size_t N = 10000;
+	const size_t Size = 100; // 落在104字节的桶里，每个对象浪费4字节
+
+	MallocStats before;
+	MallocExtension::GetMallocStats(before);
+	size_t index = SizeClass::Index(Size);
+
+	std::vector<void*> v;
+	for (size_t i = 0; i < N; i++)
+	{
+		v.push_back(ConcurrentAlloc(Size));
+	}
+	void* big = ConcurrentAlloc(1024 * 1024);
+
+	MallocStats after;
+	MallocExtension::GetMallocStats(after);
+	assert(after._classes[index]._allocs - before._classes[index]._allocs == N);
+	assert(after._classes[index]._spansInUse > 0);
+	assert(after._inUseBytes >= before._inUseBytes + N * SizeClass::RoundUp(Size) + 1024 * 1024);
+	assert(after._largeAllocs == before._largeAllocs + 1);
+
+	size_t mapped = 0;
+	size_t allocated = 0;
+	size_t wasted = 0;
+	bool ok = MallocExtension::GetNumericProperty("heap.mapped_bytes", &mapped);
+	ok = ok && MallocExtension::GetNumericProperty("generic.current_allocated_bytes", &allocated);
+	ok = ok && MallocExtension::GetNumericProperty("heap.internal_fragmentation_bytes", &wasted);
+	assert(ok && mapped >= allocated);
+	assert(!MallocExtension::GetNumericProperty("no.such.property", &mapped));
+
+	for (size_t i = 0; i < N; i++)
+	{
+		ConcurrentFree(v[i]);
+	}
+	ConcurrentFree(big);
+	MallocStats freed;
+	MallocExtension::GetMallocStats(freed);
+	assert(freed._classes[index]._frees - before._classes[index]._frees == N);
+	assert(freed._largeInUseBytes == before._largeInUseBytes);
+	// 没有其他线程在申请释放时，各部分加起来正好是向操作系统申请的字节数
+	assert(freed._inUseBytes + freed._pageCacheFreeBytes + freed._centralCacheFreeBytes + freed._transferCacheBytes
+		+ freed._frontCacheBytes + freed._metadataBytes == freed._mappedBytes);
+	assert(freed._metadataBytes > 0);
+
+	cout << "mapped: " << mapped << ", allocated: " << allocated << ", wasted: " << wasted << endl;
+	cout << MallocExtension::GetStats().substr(0, 1024);
+}
+
+// 两个调用点各自申请一批对象，采样估算的字节数应该和实际申请的接近
+__attribute__((noinline)) static void HeapProfileSiteA(std::vector<void*>& v)
+{
+	for (int i = 0; i < 20000; i++)
+	{
+		v.push_back(ConcurrentAlloc(512));
+	}
+}
+
+__attribute__((noinline)) static void HeapProfileSiteB(std::vector<void*>& v)
+{
+	for (int i = 0; i < 2000; i++)
+	{
+		v.push_back(ConcurrentAlloc(512));
+	}
+}
+
+void TestHeapProfiler()
+{
+	const size_t Rate = 64 * 1024;
+	size_t before = HeapProfiler::GetSampleCount();
+	HeapProfiler::SetSampleRate(Rate);
+
+	std::vector<void*> v;
+	HeapProfileSiteA(v);
+	HeapProfileSiteB(v);
+	size_t samples = HeapProfiler::GetSampleCount() - before;
+	// 一共申请了约11MB，期望采样约170次
+	assert(samples > 50 && samples < 500);
+
+	std::string text = HeapProfiler::DumpText();
+	std::string pprof = HeapProfiler::DumpPprof();
+	assert(pprof.compare(0, 13, "heap profile:") == 0);
+	assert(pprof.find("MAPPED_LIBRARIES:") != std::string::npos);
+
+	// 开启采样之后带size的释放也要能正确处理被采样的对象
+	for (size_t i = 0; i < v.size(); i++)
+	{
+		ConcurrentFree(v[i], 512);
+	}
+	assert(HeapProfiler::GetSampleCount() == before);
+	HeapProfiler::SetSampleRate(0);
+
+	cout << "heap samples: " << samples << endl;
+	cout << text.substr(0, text.find('\n') + 1);
+}
+
+#ifdef __linux__
+// 一直申请到拿到保护页对象为止，前面的普通对象不释放
+static char* NewGuardedObject(size_t size)
+{
+	while (true)
+	{
+		char* ptr = static_cast<char*>(ConcurrentAlloc(size));
+		if (GuardedPageAllocator::IsGuarded(ptr))
+		{
+			return ptr;
+		}
+	}
+}
+
+static void GuardedUseAfterFree()
+{
+	char* ptr = NewGuardedObject(32);
+	ConcurrentFree(ptr);
+	volatile char c = ptr[0];
+	(void)c;
+}
+
+// 对象在槽的开头时向前越界，在末尾时向后越界
+static void GuardedOverflow()
+{
+	char* ptr = NewGuardedObject(32);
+	if (reinterpret_cast<size_t>(ptr) % GuardedPageAllocator::GetSlotBytes() == 0)
+	{
+		ptr[-1] = 1;
+	}
+	else
+	{
+		ptr[32] = 1;
+	}
+}
+
+static void GuardedDoubleFree()
+{
+	char* ptr = NewGuardedObject(32);
+	ConcurrentFree(ptr);
+	ConcurrentFree(ptr);
+}
+
+// 在子进程中执行action，每次申请都使用保护页，返回标准错误输出和终止子进程的信号
+static std::string RunGuardedChild(void (*action)(), int* signal)
+{
+	int fds[2];
+	int ret = pipe(fds);
+	assert(ret == 0);
+	(void)ret;
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(fds[0]);
+		dup2(fds[1], STDERR_FILENO);
+		struct rlimit noCore = {0, 0};
+		setrlimit(RLIMIT_CORE, &noCore);
+		GuardedPageAllocator::SetSampleRate(1);
+		action();
+		_exit(0);
+	}
+	close(fds[1]);
+	std::string output;
+	char buf[4096];
+	ssize_t n;
+	while ((n = read(fds[0], buf, sizeof(buf))) > 0)
+	{
+		output.append(buf, n);
+	}
+	close(fds[0]);
+	int status = 0;
+	waitpid(pid, &status, 0);
+	*signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+	return output;
+}
+#endif
+
+// 保护页分配：被选中的对象都在保护区域中并且可以正常读写、调整大小和释放
+// 释放后使用、越界和重复释放在子进程中触发，检查进程被信号终止并输出了对应的报告
+void TestGuardedAlloc()
+{
+	GuardedPageAllocator::SetSampleRate(8);
+	size_t slotBytes = GuardedPageAllocator::GetSlotBytes();
+	std::vector<std::pair<char*, size_t>> v;
+	size_t guarded = 0;
+	for (size_t i = 0; i < 2000; i++)
+	{
+		size_t size = 1 + i * 37 % (slotBytes + 1024);
+		char* ptr = static_cast<char*>(ConcurrentAlloc(size));
+		if (GuardedPageAllocator::IsGuarded(ptr))
+		{
+			guarded++;
+			assert(size <= slotBytes);
+			// 放在槽末尾的对象也要按桶大小的最低位对齐
+			size_t rounded = SizeClass::RoundUp(size);
+			assert(reinterpret_cast<size_t>(ptr) % (rounded & (~rounded + 1)) == 0);
+		}
+		memset(ptr, static_cast<int>(i), size);
+		v.push_back(std::make_pair(ptr, size));
+	}
+	// 平均8次申请一次，槽用完之后照常申请
+	assert(guarded > 0 && guarded <= GUARDED_SLOTS);
+	assert(GuardedPageAllocator::GetGuardedCount() == guarded);
+
+	// 保护页对象调整大小时只复制申请的大小
+	for (size_t i = 0; i < v.size(); i++)
+	{
+		if (GuardedPageAllocator::IsGuarded(v[i].first))
+		{
+			unsigned char c = static_cast<unsigned char>(i);
+			char* ptr = static_cast<char*>(ConcurrentRealloc(v[i].first, v[i].second + 100000));
+			assert(static_cast<unsigned char>(ptr[0]) == c && static_cast<unsigned char>(ptr[v[i].second - 1]) == c);
+			v[i].first = ptr;
+			v[i].second += 100000;
+			break;
+		}
+	}
+	for (size_t i = 0; i < v.size(); i++)
+	{
+		ConcurrentFree(v[i].first, v[i].second);
+	}
+	assert(GuardedPageAllocator::GetGuardedCount() == 0);
+	GuardedPageAllocator::SetSampleRate(0);
+
+#ifdef __linux__
+	int signal = 0;
+	std::string report = RunGuardedChild(GuardedUseAfterFree, &signal);
+	assert(signal == SIGSEGV);
+	assert(report.find("use-after-free") != std::string::npos);
+	assert(report.find("allocated by thread") != std::string::npos && report.find("freed by thread") != std::string::npos);
+
+	report = RunGuardedChild(GuardedOverflow, &signal);
+	assert(signal == SIGSEGV);
+	assert(report.find("buffer overflow") != std::string::npos || report.find("buffer underflow") != std::string::npos);
+
+	report = RunGuardedChild(GuardedDoubleFree, &signal);
+	assert(signal == SIGABRT);
+	assert(report.find("double free") != std::string::npos);
+	cout << "guarded objects: " << guarded << ", report:" << endl
+		 << report.substr(0, report.find('\n') + 1);
+#endif
+}
+
+// 之前手工划分的桶，只用来和编译期生成的桶对比浪费的内存
+static size_t LegacyRoundUp(size_t bytes)
+{
+	size_t align = bytes <= 128 ? 8 : bytes <= 1024 ? 16 : bytes <= 8 * 1024 ? 128 : bytes <= 64 * 1024 ? 1024 : 8 * 1024;
+	return SizeClass::_RoundUp(bytes, align);
+}
+
+static size_t LegacyNumMovePage(size_t bytes)
+{
+	size_t pages = (SizeClass::ComputeBatch(bytes) * bytes) >> PAGE_SHIFT;
+	return pages == 0 ? 1 : pages;
+}
+
+// 桶的映射：每个大小都落在能放下它的最小的桶里，再对比新旧两种划分浪费的内存
+void TestSizeClass()
+{
+	for (size_t bytes = 1; bytes <= MAX_SIZE; bytes++)
+	{
+		size_t index = SizeClass::Index(bytes);
+		assert(SizeClass::RoundUp(bytes) == SizeClass::ClassSize(index));
+		assert(SizeClass::ClassSize(index) >= bytes);
+		assert(index == 0 || SizeClass::ClassSize(index - 1) < bytes);
+	}
+
+	// span尾部切不出一个完整对象的部分，按每个桶统计
+	auto tailWaste = [](size_t size, size_t pages) {
+		size_t spanBytes = pages << PAGE_SHIFT;
+		return static_cast<double>(spanBytes % size) / spanBytes;
+	};
+	size_t legacyCount = 0;
+	double legacyMax = 0, legacyMaxSize = 0, legacySum = 0;
+	for (size_t size = 8; size <= MAX_SIZE; size = LegacyRoundUp(size + 1))
+	{
+		double waste = tailWaste(size, LegacyNumMovePage(size));
+		legacyCount++;
+		legacySum += waste;
+		if (waste > legacyMax)
+		{
+			legacyMax = waste;
+			legacyMaxSize = size;
+		}
+	}
+	double newMax = 0, newMaxSize = 0, newSum = 0;
+	for (size_t i = 0; i < NUM_FREELIST; i++)
+	{
+		const SizeClassInfo& info = sizeClassTable._classes[i];
+		double waste = tailWaste(info._size, info._pages);
+		assert(waste <= 1.0 / MAX_TAIL_WASTE_DIV);
+		newSum += waste;
+		if (waste > newMax)
+		{
+			newMax = waste;
+			newMaxSize = info._size;
+		}
+	}
+
+	// 向上取整浪费的内存，128字节以内两种划分相同，只统计更大的
+	double legacyRound = 0, newRound = 0;
+	for (size_t bytes = 129; bytes <= MAX_SIZE; bytes++)
+	{
+		legacyRound = std::max(legacyRound, 1.0 - static_cast<double>(bytes) / LegacyRoundUp(bytes));
+		newRound = std::max(newRound, 1.0 - static_cast<double>(bytes) / SizeClass::RoundUp(bytes));
+	}
+
+	printf("size classes: %zu -> %zu\n", legacyCount, NUM_FREELIST);
+	printf("span tail waste: max %.1f%% (%.0f bytes) avg %.2f%% -> max %.1f%% (%.0f bytes) avg %.2f%%\n",
+		   legacyMax * 100, legacyMaxSize, legacySum * 100 / legacyCount, newMax * 100, newMaxSize, newSum * 100 / NUM_FREELIST);
+	printf("round up waste above 128 bytes: max %.1f%% -> max %.1f%%\n", legacyRound * 100, newRound * 100);
+}
 
 int main()
 {
 	//TestMultiThread();
+	TestFixedMemPool();
 	TestBigAlloc();
+	TestSizedFree();
+	TestThreadExit();
+	TestThreadCacheBudget();
+	TestLazyCarve();
+	TestSpanOccupancy();
+	TestCrossThreadFree();
+	TestTransferCache();
+	TestCpuCache();
+	TestPageCacheSearch();
+	TestSpanCoalesce();
+	TestNumaHeaps();
+	TestReleaseFreeMemory();
+	TestHugePageTLB();
+	TestAlignedAlloc();
+	TestStlAdapters();
+	TestArena();
+	TestRealloc();
+	TestMallocStats();
+	TestHeapProfiler();
+	TestGuardedAlloc();
+	TestSizeClass();
 	return 0;
 }
\ No newline at end of file